@@ -3,13 +3,59 @@
 
 #include "windows.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #define DLL_FEATURE __declspec(dllexport)
 
 #define FCAL_STRF_LOOP 0
 
+#define FCAL_MAX_EMITTERS 4096
+#define FCAL_MAX_CHANNELS 8
+
+#define FCAL_FILTER_SLOTS 2
+
+#define FCAL_MAX_TAPS 8
+
+#define FCAL_MAX_ONESHOTS 256
+
+#define FCAL_WAVE_SINE 0
+#define FCAL_WAVE_SAW 1
+#define FCAL_WAVE_SQUARE 2
+#define FCAL_WAVE_TRIANGLE 3
+#define FCAL_WAVE_NOISE 4
+
+#define FCAL_STORAGE_NATIVE 0
+#define FCAL_STORAGE_INT16 1
+#define FCAL_STORAGE_MULAW 2
+
+#define FCAL_BANK_VERSION 2
+#define FCAL_BANK_ALIGNMENT 64
+
+#define FCAL_PEAK_BLOCK_FRAMES 256
+#define FCAL_MAX_MIP_LEVELS 4
+#define FCAL_SILENCE_THRESHOLD (1.0f / 65536)
+
+#define FCAL_EVENT_STARTED 0
+#define FCAL_EVENT_LOOPED 1
+#define FCAL_EVENT_ENDED 2
+#define FCAL_EVENT_STARVED 3
+#define FCAL_EVENT_CUE 4
+
+#define FCAL_EVENT_CAPACITY 1024
+
+#define FCAL_FILTER_NONE 0
+#define FCAL_FILTER_LOWPASS 1
+#define FCAL_FILTER_HIGHPASS 2
+#define FCAL_FILTER_BANDPASS 3
+#define FCAL_FILTER_LOWSHELF 4
+#define FCAL_FILTER_HIGHSHELF 5
+#define FCAL_FILTER_PEAKING 6
+
 namespace fcal
 {
     struct audio_task
@@ -19,10 +65,158 @@ namespace fcal
         unsigned int length, offset, type;
     };
 
+    class audio_stream;
+    class stream_reader;
+
+    struct play_cursor
+    {
+        double position;
+        unsigned int loops, starved;
+        stream_reader* reader;
+    };
+
+    struct stream_cue
+    {
+        double frame;
+        unsigned int id;
+    };
+
+    struct reader_slot;
+    struct loop_cache;
+
+    struct seek_request
+    {
+        audio_stream* stream;
+        double position;
+    };
+
+    struct play_request
+    {
+        audio_stream* stream;
+        double position;
+        reader_slot* slot;
+    };
+
+    struct oneshot_params
+    {
+        float volume, pitch, balance_left, balance_right, start;
+
+        oneshot_params() : volume(1), pitch(1), balance_left(1), balance_right(1), start(0) {}
+    };
+
+    struct filter_params
+    {
+        unsigned int type;
+        float frequency, q, gain;
+    };
+
+    struct voice_filter
+    {
+        float coefficients[FCAL_FILTER_SLOTS][5];
+        float z1[FCAL_FILTER_SLOTS][FCAL_MAX_CHANNELS], z2[FCAL_FILTER_SLOTS][FCAL_MAX_CHANNELS];
+        bool primed;
+    };
+
+    class audio_source;
+
+    struct playback_event
+    {
+        unsigned int type;
+        audio_source* source;
+        audio_stream* stream;
+        unsigned int value;
+    };
+
+    struct fft_setup;
+    struct spatial_state;
+    struct device_output;
+    struct oneshot_pool;
+    struct voice_table;
+    struct generator_state;
+    struct master_resampler;
+
+    class engine;
+
+    struct meter_levels
+    {
+        unsigned int channels;
+        float peak[FCAL_MAX_CHANNELS], rms[FCAL_MAX_CHANNELS];
+        unsigned int clips;
+    };
+
+    class DLL_FEATURE level_meter
+    {
+        public:
+            level_meter();
+
+            meter_levels get_levels();
+
+            void measure(const float* data, unsigned int frames, unsigned int channels);
+        private:
+            std::atomic<unsigned int> sequence, channels, clips;
+            std::atomic<float> peak[FCAL_MAX_CHANNELS], rms[FCAL_MAX_CHANNELS];
+    };
+
+    struct bank_header
+    {
+        char magic[4];
+        unsigned int version, count, alignment;
+    };
+
+    struct bank_entry
+    {
+        char name[48];
+        unsigned short format_tag, channels;
+        unsigned int sample_rate;
+        unsigned short bits_per_sample, reserved;
+        unsigned int data_offset, data_length, loop_start, loop_end;
+        unsigned int peak_offset, peak_blocks;
+    };
+
+    class DLL_FEATURE sound_bank
+    {
+        public:
+            sound_bank(std::string filepath);
+            ~sound_bank();
+
+            unsigned int get_count();
+            const unsigned char* get_data(unsigned int id);
+            const bank_entry* get_entry(unsigned int id);
+            const float* get_peaks(unsigned int id);
+            std::string get_filepath();
+
+            int find(std::string name);
+
+            bool is_valid();
+        private:
+            std::string filepath;
+            bool success_init;
+
+            HANDLE file, mapping;
+            const unsigned char* view;
+            unsigned long long size;
+
+            const bank_header* header;
+            const bank_entry* entries;
+    };
+
+    class DLL_FEATURE stream_reader
+    {
+        public:
+            virtual ~stream_reader() {}
+
+            virtual unsigned int read(void* buffer, unsigned int bytes) = 0;
+            virtual bool seek(unsigned int offset) = 0;
+            virtual unsigned int size() = 0;
+    };
+
     class DLL_FEATURE audio_stream
     {
         public:
             audio_stream(std::string filepath);
+            audio_stream(sound_bank* bank, unsigned int id);
+            audio_stream(const void* data, unsigned int size);
+            audio_stream(stream_reader* reader);
             ~audio_stream();
 
             float get_balance_left();
@@ -30,32 +224,285 @@ namespace fcal
             float get_pitch();
             float get_volume();
 
+            float get_duration();
+            WAVEFORMATEX get_format();
+
+            unsigned int get_loop_count();
+            unsigned int get_loop_crossfade();
+            unsigned int get_loop_end();
+            unsigned int get_loop_start();
+            unsigned int get_peak_blocks();
+            unsigned int get_storage();
+
             bool get_flag(unsigned int flag);
 
             void toggle_flag(unsigned int flag);
 
+            bool has_filter();
+            bool is_resident();
             bool is_valid();
 
+            bool load_resident(unsigned int storage = FCAL_STORAGE_NATIVE);
+
+            bool build_mips(unsigned int levels = FCAL_MAX_MIP_LEVELS);
+            unsigned int get_mip_levels();
+
+            const float* get_filter_coefficients(unsigned int sample_rate);
+
+            unsigned int mix(play_cursor& cursor, unsigned int frames, WAVEFORMATEX* native_format, float pitch_master, const float* gains, float* out, bool* end,
+                unsigned int frame_stride = 0, unsigned int channel_stride = 1);
             float* pull(unsigned int& frame_offset, unsigned int frames, WAVEFORMATEX* native_format, bool* end, float pitch_master);
 
             void set_balance(float left, float right);
+            void set_filter(unsigned int slot, unsigned int type, float frequency, float q, float gain_db);
+            void set_loop_count(unsigned int count);
+            void set_loop_crossfade(unsigned int frames);
+            void set_loop_points(unsigned int start, unsigned int end);
             void set_pitch(float val);
             void set_volume(float val);
+
+            void add_cue(float seconds, unsigned int id);
+            void clear_cues();
+            unsigned int get_cue_count();
         private:
+            friend class audio_source;
+            friend class engine;
+
             std::string filepath;
             bool success_init;
 
-            void apply_balance(float* data, unsigned int data_size);
+            const unsigned char* memory;
+            unsigned char* resident;
+            stream_reader* reader;
+            stream_reader* decoder;
+            stream_reader* external;
+            const unsigned char* encoded;
+            unsigned int encoded_size;
+
+            reader_slot* reader_slots;
+            std::mutex reader_lock, source_lock;
+
+            reader_slot* acquire_reader();
+            stream_reader* open_reader();
+
+            std::atomic<engine*> bound_engine;
+            bool bind(engine* e);
+
+            void init_defaults();
             void apply_pitch(float* data, unsigned int data_size, int channels);
-            void apply_volume(float* data, unsigned int data_size);
 
-            void read_wav_header();
+            void read_wav_header(stream_reader* in);
+            bool open_vorbis(stream_reader* in, bool owned);
+            unsigned int read_frames(const unsigned char* memory, stream_reader* source, unsigned int first, unsigned int count, unsigned char* dst);
+            void loop_region(unsigned int& start, unsigned int& end, unsigned int& crossfade);
+            loop_cache* build_loop_cache();
+            void update_loop_cache();
+            void build_peaks();
 
             WAVEFORMATEX file_format;
             unsigned int length, file_data_offset;
+            unsigned int storage, sample_bytes;
 
             float volume, balance_left, balance_right, pitch;
             bool* flags;
+
+            float* channel_matrix;
+            unsigned int matrix_channels;
+
+            unsigned int loop_start, loop_end, loop_count, loop_crossfade;
+
+            std::vector<stream_cue> cues;
+
+            const float* peaks;
+            float* peak_map;
+            unsigned int peak_blocks;
+
+            unsigned char* mips;
+            const unsigned char* mip_data[FCAL_MAX_MIP_LEVELS];
+            unsigned int mip_count;
+
+            loop_cache* cache;
+            loop_cache* next_cache;
+            loop_cache* old_cache;
+            std::atomic<bool> cache_ready;
+            std::mutex cache_lock;
+
+            filter_params filters[FCAL_FILTER_SLOTS];
+            float filter_coefficients[FCAL_FILTER_SLOTS * 5];
+            unsigned int filter_rate;
+            bool filter_dirty;
+    };
+
+    class load_batch;
+
+    typedef void (*load_callback)(load_batch* batch, void* user);
+
+    class DLL_FEATURE load_batch
+    {
+        public:
+            load_batch(const std::vector<std::string>& filepaths, bool resident, load_callback callback, void* user);
+            ~load_batch();
+
+            unsigned int get_count();
+            unsigned int get_loaded();
+            unsigned int get_failed();
+            audio_stream* get_stream(unsigned int index);
+
+            bool is_done();
+
+            void load(unsigned int index);
+            void wait();
+        private:
+            std::vector<std::string> filepaths;
+            std::vector<audio_stream*> streams;
+            bool resident;
+
+            load_callback callback;
+            void* user;
+
+            std::atomic<unsigned int> loaded, failed;
+            bool done;
+
+            std::mutex lock;
+            std::condition_variable finished;
+    };
+
+    class DLL_FEATURE convolver
+    {
+        public:
+            convolver(audio_stream* impulse_response, unsigned int partition_size = 256, engine* host = NULL);
+            ~convolver();
+
+            unsigned int get_channels();
+            unsigned int get_latency();
+            unsigned int get_sample_rate();
+            unsigned int get_tail_frames();
+
+            bool is_valid();
+
+            void process(float* data, unsigned int frames);
+
+            void set_mix(float dry, float wet);
+        private:
+            bool success_init;
+
+            void load_impulse_response(audio_stream* impulse_response, WAVEFORMATEX* format);
+            void run_block(unsigned int channel);
+
+            fft_setup* fft;
+            unsigned int block, bins, partitions, channels, sample_rate, position, slot;
+
+            float* ir_spectra;
+            float* fdl;
+            float* input;
+            float* output;
+            float* accum;
+            float* time;
+
+            float dry, wet;
+    };
+
+    class DLL_FEATURE audio_tap
+    {
+        public:
+            audio_tap(unsigned int capacity_frames);
+            ~audio_tap();
+
+            unsigned int get_available();
+            unsigned int get_channels();
+            unsigned int get_dropped();
+            unsigned int get_sample_rate();
+
+            unsigned int read(float* out, unsigned int frames);
+            void write(const float* data, unsigned int frames, unsigned int channels, unsigned int sample_rate);
+        private:
+            float* ring;
+            unsigned int capacity;
+
+            std::atomic<unsigned int> channels, sample_rate, dropped;
+            std::atomic<unsigned long long> read_position, write_position;
+    };
+
+    class DLL_FEATURE spectrum_analyzer
+    {
+        public:
+            spectrum_analyzer(audio_tap* tap, unsigned int size = 2048);
+            ~spectrum_analyzer();
+
+            unsigned int get_bins();
+            float get_bin_frequency(unsigned int bin);
+            unsigned int get_spectrum(float* magnitudes);
+
+            bool is_valid();
+
+            bool update();
+        private:
+            audio_tap* tap;
+            bool success_init;
+
+            fft_setup* fft;
+            unsigned int size, position;
+
+            float* history;
+            float* window;
+            float* frame;
+            float* spectrum_re;
+            float* spectrum_im;
+            float* block;
+            float window_gain;
+
+            std::atomic<unsigned int> sequence, sample_rate;
+            std::atomic<float>* magnitudes;
+    };
+
+    class DLL_FEATURE wav_writer
+    {
+        public:
+            wav_writer(audio_tap* tap, std::string filepath);
+            ~wav_writer();
+
+            unsigned long long get_frames_written();
+
+            bool is_valid();
+
+            void stop();
+        private:
+            void run();
+            void finish_header();
+
+            audio_tap* tap;
+            std::string filepath;
+            bool success_init;
+
+            FILE* file;
+            unsigned int channels, sample_rate;
+            std::atomic<unsigned long long> frames_written;
+
+            std::atomic<bool> running;
+            std::thread* thread;
+    };
+
+    class DLL_FEATURE generator_bank
+    {
+        public:
+            generator_bank(unsigned int capacity = 16);
+            ~generator_bank();
+
+            unsigned int get_capacity();
+            unsigned int get_count();
+
+            bool is_playing();
+
+            int add(unsigned int waveform, float frequency, float amplitude = 1, float duration = 0);
+            void remove(unsigned int id);
+            void clear();
+
+            void set_amplitude(unsigned int id, float amplitude);
+            void set_frequency(unsigned int id, float frequency);
+
+            void render(float* out, unsigned int frames, unsigned int channels, const float* gains, unsigned int sample_rate, float pitch = 1);
+        private:
+            generator_state* state;
     };
 
     class DLL_FEATURE audio_source
@@ -72,38 +519,239 @@ namespace fcal
             unsigned int get_stream_list_size();
             audio_task* get_task();
 
+            meter_levels get_levels();
+
+            bool has_tail();
             bool is_playing();
 
             void renew_task(unsigned int frame_length, WAVEFORMATEX* format);
 
-            void play(audio_stream* stream);
+            void play(audio_stream* stream, float start = 0);
+            void seek(audio_stream* stream, float seconds);
             void stop(audio_stream* stream);
 
+            float tell(audio_stream* stream);
+
             void set_balance(float left, float right);
             void set_volume(float val);
             void set_pitch(float val);
+
+            void set_convolver(convolver* conv);
+            void set_generators(generator_bank* bank);
+            void set_metering(bool enabled);
+            void set_tap(audio_tap* tap);
+            void set_filter(unsigned int slot, unsigned int type, float frequency, float q, float gain_db);
+
+            void set_spatial(bool enabled);
+            void set_doppler(bool enabled);
+            void set_position(float x, float y, float z);
+            void set_velocity(float x, float y, float z);
+            void set_distance(float min_distance, float max_distance, float rolloff);
         private:
-            std::vector<audio_stream*> streams;
-            std::vector<unsigned int> stream_offsets;
+            friend class engine;
+
+            void sync_emitter();
+            void reserve(unsigned int frames, unsigned int channels);
 
+            voice_table* voices;
+            voice_table* spare_voices;
+            voice_table* retired_voices;
+            unsigned int voice_capacity;
+            std::atomic<unsigned int> voice_count;
+
+            std::vector<float> quad;
+
+            std::vector<play_request> play_requests;
             std::vector<audio_stream*> stop_requests;
+            std::vector<seek_request> seek_requests;
+
+            std::vector<audio_stream*> published_streams;
+            std::vector<double> published_positions;
 
-            void apply_balance(float* data, unsigned int data_size);
-            void apply_volume(float* data, unsigned int data_size);
+            std::mutex request_lock;
 
             audio_task* task;
+            unsigned int task_capacity;
 
             float volume, balance_left, balance_right, pitch;
+            unsigned int emitter, tail;
+
+            engine* owner;
+            float position[3], velocity[3], min_distance, max_distance, rolloff;
+            bool spatial, doppler;
+
+            std::atomic<convolver*> conv;
+            std::atomic<bool> conv_busy;
+            generator_bank* generators;
+            std::atomic<audio_tap*> tap;
+            std::atomic<bool> tap_busy;
+
+            level_meter meter;
+            bool metering;
+
+            filter_params filters[FCAL_FILTER_SLOTS];
+            voice_filter source_filter;
+            float filter_coefficients[FCAL_FILTER_SLOTS * 5];
+            unsigned int filter_rate;
+            bool filter_dirty;
+    };
+
+    class DLL_FEATURE engine
+    {
+        public:
+            engine();
+            ~engine();
+
+            void open(unsigned int requested_buffer_time);
+            void open_offline(unsigned int sample_rate, unsigned int channels);
+            void close();
+
+            bool is_open();
+
+            WAVEFORMATEX get_format();
+
+            void render(float* out, unsigned int frames);
+
+            void play_test_sound(unsigned int ms);
+
+            bool play_oneshot(audio_stream* stream, const oneshot_params& params = oneshot_params());
+            unsigned int get_oneshot_count();
+
+            void register_source(audio_source* source);
+            void remove_source(audio_source* source);
+
+            void set_render_ahead(unsigned int blocks, unsigned int block_ms = 10);
+            unsigned int get_underrun_count();
+
+            void set_mix_rate(unsigned int sample_rate);
+            unsigned int get_mix_rate();
+
+            void set_adaptive_latency(unsigned int target_ms);
+            float get_latency();
+
+            bool poll_event(playback_event& event);
+
+            float get_balance_left();
+            float get_balance_right();
+            float get_pitch();
+            float get_volume();
+
+            void set_balance(float left, float right);
+            void set_pitch(float value);
+            void set_volume(float value);
+
+            void set_convolver(convolver* conv);
+
+            meter_levels get_levels();
+            void set_metering(bool enabled);
+
+            bool add_tap(audio_tap* tap);
+            void remove_tap(audio_tap* tap);
+
+            void set_listener_position(float x, float y, float z);
+            void set_listener_orientation(float forward_x, float forward_y, float forward_z, float up_x, float up_y, float up_z);
+            void set_listener_velocity(float x, float y, float z);
+            void set_doppler_factor(float factor);
+            void set_speed_of_sound(float speed);
+
+            void commit_spatial();
+        private:
+            friend class audio_source;
+
+            HRESULT wasapi_init();
+            HRESULT thread_open();
+            void open_mix(unsigned int frames);
+            void adapt_latency(bool missed, unsigned int frames);
+            void publish_sources();
+            void push_event(unsigned int type, audio_source* source, audio_stream* stream, unsigned int value);
+            void post_voice_events(audio_source* source, audio_stream* stream, bool& started, const play_cursor& from, const play_cursor& to,
+                bool end);
+
+            void mix_output(float* data, unsigned int frames);
+            void mix_block(float* data, unsigned int frames);
+            void mix_oneshots(float* data, unsigned int frames);
+            void mix_thread_run();
+            unsigned int ring_available();
+            void read_ring(unsigned char* data, unsigned int frames);
+            void write_buffer(unsigned char* data, unsigned int frames);
+
+            std::thread* audio_thread;
+            std::atomic<bool> active;
+            bool offline;
+
+            int req_buffer_ms, buffer_duration_ms;
+            double frame_per_msec;
+            WAVEFORMATEX* format;
+            WAVEFORMATEX offline_format;
+
+            unsigned int mix_rate;
+            WAVEFORMATEX mix_format;
+            master_resampler* resampler;
+            unsigned int max_frames, max_mix_frames;
+            float* output;
+
+            device_output* device;
+
+            std::vector<audio_source*> sources;
+            std::vector<audio_source*> source_list, next_sources;
+            std::atomic<bool> sources_ready;
+            std::mutex source_lock;
+
+            generator_bank* tones;
+
+            float master_volume, master_pitch, master_balance_left, master_balance_right;
+
+            std::atomic<convolver*> master_convolver;
+            std::atomic<bool> convolver_busy;
+
+            level_meter master_meter;
+            bool master_metering;
+
+            std::atomic<audio_tap*> master_taps[FCAL_MAX_TAPS];
+            std::atomic<bool> taps_busy;
+
+            unsigned int ahead_blocks, ahead_block_ms, ring_frames, block_frames;
+            float* ring;
+            std::atomic<unsigned long long> ring_read, ring_write;
+            std::atomic<unsigned int> underruns;
+            std::thread* mix_thread;
+
+            unsigned int adaptive_ms, queue_min, queue_max, queue_step, stable_frames;
+            std::atomic<unsigned int> queue_frames;
+            std::atomic<bool> late;
+
+            playback_event events[FCAL_EVENT_CAPACITY];
+            std::atomic<unsigned int> event_read, event_write;
+
+            spatial_state* spatial;
+            oneshot_pool* oneshots;
     };
 
+    DLL_FEATURE engine* get_default_engine();
+
     DLL_FEATURE void open(unsigned int requested_buffer_time);
     DLL_FEATURE void close();
 
     DLL_FEATURE void play_test_sound(unsigned int ms);
 
+    DLL_FEATURE bool play_oneshot(audio_stream* stream, const oneshot_params& params = oneshot_params());
+
+    DLL_FEATURE load_batch* load_async(const std::vector<std::string>& filepaths, bool resident = false, load_callback callback = NULL, void* user = NULL);
+    DLL_FEATURE void set_loader_threads(unsigned int count);
+
     DLL_FEATURE void register_source(audio_source* source);
     DLL_FEATURE void remove_source(audio_source* source);
 
+    DLL_FEATURE void set_render_ahead(unsigned int blocks, unsigned int block_ms = 10);
+    DLL_FEATURE unsigned int get_underrun_count();
+
+    DLL_FEATURE void set_mix_rate(unsigned int sample_rate);
+
+    DLL_FEATURE void set_adaptive_latency(unsigned int target_ms);
+    DLL_FEATURE float get_latency();
+
+    DLL_FEATURE bool poll_event(playback_event& event);
+
     DLL_FEATURE void disable_info_print();
     DLL_FEATURE void enable_info_print();
 
@@ -115,6 +763,22 @@ namespace fcal
     DLL_FEATURE void set_balance(float left, float right);
     DLL_FEATURE void set_pitch(float value);
     DLL_FEATURE void set_volume(float value);
+
+    DLL_FEATURE void set_convolver(convolver* conv);
+
+    DLL_FEATURE meter_levels get_levels();
+    DLL_FEATURE void set_metering(bool enabled);
+
+    DLL_FEATURE bool add_tap(audio_tap* tap);
+    DLL_FEATURE void remove_tap(audio_tap* tap);
+
+    DLL_FEATURE void set_listener_position(float x, float y, float z);
+    DLL_FEATURE void set_listener_orientation(float forward_x, float forward_y, float forward_z, float up_x, float up_y, float up_z);
+    DLL_FEATURE void set_listener_velocity(float x, float y, float z);
+    DLL_FEATURE void set_doppler_factor(float factor);
+    DLL_FEATURE void set_speed_of_sound(float speed);
+
+    DLL_FEATURE void commit_spatial();
 }
 
 #endif
\ No newline at end of file
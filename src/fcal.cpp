@@ -1,9 +1,19 @@
 #include "fcal.h"
 
+#include <atomic>
+#include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <deque>
 #include <iostream>
 #include <thread>
 
+#include <xmmintrin.h>
+
+#ifdef FCAL_VORBIS
+#include <vorbis/vorbisfile.h>
+#endif
+
 #include "comdef.h"
 
 #include "mmdeviceapi.h"
@@ -27,101 +37,213 @@ float util_lerp(float a, float b, float x)
     return (b - a) * x + a;
 }
 
-//Converting bytes to floats. To be used for .WAV files, specifically, as this function will convert 8/16/24 bit integers to floats, or simply
-//copy 32-bit floats over.
-void conv_bytes_to_floats(float* data, unsigned char* bytes, int data_size, int bytes_per_float)
+//Converts one sample to little-endian bytes. 8-bit samples are written as signed values, as they always have been on output.
+template<unsigned int BYTES> inline void float_to_bytes(float f, unsigned char* b)
 {
-    for(int i = 0; i < data_size / bytes_per_float; i++)
-    {
-        int bi = i * bytes_per_float;
-        int se = 0;
-        switch(bytes_per_float)
-        {
-            case 1:
-                data[i] = (float) ((signed char) bytes[bi]) / 128 - 1;
-                break;
-            case 2:
-                data[i] = (float) ((signed short) (bytes[bi] + bytes[bi + 1] * 256)) / 32768;
-                break;
-            case 3:
-                se = (bytes[bi] + bytes[bi + 1] * 256 + bytes[bi + 2] * 65536);
-                if(se >= 8388608) se -= 16777216;
-                data[i] = (float) se / 8388608;
-                break;
-            case 4:
-                memcpy(&data[i], bytes + bi, 4);
-                break;
-            default:
-                std::cerr << "Cannot convert " << bytes_per_float << " to a float." << std::endl;
-                break;
-        }
-    }
+    int si = f * (float) (1 << (BYTES * 8 - 1));
+    for(unsigned int i = 0; i < BYTES; i++)
+        b[i] = si >> (i * 8);
+}
+
+template<> inline void float_to_bytes<4>(float f, unsigned char* b)
+{
+    memcpy(b, &f, 4);
+}
+
+template<unsigned int BYTES> void floats_to_bytes(unsigned char* data, const float* floats, int count)
+{
+    for(int i = 0; i < count; i++)
+        float_to_bytes<BYTES>(floats[i], data + i * BYTES);
 }
 
 //Converting floats to bytes. This function will likely only be used for final output. Will convert to 8/16/24 bit integers or 32-bit floats
 //depending on the 'bytes_per_float' value.
 void conv_floats_to_bytes(unsigned char* data, float* floats, int float_array_size, int bytes_per_float)
 {
-    for(int i = 0; i < float_array_size; i++)
+    switch(bytes_per_float)
     {
-        int bi = i * bytes_per_float;
+        case 1: floats_to_bytes<1>(data, floats, float_array_size); break;
+        case 2: floats_to_bytes<2>(data, floats, float_array_size); break;
+        case 3: floats_to_bytes<3>(data, floats, float_array_size); break;
+        case 4: floats_to_bytes<4>(data, floats, float_array_size); break;
+        default:
+            std::cerr << "Unsupported float to byte conversion: " << bytes_per_float << std::endl;
+            break;
+    }
+}
 
-        int si;
-        unsigned char* p;
-        
-        switch(bytes_per_float)
+/*
+Channel layouts follow the standard WAVE_FORMAT_EXTENSIBLE speaker order for each channel count: mono (FC), stereo (FL FR), quad
+(FL FR BL BR), 5.1 (FL FR FC LFE BL BR) and 7.1 (FL FR FC LFE BL BR SL SR). Other channel counts are mapped one to one.
+*/
+#define SPK_FL 0
+#define SPK_FR 1
+#define SPK_FC 2
+#define SPK_LFE 3
+#define SPK_BL 4
+#define SPK_BR 5
+#define SPK_SL 6
+#define SPK_SR 7
+
+#define MATRIX_STRIDE 8
+#define MATRIX_SIZE (FCAL_MAX_CHANNELS * MATRIX_STRIDE)
+
+#define DOWNMIX_GAIN 0.70710678f
+
+//Fills 'speakers' with the speaker at each channel index. Returns false if the channel count has no standard layout.
+bool channel_layout(unsigned int channels, int* speakers)
+{
+    static const int mono[] = { SPK_FC };
+    static const int stereo[] = { SPK_FL, SPK_FR };
+    static const int quad[] = { SPK_FL, SPK_FR, SPK_BL, SPK_BR };
+    static const int surround51[] = { SPK_FL, SPK_FR, SPK_FC, SPK_LFE, SPK_BL, SPK_BR };
+    static const int surround71[] = { SPK_FL, SPK_FR, SPK_FC, SPK_LFE, SPK_BL, SPK_BR, SPK_SL, SPK_SR };
+
+    const int* layout;
+    switch(channels)
+    {
+        case 1: layout = mono; break;
+        case 2: layout = stereo; break;
+        case 4: layout = quad; break;
+        case 6: layout = surround51; break;
+        case 8: layout = surround71; break;
+        default: return false;
+    }
+
+    for(unsigned int i = 0; i < channels; i++)
+        speakers[i] = layout[i];
+    return true;
+}
+
+//Adds 'speaker' at 'gain' to the matrix column, folding it into neighbouring speakers if the destination layout doesn't have it.
+void route_speaker(int speaker, float gain, const int* dst_index, float* column)
+{
+    if(dst_index[speaker] >= 0)
+    {
+        column[dst_index[speaker]] += gain;
+        return;
+    }
+
+    switch(speaker)
+    {
+        case SPK_FL:
+        case SPK_FR:
+            route_speaker(SPK_FC, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        case SPK_FC:
+            route_speaker(SPK_FL, gain * DOWNMIX_GAIN, dst_index, column);
+            route_speaker(SPK_FR, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        case SPK_BL:
+            if(dst_index[SPK_SL] >= 0) route_speaker(SPK_SL, gain, dst_index, column);
+            else route_speaker(SPK_FL, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        case SPK_BR:
+            if(dst_index[SPK_SR] >= 0) route_speaker(SPK_SR, gain, dst_index, column);
+            else route_speaker(SPK_FR, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        case SPK_SL:
+            if(dst_index[SPK_BL] >= 0) route_speaker(SPK_BL, gain, dst_index, column);
+            else route_speaker(SPK_FL, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        case SPK_SR:
+            if(dst_index[SPK_BR] >= 0) route_speaker(SPK_BR, gain, dst_index, column);
+            else route_speaker(SPK_FR, gain * DOWNMIX_GAIN, dst_index, column);
+            break;
+        default:
+            break; //The LFE channel is dropped when the destination has no subwoofer.
+    }
+}
+
+/*
+Builds the up/down-mix matrix from src_channels to dst_channels. The matrix is stored column by column: the gains of source channel 's' on
+every destination channel start at matrix[s * MATRIX_STRIDE]. Mono sources are played at full gain on both front speakers when the
+destination has no center speaker, like the old behaviour.
+*/
+void build_channel_matrix(unsigned int src_channels, unsigned int dst_channels, float* matrix)
+{
+    for(unsigned int i = 0; i < MATRIX_SIZE; i++)
+        matrix[i] = 0;
+
+    int src_speakers[FCAL_MAX_CHANNELS], dst_speakers[FCAL_MAX_CHANNELS];
+    if(!channel_layout(src_channels, src_speakers) || !channel_layout(dst_channels, dst_speakers))
+    {
+        for(unsigned int s = 0; s < src_channels; s++)
+            for(unsigned int d = 0; d < dst_channels; d++)
+                if(s == d || src_channels == 1)
+                    matrix[s * MATRIX_STRIDE + d] = 1;
+        return;
+    }
+
+    int dst_index[8];
+    for(int i = 0; i < 8; i++)
+        dst_index[i] = -1;
+    for(unsigned int d = 0; d < dst_channels; d++)
+        dst_index[dst_speakers[d]] = d;
+
+    if(src_channels == 1 && dst_index[SPK_FC] < 0)
+    {
+        matrix[dst_index[SPK_FL]] = 1;
+        matrix[dst_index[SPK_FR]] = 1;
+        return;
+    }
+
+    for(unsigned int s = 0; s < src_channels; s++)
+        route_speaker(src_speakers[s], 1, dst_index, matrix + s * MATRIX_STRIDE);
+}
+
+//Spreads a left/right balance over any channel layout: left-side speakers get 'left', right-side speakers get 'right', and center and
+//LFE speakers get the average of both.
+void channel_gains(unsigned int channels, float left, float right, float* gains)
+{
+    int speakers[FCAL_MAX_CHANNELS];
+    if(!channel_layout(channels, speakers))
+    {
+        for(unsigned int c = 0; c < channels; c++)
+            gains[c] = (c % 2 == 0) ? left : right;
+        return;
+    }
+
+    for(unsigned int c = 0; c < channels; c++)
+    {
+        switch(speakers[c])
         {
-            case 1:
-                si = floats[i] * 128;
-                data[bi] = si;
-                break;
-            case 2:
-                si = floats[i] * 32768;
-                data[bi] = si;
-                data[bi + 1] = si >> 8;
-                break;
-            case 3:
-                si = floats[i] * 8388608;
-                data[bi] = si;
-                data[bi + 1] = si >> 8;
-                data[bi + 2] = si >> 16;
-                break;
-            case 4:
-                p = reinterpret_cast<unsigned char*>(&floats[i]);
-                for(int j = 0; j < 4; j++)
-                    data[bi + j] = p[j];
-                break;
-            default:
-                std::cerr << "Unsupported float to byte conversion: " << bytes_per_float << std::endl;
-                return;
+            case SPK_FL: case SPK_BL: case SPK_SL: gains[c] = left; break;
+            case SPK_FR: case SPK_BR: case SPK_SR: gains[c] = right; break;
+            default: gains[c] = (left + right) * 0.5f; break;
         }
     }
 }
 
-//Converts a stream with current->nChannels to a stream with result->nChannels. This function currently simply copies the first channel of the current
-//data stream however many times it needs, or omits other channels in the stream.
-void conv_channels(WAVEFORMATEX* current, WAVEFORMATEX* result, float** data, unsigned int* data_size)
+//Multiplies one frame of src_channels samples by a channel matrix and adds the dst_channels results to 'out', 'channel_stride' floats apart.
+//Each source sample is broadcast and multiplied by its matrix column, so all destination channels are computed at once.
+inline void mix_frame(const float* matrix, const float* in, float* out, unsigned int src_channels, unsigned int dst_channels, unsigned int channel_stride)
 {
-    int current_channels = current->nChannels;
-    int result_channels = result->nChannels;
-    
-    int frames = *data_size / (current_channels);
-    float* new_data = new float[frames * result_channels];
+    alignas(16) float result[MATRIX_STRIDE];
 
-    for(int i = 0; i < frames; i++)
-    {
-        int current_offset = i * current_channels;
-        int result_offset = i * result_channels;
+    __m128 lo = _mm_setzero_ps();
+    __m128 hi = _mm_setzero_ps();
 
-        for(int k = 0; k < result_channels; k++)
+    if(dst_channels <= 4)
+    {
+        for(unsigned int s = 0; s < src_channels; s++)
+            lo = _mm_add_ps(lo, _mm_mul_ps(_mm_load_ps(matrix + s * MATRIX_STRIDE), _mm_set1_ps(in[s])));
+    }
+    else
+    {
+        for(unsigned int s = 0; s < src_channels; s++)
         {
-            new_data[result_offset + k] = (*data)[current_offset];
+            __m128 x = _mm_set1_ps(in[s]);
+            lo = _mm_add_ps(lo, _mm_mul_ps(_mm_load_ps(matrix + s * MATRIX_STRIDE), x));
+            hi = _mm_add_ps(hi, _mm_mul_ps(_mm_load_ps(matrix + s * MATRIX_STRIDE + 4), x));
         }
     }
 
-    delete[] data[0];
-    *data = new_data;
-    *data_size = frames * result_channels;
+    _mm_store_ps(result, lo);
+    _mm_store_ps(result + 4, hi);
+
+    for(unsigned int d = 0; d < dst_channels; d++)
+        out[d * channel_stride] += result[d];
 }
 
 //Currently unused. Converts a stream with current->wBitsPerSample to a stream with result->wBitsPerSample. Since the audio pipeline works with 32-bit floats,
@@ -238,828 +360,6104 @@ void conv_sample_rate(WAVEFORMATEX* current, WAVEFORMATEX* result, float* data,
     delete[] current_data;
 }
 
-fcal::audio_stream::audio_stream(std::string filepath) : filepath(filepath)
+/*
+Biquad filters use the RBJ audio EQ cookbook formulas, normalized so a0 = 1. Coefficients are stored as b0, b1, b2, a1, a2 and run in
+transposed direct form II:
+    y = b0 * x + z1
+    z1 = b1 * x - a1 * y + z2
+    z2 = b2 * x - a2 * y
+An empty slot gets the identity filter (b0 = 1, everything else 0).
+*/
+void design_biquad(const fcal::filter_params& p, unsigned int sample_rate, float* c)
 {
-    success_init = false;
-
-    volume = 1;
-    balance_left = 1;
-    balance_right = 1;
-    pitch = 1;
-
-    if(filepath.substr(filepath.length() - 4) == ".wav")
-    {
-        read_wav_header();
-    }
-    else
+    c[0] = 1;
+    c[1] = c[2] = c[3] = c[4] = 0;
+    if(p.type == FCAL_FILTER_NONE || sample_rate == 0) return;
+
+    double frequency = p.frequency;
+    if(frequency < 10) frequency = 10;
+    if(frequency > sample_rate * 0.49) frequency = sample_rate * 0.49;
+    double q = p.q < 0.05f ? 0.05 : p.q;
+
+    double w0 = 2 * 3.14159265358979323846 * frequency / sample_rate;
+    double cw = std::cos(w0), sw = std::sin(w0);
+    double alpha = sw / (2 * q);
+    double a = std::pow(10.0, p.gain / 40);
+    double sa = 2 * std::sqrt(a) * alpha;
+
+    double b0, b1, b2, a0, a1, a2;
+    switch(p.type)
     {
-        std::cerr << "File type unsupported: " << filepath << std::endl;
+        case FCAL_FILTER_LOWPASS:
+            b0 = (1 - cw) / 2; b1 = 1 - cw; b2 = (1 - cw) / 2;
+            a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+            break;
+        case FCAL_FILTER_HIGHPASS:
+            b0 = (1 + cw) / 2; b1 = -(1 + cw); b2 = (1 + cw) / 2;
+            a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+            break;
+        case FCAL_FILTER_BANDPASS:
+            b0 = alpha; b1 = 0; b2 = -alpha;
+            a0 = 1 + alpha; a1 = -2 * cw; a2 = 1 - alpha;
+            break;
+        case FCAL_FILTER_LOWSHELF:
+            b0 = a * ((a + 1) - (a - 1) * cw + sa); b1 = 2 * a * ((a - 1) - (a + 1) * cw); b2 = a * ((a + 1) - (a - 1) * cw - sa);
+            a0 = (a + 1) + (a - 1) * cw + sa; a1 = -2 * ((a - 1) + (a + 1) * cw); a2 = (a + 1) + (a - 1) * cw - sa;
+            break;
+        case FCAL_FILTER_HIGHSHELF:
+            b0 = a * ((a + 1) + (a - 1) * cw + sa); b1 = -2 * a * ((a - 1) + (a + 1) * cw); b2 = a * ((a + 1) + (a - 1) * cw - sa);
+            a0 = (a + 1) - (a - 1) * cw + sa; a1 = 2 * ((a - 1) - (a + 1) * cw); a2 = (a + 1) - (a - 1) * cw - sa;
+            break;
+        case FCAL_FILTER_PEAKING:
+            b0 = 1 + alpha * a; b1 = -2 * cw; b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a; a1 = -2 * cw; a2 = 1 - alpha / a;
+            break;
+        default:
+            std::cerr << "Unknown filter type: " << p.type << std::endl;
+            return;
     }
 
-    flags = new bool[1];
-    for(int i = 0; i < 1; i++)
-        flags[i] = false;
+    c[0] = b0 / a0;
+    c[1] = b1 / a0;
+    c[2] = b2 / a0;
+    c[3] = a1 / a0;
+    c[4] = a2 / a0;
 }
 
-fcal::audio_stream::~audio_stream()
+bool is_identity_biquad(const float* c)
 {
-    delete[] flags;
+    return c[0] == 1 && c[1] == 0 && c[2] == 0 && c[3] == 0 && c[4] == 0;
 }
 
-//Applies the balance modifier to the float stream.
-void fcal::audio_stream::apply_balance(float* data, unsigned int data_size)
+/*
+Filters four voices at once, one per SSE lane. 'data' is a quad buffer: for every frame and channel, the samples of the four voices are
+stored next to each other. Each voice's coefficients ramp linearly from the values used last block to 'targets' over the block, so
+parameter changes don't click. Lanes without a voice pass NULL.
+*/
+void filter_quad(float* data, unsigned int frames, unsigned int channels, fcal::voice_filter** voices, const float** targets)
 {
-    for(unsigned int i = 0; i < data_size; i += 2)
+    for(unsigned int slot = 0; slot < FCAL_FILTER_SLOTS; slot++)
     {
-        data[i] *= balance_left;
-        data[i + 1] *= balance_right;
-    }
-}
-
-void fcal::audio_stream::apply_pitch(float* data, unsigned int data_size, int channels)
-{
-    float* current_data = new float[data_size];
-    for(unsigned int i = 0; i < data_size; i++)
-        current_data[i] = data[i];
+        alignas(16) float start[5][4], delta[5][4];
+        alignas(16) float z1[FCAL_MAX_CHANNELS][4], z2[FCAL_MAX_CHANNELS][4];
+        bool active = false;
 
-    double point = 0;
-    int size_of_point = channels;
-
-    for(unsigned int i = 0; i < data_size; i += size_of_point)
-    {
-        for(unsigned int c = 0; c < channels; c++)
+        for(unsigned int l = 0; l < 4; l++)
         {
-            int si = (int) point * size_of_point + c;
-            int ei = (int) point * size_of_point + c + size_of_point;
+            fcal::voice_filter* v = voices[l];
+            const float* target = v ? targets[l] + slot * 5 : NULL;
 
-            float start, end;
-            start = current_data[si];
-            end = current_data[ei];
+            if(v && !v->primed)
+            {
+                for(unsigned int k = 0; k < 5; k++)
+                    v->coefficients[slot][k] = target[k];
+                for(unsigned int c = 0; c < channels; c++)
+                    v->z1[slot][c] = v->z2[slot][c] = 0;
+            }
 
-            float offset = point - (int) point;
+            for(unsigned int k = 0; k < 5; k++)
+            {
+                start[k][l] = v ? v->coefficients[slot][k] : (k == 0 ? 1 : 0);
+                delta[k][l] = v ? (target[k] - start[k][l]) / frames : 0;
+            }
 
-            float p = util_lerp(start, end, offset);
-            data[i + c] = p;
+            for(unsigned int c = 0; c < channels; c++)
+            {
+                z1[c][l] = v ? v->z1[slot][c] : 0;
+                z2[c][l] = v ? v->z2[slot][c] : 0;
+            }
+
+            if(v && (!is_identity_biquad(v->coefficients[slot]) || !is_identity_biquad(target)))
+                active = true;
         }
 
-        point += pitch;
-    }
+        if(!active) continue;
 
-    delete[] current_data;
-}
+        __m128 b0 = _mm_load_ps(start[0]), b1 = _mm_load_ps(start[1]), b2 = _mm_load_ps(start[2]);
+        __m128 a1 = _mm_load_ps(start[3]), a2 = _mm_load_ps(start[4]);
+        __m128 db0 = _mm_load_ps(delta[0]), db1 = _mm_load_ps(delta[1]), db2 = _mm_load_ps(delta[2]);
+        __m128 da1 = _mm_load_ps(delta[3]), da2 = _mm_load_ps(delta[4]);
 
-//Applies the volume modifier to the float stream.
-void fcal::audio_stream::apply_volume(float* data, unsigned int data_size)
-{
-    for(unsigned int i = 0; i < data_size; i++)
-    {
-        data[i] *= volume;
-    }
-}
+        float* p = data;
+        for(unsigned int f = 0; f < frames; f++)
+        {
+            b0 = _mm_add_ps(b0, db0);
+            b1 = _mm_add_ps(b1, db1);
+            b2 = _mm_add_ps(b2, db2);
+            a1 = _mm_add_ps(a1, da1);
+            a2 = _mm_add_ps(a2, da2);
 
-float fcal::audio_stream::get_balance_left()
-{
-    return balance_left;
-}
+            for(unsigned int c = 0; c < channels; c++)
+            {
+                __m128 x = _mm_loadu_ps(p);
+                __m128 s1 = _mm_load_ps(z1[c]);
+                __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), s1);
 
-float fcal::audio_stream::get_balance_right()
-{
-    return balance_right;
-}
+                _mm_store_ps(z1[c], _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), _mm_load_ps(z2[c])));
+                _mm_store_ps(z2[c], _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y)));
+                _mm_storeu_ps(p, y);
 
-float fcal::audio_stream::get_pitch()
-{
-    return pitch;
-}
+                p += 4;
+            }
+        }
 
-float fcal::audio_stream::get_volume()
-{
-    return volume;
-}
+        for(unsigned int l = 0; l < 4; l++)
+        {
+            fcal::voice_filter* v = voices[l];
+            if(!v) continue;
 
-bool fcal::audio_stream::get_flag(unsigned int flag)
-{
-    return flags[flag];
-}
+            for(unsigned int k = 0; k < 5; k++)
+                v->coefficients[slot][k] = targets[l][slot * 5 + k];
+            for(unsigned int c = 0; c < channels; c++)
+            {
+                v->z1[slot][c] = z1[c][l];
+                v->z2[slot][c] = z2[c][l];
+            }
+        }
+    }
 
-bool fcal::audio_stream::is_valid()
-{
-    return success_init;
+    for(unsigned int l = 0; l < 4; l++)
+        if(voices[l]) voices[l]->primed = true;
 }
 
-//Pulls a subset of data out of a .WAV file and converts to a float stream compliant with the native_format format and modifiers such as gain/balance. This function
-//is accessed by the audio buffer loop to play an audio stream.
-float* fcal::audio_stream::pull(unsigned int& frame_offset, unsigned int frames, WAVEFORMATEX* native_format, bool* end, float pitch_master)
+//Filters a quad buffer and adds each voice in it to the interleaved 'out' buffer.
+void mix_quad(float* quad, unsigned int frames, unsigned int channels, fcal::voice_filter** voices, const float** targets, float* out)
 {
-    FILE* file = fopen(filepath.c_str(), "rb");
-
-    unsigned int frame_size = file_format.nChannels * file_format.wBitsPerSample / 8;
-    unsigned int data_offset = file_data_offset + frame_offset * frame_size;
-    fseek(file, data_offset, SEEK_CUR); //Go to data begin.
+    filter_quad(quad, frames, channels, voices, targets);
 
-    float sample_modifier = ((float) file_format.nSamplesPerSec / (float) native_format->nSamplesPerSec) * pitch * pitch_master;
-
-    unsigned int remaining = length - (data_offset - file_data_offset);
-    unsigned int frames_to_sample = frames * sample_modifier;
-    unsigned int sample_data_size = (frames_to_sample + 8) * frame_size; //We add an extra 8 frames at the end to account for any precision and rounding error.
-    unsigned int data_size = frames * frame_size;
-    unsigned int read_size = 0;
-    
-    if(remaining < sample_data_size)
-    {
-        read_size = remaining;
-        *end = true;
-    }
-    else
+    for(unsigned int l = 0; l < 4; l++)
     {
-        read_size = sample_data_size;
-        *end = false;
+        if(!voices[l]) continue;
+        for(unsigned int j = 0; j < frames * channels; j++)
+            out[j] += quad[j * 4 + l];
     }
+}
 
-    unsigned char raw_data[sample_data_size];
-    fread(raw_data, 1, read_size, file);
-    fclose(file);
-
-    if(read_size < sample_data_size)
+//Filters one interleaved buffer (a source's mix) through its filter slots, one channel at a time. Coefficients ramp like in filter_quad().
+void filter_interleaved(float* data, unsigned int frames, unsigned int channels, fcal::voice_filter* state, const float* targets)
+{
+    for(unsigned int slot = 0; slot < FCAL_FILTER_SLOTS; slot++)
     {
-        for(unsigned int i = read_size; i < sample_data_size; i++)
+        const float* target = targets + slot * 5;
+        float* current = state->coefficients[slot];
+
+        if(!state->primed)
         {
-            raw_data[i] = 0;
+            for(unsigned int k = 0; k < 5; k++)
+                current[k] = target[k];
+            for(unsigned int c = 0; c < channels; c++)
+                state->z1[slot][c] = state->z2[slot][c] = 0;
         }
-    }
-
-    int bytes_per_float = file_format.wBitsPerSample / 8;
-    float* initial_data = new float[sample_data_size / bytes_per_float];
-
-    conv_bytes_to_floats(initial_data, raw_data, sample_data_size, bytes_per_float);
-
-    unsigned int conv_size = sample_data_size / bytes_per_float;
-    if(file_format.nChannels != native_format->nChannels)
-    {
-        //Convert to (most likely) stereo channel.
-        conv_channels(&file_format, native_format, &initial_data, &conv_size); //Shoutout heap corruption.
-        data_size *= (float) native_format->nChannels / (float) file_format.nChannels;
-    }
 
-    unsigned int final_size = data_size / bytes_per_float;
-    float* data = new float[final_size];
-    float point = 0;
+        if(is_identity_biquad(current) && is_identity_biquad(target)) continue;
 
-    int size_of_point = native_format->nChannels;
-
-    for(unsigned int i = 0; i < final_size; i += size_of_point)
-    {
-        for(unsigned int c = 0; c < size_of_point; c++)
+        for(unsigned int c = 0; c < channels; c++)
         {
-            int si = (int) point * size_of_point + c;
-            int ei = (int) point * size_of_point + c + size_of_point;
-
-            //if(si >= conv_size) si = conv_size - size_of_point + c;
-            //if(ei >= conv_size) ei = conv_size - size_of_point + c;
+            float b0 = current[0], b1 = current[1], b2 = current[2], a1 = current[3], a2 = current[4];
+            float db0 = (target[0] - b0) / frames, db1 = (target[1] - b1) / frames, db2 = (target[2] - b2) / frames;
+            float da1 = (target[3] - a1) / frames, da2 = (target[4] - a2) / frames;
+            float z1 = state->z1[slot][c], z2 = state->z2[slot][c];
 
-            float start, end;
-            start = initial_data[si];
-            end = initial_data[ei];
+            for(unsigned int f = 0; f < frames; f++)
+            {
+                b0 += db0; b1 += db1; b2 += db2; a1 += da1; a2 += da2;
 
-            float offset = point - (int) point;
+                float x = data[f * channels + c];
+                float y = b0 * x + z1;
+                z1 = b1 * x - a1 * y + z2;
+                z2 = b2 * x - a2 * y;
+                data[f * channels + c] = y;
+            }
 
-            float p = util_lerp(start, end, offset);
-            data[i + c] = p;
+            state->z1[slot][c] = z1;
+            state->z2[slot][c] = z2;
         }
 
-        point += sample_modifier;
+        for(unsigned int k = 0; k < 5; k++)
+            current[k] = target[k];
     }
 
-    delete[] initial_data;
-    
-    apply_volume(data, final_size);
-    apply_balance(data, final_size);
-
-    //If you don't make sure the offset moves by the right interval, the audio will stop working altogether.
-    frame_offset += read_size / frame_size - 8;
-
-    return data;
+    state->primed = true;
 }
 
-void skip_if_junk(FILE* file, std::vector<unsigned int>& offsets, std::vector<unsigned int>& sizes)
+//stream_reader over a file. Used for streams created from a filepath.
+class file_reader : public fcal::stream_reader
 {
-    if(offsets.size() != 0 && offsets[0] == (unsigned int) ftell(file))
-    {
-        fseek(file, sizes[0], SEEK_CUR);
+    public:
+        file_reader() : file(NULL), length(0) {}
 
-        offsets.erase(offsets.begin());
-        sizes.erase(sizes.begin());
-    }
-}
-
-//Obtains necessary information from the .WAV file header.
-void fcal::audio_stream::read_wav_header()
-{
-    FILE* file = fopen(filepath.c_str(), "rb");
-    if(!file)
-    {
-        std::cerr << "Invalid file filepath! " << filepath << std::endl;
-        return;
-    }
+        file_reader(std::string filepath) : file(NULL), length(0)
+        {
+            open(filepath);
+        }
 
-    //Checking for JUNK chunks in the .WAV header.
+        bool open(std::string filepath)
+        {
+            file = fopen(filepath.c_str(), "rb");
+            if(file)
+            {
+                fseek(file, 0, SEEK_END);
+                length = ftell(file);
+                fseek(file, 0, SEEK_SET);
+            }
+            return file != NULL;
+        }
 
-    std::vector<unsigned int> ignore_offsets, ignore_sizes;
+        ~file_reader()
+        {
+            if(file) fclose(file);
+        }
 
-    char junk_check[256];
-    fread(junk_check, sizeof(char), 256, file);
+        bool is_open()
+        {
+            return file != NULL;
+        }
 
-    unsigned int loop_size = 256 - 4;
-    for(unsigned int i = 0; i < loop_size; i++)
-    {
-        char name[5];
-        name[4] = '\0';
-        for(int j = 0; j < 4; j++)
-            name[j] = junk_check[i + j];
-        
-        if(strcmp(name, "JUNK") == 0)
+        unsigned int read(void* buffer, unsigned int bytes)
         {
-            unsigned int ig_size;
+            return fread(buffer, 1, bytes, file);
+        }
 
-            ig_size += junk_check[i + 4];
-            ig_size += junk_check[i + 5] * 256;
-            ig_size += junk_check[i + 6] * 256 * 256;
-            ig_size += junk_check[i + 7] * 256 * 256 * 256;
+        bool seek(unsigned int offset)
+        {
+            return fseek(file, offset, SEEK_SET) == 0;
+        }
 
-            ignore_offsets.push_back(i);
-            ignore_sizes.push_back(ig_size + 8);
+        unsigned int size()
+        {
+            return length;
+        }
+    private:
+        FILE* file;
+        unsigned int length;
+};
+
+//stream_reader over a caller-owned memory span. Used to parse the header of streams created from memory, and to read Ogg Vorbis data held
+//in memory.
+class memory_reader : public fcal::stream_reader
+{
+    public:
+        memory_reader(const unsigned char* data, unsigned int length) : data(data), length(length), offset(0) {}
 
-            loop_size += ig_size + 8;
-            i += ig_size + 7;
-            continue;
+        unsigned int read(void* buffer, unsigned int bytes)
+        {
+            if(bytes > length - offset) bytes = length - offset;
+            memcpy(buffer, data + offset, bytes);
+            offset += bytes;
+            return bytes;
         }
 
-        if(strcmp(name, "data") == 0)
+        bool seek(unsigned int position)
         {
-            break;
+            if(position > length) return false;
+            offset = position;
+            return true;
         }
-    }
 
-    fseek(file, 0, SEEK_SET);
+        unsigned int size()
+        {
+            return length;
+        }
+    private:
+        const unsigned char* data;
+        unsigned int length, offset;
+};
 
-    /*
-    WAV files are formatted as follows:
-    Bytes 1-4: "RIFF" tag (char[4])
-    Bytes 5-8: Size (32-bit integer (DWORD/unsigned int))
-    Bytes 9-12: "WAVE" tag (char[4])
-    Bytes 13-16: "fmt " tag (char[4])
-    Bytes 17-20: Chunk size (32-bit integer)
-    Bytes 21-22: Format type (16-bit integer (short))
-    Bytes 23-24: # of channels (16-bit integer)
-    Bytes 25-28: Sample rate (32-bit integer)
-    Bytes 29-32: Average bytes/sec (32-bit integer)
-    Bytes 33-34: Bytes per sample (16-bit integer)
-    Bytes 35-36: Bits per sample (16-bit integer)
-    Bytes 37-40: "data" tag (char[4])
-    Bytes 41-44: Data Size (32-bit integer)
-    Bytes 45+: Data
-    */
-
-    char wav_type[4];
-
-    fread(wav_type, sizeof(char), 4, file);
-
-    if(strcmp(wav_type, "RIFF") < 0)
-    {
-        std::cerr << "Invalid .WAV type: " << filepath << std::endl;
-        std::cerr << "Reads: " << wav_type << std::endl;
-        return;
-    }
+#ifdef FCAL_VORBIS
+/*
+Ogg Vorbis decoding, built with FCAL_VORBIS defined (and linked with libvorbisfile, libvorbis and libogg). A vorbis_reader is a
+stream_reader over the decoded audio: it looks like the data chunk of a 16-bit PCM .WAV file, so mixing, loops, resident loading and
+everything else work on it unchanged, and it decodes only what's read. The compressed data comes from another stream_reader (a file,
+memory or the caller's).
+
+mix() reads every chunk at an exact frame, and a chunk starts on (or one frame before) where the previous one ended, so the last bytes
+decoded are kept in a small window and reads are served from it first. Reads a little ahead of the decoder decode forward; anything else
+is a seek: libvorbisfile bisects to the right Ogg page, then decodes forward to the exact frame. Memory stays bounded by the decoder's own
+state and the window, however long the stream is. Each voice has its own vorbis_reader (see acquire_reader()), so voices don't seek each
+other's decoder.
+*/
+#define VORBIS_WINDOW_BYTES 16384
+#define VORBIS_SKIP_BYTES 65536
 
-    fseek(file, sizeof(DWORD), SEEK_CUR); //skip the file length.
-    fread(wav_type, sizeof(char), 4, file);
+class vorbis_reader : public fcal::stream_reader
+{
+    public:
+        //If 'shared' is given, other decoders read the same source: every read then seeks it first, holding the lock.
+        vorbis_reader(fcal::stream_reader* source, bool owned, std::mutex* shared = NULL) : source(source), owned(owned), shared(shared),
+            source_offset(0), valid(false)
+        {
+            offset = decoded = window_fill = 0;
+            channels = rate = length = 0;
 
-    if(strcmp(wav_type, "WAVE") < 0)
-    {
-        std::cerr << "WAVE tag not present: " << filepath << std::endl;
+            if(shared)
+            {
+                std::lock_guard<std::mutex> guard(*shared);
+                source_size = source->size();
+            }
+            else
+            {
+                source_size = source->size();
+                source->seek(0);
+            }
+
+            ov_callbacks callbacks = { read_source, seek_source, NULL, tell_source };
+            if(ov_open_callbacks(this, &file, NULL, 0, callbacks) != 0) return;
+
+            //Chained files are read with the format of their first link.
+            vorbis_info* info = ov_info(&file, 0);
+            ogg_int64_t frames = ov_pcm_total(&file, -1);
+            if(!info || info->channels <= 0 || info->channels > FCAL_MAX_CHANNELS || frames < 0
+                || frames * info->channels * 2 > 0xFFFFFFFFu)
+            {
+                ov_clear(&file);
+                return;
+            }
+
+            channels = info->channels;
+            rate = info->rate;
+            length = (unsigned int) frames * channels * 2;
+            valid = true;
+        }
+
+        ~vorbis_reader()
+        {
+            if(valid) ov_clear(&file);
+            if(owned) delete source;
+        }
+
+        bool is_valid()
+        {
+            return valid;
+        }
+
+        unsigned int get_channels()
+        {
+            return channels;
+        }
+
+        unsigned int get_rate()
+        {
+            return rate;
+        }
+
+        //Reads a loop point stored as a comment ("LOOPSTART", "LOOPEND" or "LOOPLENGTH", in frames), the convention of most game tools.
+        bool get_comment(const char* name, unsigned int& value)
+        {
+            char* text = vorbis_comment_query(ov_comment(&file, 0), name, 0);
+            if(!text) return false;
+            value = (unsigned int) strtoul(text, NULL, 10);
+            return true;
+        }
+
+        unsigned int read(void* buffer, unsigned int bytes)
+        {
+            unsigned char* out = (unsigned char*) buffer;
+            unsigned int frame_bytes = channels * 2;
+            unsigned int done = 0;
+
+            if(bytes > length - offset) bytes = offset < length ? length - offset : 0;
+
+            while(done < bytes)
+            {
+                //Served from the window.
+                if(offset < decoded && decoded - offset <= window_fill)
+                {
+                    unsigned int n = decoded - offset < bytes - done ? decoded - offset : bytes - done;
+                    memcpy(out + done, window + window_fill - (decoded - offset), n);
+                    done += n;
+                    offset += n;
+                    continue;
+                }
+
+                //Behind the window, or too far ahead to decode up to: seek.
+                if(offset < decoded || offset - decoded > VORBIS_SKIP_BYTES)
+                {
+                    if(ov_pcm_seek(&file, offset / frame_bytes) != 0) break;
+                    decoded = offset - offset % frame_bytes;
+                    window_fill = 0;
+                }
+
+                if(!decode()) break;
+            }
+
+            return done;
+        }
+
+        bool seek(unsigned int position)
+        {
+            if(position > length) return false;
+            offset = position;
+            return true;
+        }
+
+        unsigned int size()
+        {
+            return length;
+        }
+    private:
+        //Decodes the next packet into the window, dropping its oldest bytes to make room.
+        bool decode()
+        {
+            char pcm[4096];
+            int section;
+            long got;
+
+            do got = ov_read(&file, pcm, sizeof(pcm), 0, 2, 1, &section);
+            while(got == OV_HOLE);
+
+            if(got <= 0) return false;
+
+            if(window_fill + got > VORBIS_WINDOW_BYTES)
+            {
+                unsigned int keep = VORBIS_WINDOW_BYTES - got;
+                memmove(window, window + window_fill - keep, keep);
+                window_fill = keep;
+            }
+
+            memcpy(window + window_fill, pcm, got);
+            window_fill += got;
+            decoded += got;
+            return true;
+        }
+
+        static size_t read_source(void* buffer, size_t size, size_t count, void* user)
+        {
+            vorbis_reader* r = (vorbis_reader*) user;
+            unsigned int got;
+            if(r->shared)
+            {
+                std::lock_guard<std::mutex> guard(*r->shared);
+                got = r->source->seek(r->source_offset) ? r->source->read(buffer, size * count) : 0;
+            }
+            else got = r->source->read(buffer, size * count);
+            r->source_offset += got;
+            return size ? got / size : 0;
+        }
+
+        static int seek_source(void* user, ogg_int64_t position, int whence)
+        {
+            vorbis_reader* r = (vorbis_reader*) user;
+            ogg_int64_t target = position;
+            if(whence == SEEK_CUR) target += r->source_offset;
+            if(whence == SEEK_END) target += r->source_size;
+            if(target < 0 || target > r->source_size) return -1;
+            if(!r->shared && !r->source->seek((unsigned int) target)) return -1;
+
+            r->source_offset = (unsigned int) target;
+            return 0;
+        }
+
+        static long tell_source(void* user)
+        {
+            return ((vorbis_reader*) user)->source_offset;
+        }
+
+        fcal::stream_reader* source;
+        bool owned;
+        std::mutex* shared;
+        unsigned int source_offset, source_size;
+
+        OggVorbis_File file;
+        bool valid;
+        unsigned int channels, rate, length;
+
+        unsigned int offset, decoded;
+        unsigned char window[VORBIS_WINDOW_BYTES];
+        unsigned int window_fill;
+};
+#endif
+
+//Returns true if the reader's data starts like an Ogg file.
+bool is_ogg(fcal::stream_reader* in)
+{
+    char tag[4];
+    return in->seek(0) && in->read(tag, 4) == 4 && memcmp(tag, "OggS", 4) == 0;
+}
+
+fcal::audio_stream::audio_stream(std::string filepath) : filepath(filepath)
+{
+    init_defaults();
+
+    std::string extension = filepath.length() >= 4 ? filepath.substr(filepath.length() - 4) : "";
+
+    if(extension == ".wav")
+    {
+        file_reader file(filepath);
+        if(!file.is_open())
+        {
+            std::cerr << "Invalid file filepath! " << filepath << std::endl;
+            return;
+        }
+
+        read_wav_header(&file);
+    }
+    else if(extension == ".ogg")
+    {
+        file_reader* file = new file_reader(filepath);
+        if(!file->is_open())
+        {
+            std::cerr << "Invalid file filepath! " << filepath << std::endl;
+            delete file;
+            return;
+        }
+
+        open_vorbis(file, true);
+    }
+    else
+    {
+        std::cerr << "File type unsupported: " << filepath << std::endl;
+    }
+}
+
+//Creates a stream from a .WAV or Ogg Vorbis file already in memory. The data isn't copied, so it must stay valid for the life of the stream.
+fcal::audio_stream::audio_stream(const void* data, unsigned int size) : filepath("<memory>")
+{
+    init_defaults();
+
+    memory_reader in((const unsigned char*) data, size);
+    if(is_ogg(&in))
+    {
+        //The compressed data is decoded in place, so it must outlive the stream like a .WAV's would.
+        encoded = (const unsigned char*) data;
+        encoded_size = size;
+        open_vorbis(new memory_reader(encoded, encoded_size), true);
         return;
     }
 
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(wav_type, sizeof(char), 4, file);
+    read_wav_header(&in);
 
-    if(strcmp(wav_type, "fmt ") < 0)
+    if(success_init)
     {
-        std::cerr << "Invalid .WAV format: " << filepath << std::endl;
+        memory = (const unsigned char*) data + file_data_offset;
+        build_peaks();
+    }
+}
+
+//Creates a stream that reads a .WAV or Ogg Vorbis file through a caller-supplied reader, for data that lives in archives or other custom
+//storage. The reader is only used from one thread at a time (the audio thread while playing, and for an Ogg Vorbis file, the thread that
+//plays it while a voice's decoder opens), and must outlive the stream.
+fcal::audio_stream::audio_stream(stream_reader* reader) : filepath("<reader>")
+{
+    init_defaults();
+
+    if(!reader)
+    {
+        std::cerr << "Invalid stream reader!" << std::endl;
         return;
     }
 
-    unsigned int chunk_size;
-    unsigned short format_type;
+    if(is_ogg(reader))
+    {
+        external = reader;
+        open_vorbis(reader, false);
+        return;
+    }
+
+    read_wav_header(reader);
+    this->reader = reader;
+}
+
+/*
+Opens an Ogg Vorbis stream on 'in', through a vorbis_reader that decodes it as 16-bit PCM at the file's rate and channel count. Loop points
+come from the LOOPSTART and LOOPEND (or LOOPLENGTH) comments, in frames. If 'owned', the reader is deleted with the stream (or right away
+if this fails). Without FCAL_VORBIS this only reports that Ogg Vorbis isn't supported.
+*/
+bool fcal::audio_stream::open_vorbis(stream_reader* in, bool owned)
+{
+#ifdef FCAL_VORBIS
+    vorbis_reader* vorbis = new vorbis_reader(in, owned, owned ? NULL : &source_lock);
+    if(!vorbis->is_valid())
+    {
+        std::cerr << "Invalid Ogg Vorbis stream: " << filepath << std::endl;
+        delete vorbis;
+        return false;
+    }
+
+    file_format.wFormatTag = 1; //WAVE_FORMAT_PCM
+    file_format.nChannels = vorbis->get_channels();
+    file_format.nSamplesPerSec = vorbis->get_rate();
+    file_format.wBitsPerSample = 16;
+    file_format.nBlockAlign = file_format.nChannels * 2;
+    file_format.nAvgBytesPerSec = file_format.nBlockAlign * file_format.nSamplesPerSec;
+    file_format.cbSize = 0;
+
+    sample_bytes = 2;
+    length = vorbis->size();
+    file_data_offset = 0;
 
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&chunk_size, sizeof(DWORD), 1, file);
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&format_type, sizeof(short), 1, file);
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&file_format.nChannels, sizeof(WORD), 1, file);
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&file_format.nSamplesPerSec, sizeof(DWORD), 1, file);
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&file_format.nAvgBytesPerSec, sizeof(DWORD), 1, file);
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fseek(file, 2, SEEK_CUR); //skip the file length.
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(&file_format.wBitsPerSample, sizeof(WORD), 1, file);
+    unsigned int start, end;
+    if(vorbis->get_comment("LOOPSTART", start))
+    {
+        unsigned int frames = length / file_format.nBlockAlign;
+        if(vorbis->get_comment("LOOPEND", end)) {}
+        else if(vorbis->get_comment("LOOPLENGTH", end)) end += start;
+        else end = frames;
 
-    skip_if_junk(file, ignore_offsets, ignore_sizes);
-    fread(wav_type, sizeof(char), 4, file);
+        if(end > frames) end = frames;
+        if(start < end)
+        {
+            loop_start = start;
+            loop_end = end;
+        }
+    }
 
     if(print_info)
     {
         std::cout << filepath << " loaded." << std::endl;
         std::cout << "   Sample rate: " << file_format.nSamplesPerSec << std::endl;
-        std::cout << "   Bit depth:   " << file_format.wBitsPerSample << std::endl;
+        std::cout << "   Bit depth:   " << file_format.wBitsPerSample << " (decoded)" << std::endl;
         std::cout << "   Channels:    " << file_format.nChannels << std::endl;
     }
 
-    if(strcmp(wav_type, "data") < 0)
+    reader = decoder = vorbis;
+    success_init = true;
+    return true;
+#else
+    std::cerr << "Ogg Vorbis support not compiled in (define FCAL_VORBIS): " << filepath << std::endl;
+    if(owned) delete in;
+    return false;
+#endif
+}
+
+//Creates a stream that plays asset 'id' of a sound bank straight from the bank's mapped memory, without any file access.
+fcal::audio_stream::audio_stream(sound_bank* bank, unsigned int id)
+{
+    init_defaults();
+
+    if(!bank || !bank->is_valid() || id >= bank->get_count())
     {
-        std::cerr << "Missing data: " << filepath << std::endl;
+        std::cerr << "Invalid sound bank asset: " << id << std::endl;
         return;
     }
 
-    fread(&length, sizeof(DWORD), 1, file);
-    file_data_offset = ftell(file);
+    const bank_entry* entry = bank->get_entry(id);
+    filepath = bank->get_filepath() + ":" + entry->name;
+
+    file_format.wFormatTag = entry->format_tag;
+    file_format.nChannels = entry->channels;
+    file_format.nSamplesPerSec = entry->sample_rate;
+    file_format.wBitsPerSample = entry->bits_per_sample;
+    file_format.nBlockAlign = entry->channels * entry->bits_per_sample / 8;
+    file_format.nAvgBytesPerSec = file_format.nBlockAlign * entry->sample_rate;
+    file_format.cbSize = 0;
+
+    memory = bank->get_data(id);
+    length = entry->data_length;
+    sample_bytes = entry->bits_per_sample / 8;
+    file_data_offset = 0;
+
+    loop_start = entry->loop_start;
+    loop_end = entry->loop_end;
+
+    peaks = bank->get_peaks(id);
+    peak_blocks = peaks ? entry->peak_blocks : 0;
 
     success_init = true;
-    
-    fclose(file);
 }
 
-//Sets the balance (gain in both the 'left' and 'right' speakers) of the audio stream.
-void fcal::audio_stream::set_balance(float left, float right)
+/*
+Voices that read a stream through a reader each get their own, so they never move each other's position in the file. Readers are pooled per
+stream: play() and play_oneshot() take a free one on the calling thread, opening a new one only when every one is in use, and the audio
+thread hands it back by clearing 'busy' when the voice ends. They're closed with the stream. Ogg Vorbis voices get a decoder each, over a
+new file or memory reader, or over the caller's reader, which they take turns on. .WAV streams read in place from memory, and .WAV streams
+over a caller's reader (which can't be duplicated), don't use the pool.
+*/
+struct fcal::reader_slot
 {
-    balance_left = left;
-    balance_right = right;
-}
+    fcal::stream_reader* reader;
+    std::atomic<bool> busy;
+    reader_slot* next;
+};
 
-void fcal::audio_stream::set_pitch(float val)
+//A loop cache (see build_loop_cache()): the crossfade tail and the loop head, and the loop region they were built for.
+struct fcal::loop_cache
 {
-    pitch = val;
+    std::vector<unsigned char> data;
+    unsigned int start, end, crossfade, head;
+};
+
+//Takes a free reader from the pool, or opens a new one. Returns NULL if the stream doesn't need one per voice.
+fcal::reader_slot* fcal::audio_stream::acquire_reader()
+{
+    if(!success_init || memory) return NULL;
+
+    std::lock_guard<std::mutex> guard(reader_lock);
+    for(reader_slot* slot = reader_slots; slot; slot = slot->next)
+    {
+        if(!slot->busy.load(std::memory_order_acquire))
+        {
+            slot->busy.store(true, std::memory_order_relaxed);
+            return slot;
+        }
+    }
+
+    stream_reader* opened = open_reader();
+    if(!opened) return NULL;
+
+    reader_slot* slot = new reader_slot();
+    slot->reader = opened;
+    slot->busy = true;
+    slot->next = reader_slots;
+    reader_slots = slot;
+    return slot;
 }
 
-//Sets the volume (gain) of the audio stream.
-void fcal::audio_stream::set_volume(float val)
+//Opens a reader over the stream's data for one voice. Returns NULL if voices share the stream's own reader.
+fcal::stream_reader* fcal::audio_stream::open_reader()
 {
-    volume = val;
+#ifdef FCAL_VORBIS
+    //An Ogg Vorbis voice gets its own decoder over the compressed data, so voices don't move each other's decoding position.
+    if(decoder)
+    {
+        vorbis_reader* vorbis;
+        if(external) vorbis = new vorbis_reader(external, false, &source_lock);
+        else if(encoded) vorbis = new vorbis_reader(new memory_reader(encoded, encoded_size), true);
+        else
+        {
+            file_reader* file = new file_reader(filepath);
+            if(!file->is_open())
+            {
+                delete file;
+                return NULL;
+            }
+            vorbis = new vorbis_reader(file, true);
+        }
+
+        if(!vorbis->is_valid())
+        {
+            delete vorbis;
+            return NULL;
+        }
+        return vorbis;
+    }
+#endif
+
+    if(reader) return NULL;
+
+    file_reader* file = new file_reader(filepath);
+    if(!file->is_open())
+    {
+        delete file;
+        return NULL;
+    }
+    return file;
 }
 
-void fcal::audio_stream::toggle_flag(unsigned int flag)
+/*
+Ties the stream to engine 'e' the first time one of its voices is started, for the rest of the stream's life. mix() keeps render state in
+the stream (the channel matrix for the engine's layout, the loop cache, filter coefficients and its reader's position), which one engine's
+audio thread can update without locks, but which two engines would race on. Returns false if the stream belongs to another engine.
+*/
+bool fcal::audio_stream::bind(engine* e)
 {
-    if(flags[flag]) flags[flag] = false;
-    else flags[flag] = true;
+    engine* expected = NULL;
+    return bound_engine.compare_exchange_strong(expected, e, std::memory_order_relaxed) || expected == e;
 }
 
-static float FCAL_master_volume, FCAL_master_pitch, FCAL_master_balance_left, FCAL_master_balance_right;
+//Hands a voice's reader back to its stream's pool. Called by the audio thread when the voice ends.
+void release_reader(fcal::reader_slot* slot)
+{
+    if(slot) slot->busy.store(false, std::memory_order_release);
+}
 
-fcal::audio_source::audio_source()
+void fcal::audio_stream::init_defaults()
 {
-    task = new audio_task();
-    task->data = new float[1];
+    success_init = false;
+    memory = NULL;
+    resident = NULL;
+    reader = NULL;
+    decoder = NULL;
+    bound_engine = NULL;
+    external = NULL;
+    encoded = NULL;
+    encoded_size = 0;
+    reader_slots = NULL;
+    storage = FCAL_STORAGE_NATIVE;
+    sample_bytes = 0;
+    length = 0;
+    file_data_offset = 0;
 
+    volume = 1;
     balance_left = 1;
     balance_right = 1;
+    pitch = 1;
 
-    volume = 1;
+    flags = new bool[1];
+    for(int i = 0; i < 1; i++)
+        flags[i] = false;
 
-    pitch = 1;
-}
+    channel_matrix = (float*) _mm_malloc(MATRIX_SIZE * sizeof(float), 16);
+    matrix_channels = 0;
 
-fcal::audio_source::~audio_source()
-{
-    delete[] task->data;
-    delete task;
+    loop_start = 0;
+    loop_end = 0;
+    loop_count = 0;
+    loop_crossfade = 0;
+
+    peaks = NULL;
+    peak_map = NULL;
+    peak_blocks = 0;
+
+    mips = NULL;
+    mip_count = 0;
+
+    cache = NULL;
+    next_cache = NULL;
+    old_cache = NULL;
+    cache_ready = false;
+
+    for(int i = 0; i < FCAL_FILTER_SLOTS; i++)
+    {
+        filters[i].type = FCAL_FILTER_NONE;
+        filters[i].frequency = 1000;
+        filters[i].q = 0.7071f;
+        filters[i].gain = 0;
+    }
+    filter_rate = 0;
+    filter_dirty = true;
 }
 
-void fcal::audio_source::apply_balance(float* data, unsigned int data_size)
+fcal::audio_stream::~audio_stream()
 {
-    for(unsigned int i = 0; i < data_size; i += 2)
+    delete[] flags;
+    delete[] resident;
+    delete cache;
+    delete next_cache;
+    delete old_cache;
+    delete[] peak_map;
+    delete[] mips;
+    delete decoder;
+    _mm_free(channel_matrix);
+
+    while(reader_slots)
     {
-        data[i] *= balance_left * FCAL_master_balance_left;
-        data[i + 1] *= balance_right * FCAL_master_balance_right;
+        reader_slot* next = reader_slots->next;
+        delete reader_slots->reader;
+        delete reader_slots;
+        reader_slots = next;
     }
 }
 
-void fcal::audio_source::apply_volume(float* data, unsigned int data_size)
+void fcal::audio_stream::apply_pitch(float* data, unsigned int data_size, int channels)
 {
+    float* current_data = new float[data_size];
     for(unsigned int i = 0; i < data_size; i++)
+        current_data[i] = data[i];
+
+    double point = 0;
+    int size_of_point = channels;
+
+    for(unsigned int i = 0; i < data_size; i += size_of_point)
     {
-        data[i] *= volume * FCAL_master_volume;
+        for(unsigned int c = 0; c < channels; c++)
+        {
+            int si = (int) point * size_of_point + c;
+            int ei = (int) point * size_of_point + c + size_of_point;
+
+            float start, end;
+            start = current_data[si];
+            end = current_data[ei];
+
+            float offset = point - (int) point;
+
+            float p = util_lerp(start, end, offset);
+            data[i + c] = p;
+        }
+
+        point += pitch;
     }
+
+    delete[] current_data;
 }
 
-float fcal::audio_source::get_balance_left()
+float fcal::audio_stream::get_balance_left()
 {
     return balance_left;
 }
 
-float fcal::audio_source::get_balance_right()
+float fcal::audio_stream::get_balance_right()
+{
+    return balance_right;
+}
+
+float fcal::audio_stream::get_pitch()
+{
+    return pitch;
+}
+
+float fcal::audio_stream::get_volume()
+{
+    return volume;
+}
+
+//Returns the length of the stream in seconds.
+float fcal::audio_stream::get_duration()
+{
+    if(!success_init) return 0;
+    return (float) (length / (file_format.nChannels * sample_bytes)) / file_format.nSamplesPerSec;
+}
+
+//Returns how many times the loop region repeats before playback continues past it. 0 means forever.
+unsigned int fcal::audio_stream::get_loop_count()
+{
+    return loop_count;
+}
+
+unsigned int fcal::audio_stream::get_loop_crossfade()
+{
+    return loop_crossfade;
+}
+
+//Returns the frame the loop region ends at (exclusive). 0 means the loop region ends at the end of the stream.
+unsigned int fcal::audio_stream::get_loop_end()
+{
+    return loop_end;
+}
+
+unsigned int fcal::audio_stream::get_loop_start()
+{
+    return loop_start;
+}
+
+WAVEFORMATEX fcal::audio_stream::get_format()
+{
+    return file_format;
+}
+
+bool fcal::audio_stream::get_flag(unsigned int flag)
+{
+    return flags[flag];
+}
+
+//Returns the filter coefficients of every slot (b0, b1, b2, a1, a2 each) at the given sample rate. They're only recomputed after a change.
+const float* fcal::audio_stream::get_filter_coefficients(unsigned int sample_rate)
+{
+    if(filter_dirty || filter_rate != sample_rate)
+    {
+        filter_dirty = false;
+        filter_rate = sample_rate;
+        for(int i = 0; i < FCAL_FILTER_SLOTS; i++)
+            design_biquad(filters[i], sample_rate, filter_coefficients + i * 5);
+    }
+
+    return filter_coefficients;
+}
+
+bool fcal::audio_stream::has_filter()
+{
+    for(int i = 0; i < FCAL_FILTER_SLOTS; i++)
+        if(filters[i].type != FCAL_FILTER_NONE) return true;
+    return false;
+}
+
+//Returns true if the stream's data is in memory (a sound bank asset, or a stream made resident), so playing it needs no file access.
+bool fcal::audio_stream::is_resident()
+{
+    return memory != NULL;
+}
+
+bool fcal::audio_stream::is_valid()
+{
+    return success_init;
+}
+
+//Decodes one sample of a little-endian PCM or float .WAV frame. 8-bit .WAV data is unsigned, the other depths are signed.
+template<unsigned int BYTES> inline float decode_sample(const unsigned char* p);
+
+template<> inline float decode_sample<1>(const unsigned char* p)
+{
+    return ((float) p[0] - 128) / 128;
+}
+
+template<> inline float decode_sample<2>(const unsigned char* p)
+{
+    return (float) (signed short) (p[0] | (p[1] << 8)) / 32768;
+}
+
+template<> inline float decode_sample<3>(const unsigned char* p)
+{
+    int se = p[0] | (p[1] << 8) | (p[2] << 16);
+    if(se >= 8388608) se -= 16777216;
+    return (float) se / 8388608;
+}
+
+template<> inline float decode_sample<4>(const unsigned char* p)
+{
+    float f;
+    memcpy(&f, p, 4);
+    return f;
+}
+
+/*
+8-bit mu-law (G.711), used for compact resident storage. A byte holds a sign, a 3-bit exponent and a 4-bit mantissa of the biased magnitude,
+stored inverted, which gives about 13 bits of dynamic range. Decoding is a lookup in a table built on first use.
+*/
+#define MULAW_BIAS 0x84
+#define MULAW_CLIP 32635
+
+struct mulaw_table
+{
+    float values[256];
+
+    mulaw_table()
+    {
+        for(int i = 0; i < 256; i++)
+        {
+            int u = ~i & 0xFF;
+            int magnitude = (((u & 0x0F) << 3) + MULAW_BIAS) << ((u & 0x70) >> 4);
+            values[i] = (float) ((u & 0x80) ? MULAW_BIAS - magnitude : magnitude - MULAW_BIAS) / 32768;
+        }
+    }
+};
+
+static const mulaw_table mulaw_decoder;
+
+inline float decode_mulaw(const unsigned char* p)
+{
+    return mulaw_decoder.values[p[0]];
+}
+
+unsigned char encode_mulaw(float f)
+{
+    int si = (int) std::floor(f * 32768 + 0.5f);
+    int sign = si < 0 ? 0x80 : 0;
+    int magnitude = si < 0 ? -si : si;
+    if(magnitude > MULAW_CLIP) magnitude = MULAW_CLIP;
+    magnitude += MULAW_BIAS;
+
+    int exponent = 7;
+    for(int mask = 0x4000; exponent > 0 && !(magnitude & mask); mask >>= 1)
+        exponent--;
+
+    int mantissa = (magnitude >> (exponent + 3)) & 0x0F;
+    return ~(sign | (exponent << 4) | mantissa);
+}
+
+float decode_sample(const unsigned char* p, unsigned int bytes, bool mulaw = false)
+{
+    if(mulaw) return decode_mulaw(p);
+
+    switch(bytes)
+    {
+        case 1: return decode_sample<1>(p);
+        case 2: return decode_sample<2>(p);
+        case 3: return decode_sample<3>(p);
+        default: return decode_sample<4>(p);
+    }
+}
+
+//Encodes one sample in the same formats decode_sample() reads, rounding and clipping integer formats.
+void encode_sample(float f, unsigned char* p, unsigned int bytes, bool mulaw = false)
+{
+    if(mulaw)
+    {
+        p[0] = encode_mulaw(f);
+        return;
+    }
+
+    if(bytes == 4)
+    {
+        memcpy(p, &f, 4);
+        return;
+    }
+
+    float scale = (float) (1 << (bytes * 8 - 1));
+    int si = (int) std::floor(f * scale + 0.5f);
+    if(si > scale - 1) si = scale - 1;
+    if(si < -scale) si = -scale;
+    if(bytes == 1) si += 128;
+
+    for(unsigned int i = 0; i < bytes; i++)
+        p[i] = si >> (i * 8);
+}
+
+/*
+The fused per-voice kernel. For each output frame it decodes the two surrounding source frames straight from the raw bytes, interpolates
+them, multiplies by the combined gain matrix and adds the result to the mix buffer, so a voice makes a single pass over memory with no
+intermediate buffers. 'raw' starts at source frame 'first', and 'point' is the source position of the first output frame. Compact resident
+data (int16 or mu-law) is widened to float here, so it's only ever read at its stored size.
+
+The kernel is instantiated for every sample encoding, for mono and stereo sources and destinations (0 stands for any other channel count,
+passed at run time), and with and without interpolation. With the channel counts known at compile time the channel loops and mix_frame()
+unroll completely, so the common paths run with no branches in the frame loop. Voices that play at exactly the device rate from a whole
+frame position never need interpolating, and read one frame per output frame.
+*/
+template<unsigned int BYTES, float (*DECODE)(const unsigned char*), unsigned int SRC, unsigned int DST, bool INTERPOLATE>
+void mix_pcm(const unsigned char* raw, double first, double point, double step, unsigned int src_channels, unsigned int dst_channels,
+    const float* matrix, float* out, unsigned int frames, unsigned int frame_stride, unsigned int channel_stride)
+{
+    const unsigned int src = SRC ? SRC : src_channels;
+    const unsigned int dst = DST ? DST : dst_channels;
+
+    unsigned int frame_size = src * BYTES;
+    float frame[FCAL_MAX_CHANNELS];
+
+    if(!INTERPOLATE)
+    {
+        const unsigned char* a = raw + (unsigned int) (point - first) * frame_size;
+        for(unsigned int i = 0; i < frames; i++)
+        {
+            for(unsigned int c = 0; c < src; c++)
+                frame[c] = DECODE(a + c * BYTES);
+
+            mix_frame(matrix, frame, out + i * frame_stride, src, dst, channel_stride);
+            a += frame_size;
+        }
+        return;
+    }
+
+    for(unsigned int i = 0; i < frames; i++)
+    {
+        double local = point - first;
+        unsigned int index = (unsigned int) local;
+        float offset = (float) (local - index);
+
+        const unsigned char* a = raw + index * frame_size;
+        const unsigned char* b = a + frame_size;
+
+        for(unsigned int c = 0; c < src; c++)
+            frame[c] = util_lerp(DECODE(a + c * BYTES), DECODE(b + c * BYTES), offset);
+
+        mix_frame(matrix, frame, out + i * frame_stride, src, dst, channel_stride);
+
+        point += step;
+    }
+}
+
+typedef void (*mix_kernel)(const unsigned char*, double, double, double, unsigned int, unsigned int, const float*, float*, unsigned int,
+    unsigned int, unsigned int);
+
+#define KERNEL_ENCODINGS 5
+#define KERNEL_LAYOUTS 3
+
+//Every instantiation of mix_pcm(), indexed by encoding (8/16/24/32-bit, mu-law), source layout and destination layout (mono, stereo, other)
+//and interpolation. Built once, before any stream can play.
+struct mix_kernel_table
+{
+    mix_kernel kernels[KERNEL_ENCODINGS][KERNEL_LAYOUTS][KERNEL_LAYOUTS][2];
+
+    template<unsigned int BYTES, float (*DECODE)(const unsigned char*), unsigned int SRC, unsigned int DST>
+    void fill_layout(mix_kernel* k)
+    {
+        k[0] = mix_pcm<BYTES, DECODE, SRC, DST, false>;
+        k[1] = mix_pcm<BYTES, DECODE, SRC, DST, true>;
+    }
+
+    template<unsigned int BYTES, float (*DECODE)(const unsigned char*), unsigned int SRC>
+    void fill_source(mix_kernel (*k)[2])
+    {
+        fill_layout<BYTES, DECODE, SRC, 1>(k[0]);
+        fill_layout<BYTES, DECODE, SRC, 2>(k[1]);
+        fill_layout<BYTES, DECODE, SRC, 0>(k[2]);
+    }
+
+    template<unsigned int BYTES, float (*DECODE)(const unsigned char*)>
+    void fill_encoding(mix_kernel (*k)[KERNEL_LAYOUTS][2])
+    {
+        fill_source<BYTES, DECODE, 1>(k[0]);
+        fill_source<BYTES, DECODE, 2>(k[1]);
+        fill_source<BYTES, DECODE, 0>(k[2]);
+    }
+
+    mix_kernel_table()
+    {
+        fill_encoding<1, decode_sample<1> >(kernels[0]);
+        fill_encoding<2, decode_sample<2> >(kernels[1]);
+        fill_encoding<3, decode_sample<3> >(kernels[2]);
+        fill_encoding<4, decode_sample<4> >(kernels[3]);
+        fill_encoding<1, decode_mulaw>(kernels[4]);
+    }
+};
+
+static const mix_kernel_table mix_kernels;
+
+inline unsigned int kernel_layout(unsigned int channels)
+{
+    return channels == 1 ? 0 : channels == 2 ? 1 : 2;
+}
+
+//The byte that encodes silence in every byte of a sample: unsigned 8-bit PCM is centered on 128, and mu-law stores its bits inverted.
+unsigned char silence_byte(unsigned int bytes_per_sample, unsigned int storage)
+{
+    if(storage == FCAL_STORAGE_MULAW) return 0xFF;
+    return bytes_per_sample == 1 ? 0x80 : 0;
+}
+
+//Looks up the kernel for a voice's encoding and layouts. Returns NULL for unsupported sample sizes.
+mix_kernel select_mix_kernel(unsigned int bytes_per_sample, unsigned int storage, unsigned int src_channels, unsigned int dst_channels,
+    bool interpolate)
+{
+    unsigned int encoding = storage == FCAL_STORAGE_MULAW ? 4 : bytes_per_sample - 1;
+    if(encoding >= KERNEL_ENCODINGS) return NULL;
+
+    return mix_kernels.kernels[encoding][kernel_layout(src_channels)][kernel_layout(dst_channels)][interpolate ? 1 : 0];
+}
+
+//Raw bytes read per chunk. Small enough that the chunk and the part of the mix buffer it feeds stay in L1.
+#define MIX_CHUNK_BYTES 16384
+#define MIX_CHUNK_FRAMES 256
+
+//Copies 'count' raw frames starting at 'first' from memory or the reader into 'dst'. Frames past the end of the data are zeroed. Returns how
+//many frames within the data the reader couldn't deliver, which are zeroed as well.
+unsigned int fcal::audio_stream::read_frames(const unsigned char* memory, stream_reader* source, unsigned int first, unsigned int count, unsigned char* dst)
+{
+    unsigned int frame_size = file_format.nChannels * sample_bytes;
+    unsigned int total_frames = length / frame_size;
+
+    unsigned int available = first < total_frames ? total_frames - first : 0;
+    unsigned int read = count < available ? count : available;
+
+    if(memory)
+    {
+        memcpy(dst, memory + first * frame_size, read * frame_size);
+    }
+    else if(read)
+    {
+        source->seek(file_data_offset + first * frame_size);
+        read = source->read(dst, read * frame_size) / frame_size;
+    }
+
+    memset(dst + read * frame_size, silence_byte(sample_bytes, storage), (count - read) * frame_size);
+
+    unsigned int wanted = count < available ? count : available;
+    return wanted - read;
+}
+
+/*
+The loop cache holds the raw frames the loop wrap needs so it never reads anything twice:
+    the crossfade tail: the last 'crossfade' frames of the loop, already blended with the frames before the loop start
+    the loop head: the first frames of the loop. One frame for memory-backed streams (for interpolating across the wrap), and a whole chunk
+    for streams read from a file or reader, so the first chunk after every wrap is served from memory.
+The blend is a linear crossfade, as both sides are usually correlated material. It ends on the frame just before the loop start, so the wrap
+itself is seamless.
+
+The cache is built on the thread that changes the loop (see update_loop_cache()), and keeps the region it was built for (see loop_cache),
+which mix() loops over. So changing the loop never reads or allocates on the audio thread, and takes effect at the block where the new cache is picked up.
+*/
+//The loop region. Invalid loop points (or none) loop the whole stream. The crossfade needs as many frames before the loop start.
+void fcal::audio_stream::loop_region(unsigned int& start, unsigned int& end, unsigned int& crossfade)
+{
+    unsigned int frame_size = file_format.nChannels * sample_bytes;
+    unsigned int total_frames = frame_size ? length / frame_size : 0;
+
+    start = loop_start;
+    end = loop_end;
+    if(end == 0 || end > total_frames || start >= end)
+    {
+        start = 0;
+        end = total_frames;
+    }
+
+    crossfade = loop_crossfade;
+    if(crossfade > start) crossfade = start;
+    if(end > start && crossfade > end - start - 1) crossfade = end - start - 1;
+}
+
+//Builds a loop cache for the current loop settings. Streams that aren't in memory are read through a reader of the caller's own. Returns
+//NULL if the stream has no frames or its data can't be read.
+fcal::loop_cache* fcal::audio_stream::build_loop_cache()
+{
+    unsigned int start, end, crossfade;
+    loop_region(start, end, crossfade);
+    if(!success_init || start >= end) return NULL;
+
+    const unsigned char* memory = this->memory;
+    file_reader file;
+    stream_reader* opened = NULL;
+    stream_reader* source = NULL;
+    if(!memory)
+    {
+        if(decoder) source = opened = open_reader();
+        else if(reader) source = reader;
+        else if(file.open(filepath)) source = &file;
+
+        if(!source)
+        {
+            std::cerr << "Couldn't open stream: " << filepath << std::endl;
+            return NULL;
+        }
+    }
+
+    unsigned int bytes_per_sample = sample_bytes;
+    unsigned int frame_size = file_format.nChannels * bytes_per_sample;
+    bool mulaw = storage == FCAL_STORAGE_MULAW;
+
+    unsigned int head = memory ? 1 : MIX_CHUNK_BYTES / frame_size;
+    if(head > end - start) head = end - start;
+
+    loop_cache* built = new loop_cache();
+    built->data.resize((crossfade + head) * frame_size);
+    built->start = start;
+    built->end = end;
+    built->crossfade = crossfade;
+    built->head = head;
+
+    unsigned char* data = &built->data[0];
+    read_frames(memory, source, start, head, data + crossfade * frame_size);
+
+    if(crossfade)
+    {
+        std::vector<unsigned char> lead(crossfade * frame_size);
+        read_frames(memory, source, end - crossfade, crossfade, data);
+        read_frames(memory, source, start - crossfade, crossfade, &lead[0]);
+
+        for(unsigned int i = 0; i < crossfade; i++)
+        {
+            float w = (float) (i + 1) / (crossfade + 1);
+            for(unsigned int c = 0; c < file_format.nChannels; c++)
+            {
+                unsigned char* a = data + i * frame_size + c * bytes_per_sample;
+                float b = decode_sample(&lead[i * frame_size + c * bytes_per_sample], bytes_per_sample, mulaw);
+                encode_sample(decode_sample(a, bytes_per_sample, mulaw) * (1 - w) + b * w, a, bytes_per_sample, mulaw);
+            }
+        }
+    }
+
+    delete opened;
+    return built;
+}
+
+/*
+Rebuilds the loop cache for a looping stream and hands it to the audio thread. The new cache waits in 'next_cache' until mix() swaps it in,
+which it does without waiting on the lock: if this thread holds it, the swap happens at the next call. The cache it replaces is parked in
+'old_cache' and freed here on the next update (or with the stream), so the audio thread never frees anything.
+*/
+void fcal::audio_stream::update_loop_cache()
+{
+    if(!flags[FCAL_STRF_LOOP]) return;
+
+    loop_cache* built = build_loop_cache();
+    if(!built) return;
+
+    loop_cache* replaced;
+    loop_cache* retired;
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        replaced = next_cache;
+        retired = old_cache;
+        next_cache = built;
+        old_cache = NULL;
+        cache_ready.store(true, std::memory_order_release);
+    }
+
+    delete replaced;
+    delete retired;
+}
+
+/*
+Renders 'frames' frames of the stream, starting at source frame 'cursor.position', and adds them to 'out' in the native_format layout.
+'gains' holds one gain per native channel (the source, master and spatial gains), which is combined with the stream's own volume, balance
+and channel matrix into one matrix per block. The position is advanced by the exact (fractional) resampling step. Looping streams wrap
+from the loop end to the loop start on their own, interpolating straight across the wrap, and count their loops in 'cursor.loops'. Returns
+the number of frames rendered before the end of the stream, and sets 'end' if the end was reached.
+
+By default 'out' is interleaved in the native layout. 'frame_stride' and 'channel_stride' let the caller render into other layouts, such as
+the lane-interleaved buffers used for filtering.
+*/
+unsigned int fcal::audio_stream::mix(play_cursor& cursor, unsigned int frames, WAVEFORMATEX* native_format, float pitch_master, const float* gains,
+    float* out, bool* end, unsigned int frame_stride, unsigned int channel_stride)
+{
+    *end = false;
+
+    unsigned int src_channels = file_format.nChannels;
+    unsigned int dst_channels = native_format->nChannels;
+    unsigned int bytes_per_sample = sample_bytes;
+    unsigned int frame_size = src_channels * bytes_per_sample;
+
+    mix_kernel kernel = select_mix_kernel(bytes_per_sample, storage, src_channels, dst_channels, true);
+
+    if(frame_stride == 0)
+        frame_stride = dst_channels;
+
+    if(!success_init || !kernel || src_channels > FCAL_MAX_CHANNELS || dst_channels > FCAL_MAX_CHANNELS)
+    {
+        std::cerr << "Stream can't be played: " << filepath << std::endl;
+        *end = true;
+        return 0;
+    }
+
+    //The channel matrix only depends on the asset and device layouts, so it's built once and reused for every block.
+    if(matrix_channels != dst_channels)
+    {
+        build_channel_matrix(src_channels, dst_channels, channel_matrix);
+        matrix_channels = dst_channels;
+    }
+
+    //Stream volume and balance and the caller's gains are folded into a copy of the matrix, so they cost nothing per sample.
+    alignas(16) float block_matrix[MATRIX_SIZE];
+    float stream_gains[FCAL_MAX_CHANNELS];
+    channel_gains(dst_channels, balance_left, balance_right, stream_gains);
+
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        for(unsigned int d = 0; d < MATRIX_STRIDE; d++)
+            block_matrix[c * MATRIX_STRIDE + d] = d < dst_channels ? channel_matrix[c * MATRIX_STRIDE + d] * volume * stream_gains[d] * gains[d] : 0;
+
+    //The most a source sample can add to any output sample, through this block's matrix. Blocks whose peak times this stays under the
+    //silence threshold are skipped.
+    const float* peaks = this->peaks;
+    unsigned int peak_count = peak_blocks;
+    float quiet = 0;
+    if(peaks)
+    {
+        float reach = 0;
+        for(unsigned int d = 0; d < dst_channels; d++)
+        {
+            float sum = 0;
+            for(unsigned int c = 0; c < src_channels; c++)
+                sum += std::fabs(block_matrix[c * MATRIX_STRIDE + d]);
+            if(sum > reach) reach = sum;
+        }
+        quiet = reach > 0 ? FCAL_SILENCE_THRESHOLD / reach : FLT_MAX;
+    }
+
+    double step = ((double) file_format.nSamplesPerSec / native_format->nSamplesPerSec) * pitch * pitch_master;
+    if(step < 1e-6) step = 1e-6;
+
+    //At a step of exactly one, a voice on a whole frame stays on whole frames, and the kernel that doesn't interpolate can be used.
+    mix_kernel exact = step == 1 ? select_mix_kernel(bytes_per_sample, storage, src_channels, dst_channels, false) : NULL;
+    unsigned int total_frames = length / frame_size;
+    unsigned int chunk_capacity = MIX_CHUNK_BYTES / frame_size;
+
+    //Keeps the source frames a chunk reads (plus one for interpolation) within the raw buffer.
+    unsigned int chunk_frames = MIX_CHUNK_FRAMES;
+    if((chunk_frames - 1) * step + 2 > chunk_capacity)
+        chunk_frames = (unsigned int) ((chunk_capacity - 2) / step) + 1;
+
+    //Memory-backed streams (sound banks, memory spans and resident streams) are read in place. Others go through the voice's own reader,
+    //or the stream's. A caller that mixes a file-backed stream without giving the cursor a reader has the file opened for the call.
+    const unsigned char* memory = this->memory;
+    stream_reader* source = cursor.reader ? cursor.reader : reader;
+    file_reader file;
+    if(!memory && !source)
+    {
+        if(!file.open(filepath))
+        {
+            std::cerr << "Couldn't open stream: " << filepath << std::endl;
+            *end = true;
+            return 0;
+        }
+        source = &file;
+    }
+
+    //A voice stepping more than about 1.4 frames per output frame reads the mip level nearest its step instead (see build_mips()).
+    unsigned int level = 0;
+    if(memory && mip_count && step > 1.41421356)
+    {
+        level = (unsigned int) std::floor(std::log2(step) + 0.5);
+        if(level > mip_count) level = mip_count;
+    }
+    const unsigned char* level_data = level ? mip_data[level - 1] : NULL;
+    double level_scale = 1.0 / (1u << level);
+
+    //Picks up a loop cache built since the last call, unless the thread that built it is still handing it over.
+    if(cache_ready.load(std::memory_order_acquire) && cache_lock.try_lock())
+    {
+        old_cache = cache;
+        cache = next_cache;
+        next_cache = NULL;
+        cache_ready.store(false, std::memory_order_relaxed);
+        cache_lock.unlock();
+    }
+
+    //The loop region is the one the cache was built for. Until a looping stream has a cache, it plays on as if it didn't loop.
+    bool looping = flags[FCAL_STRF_LOOP] && total_frames != 0 && cache;
+    unsigned int region_start = looping ? cache->start : 0, region_end = looping ? cache->end : total_frames;
+    unsigned int crossfade = looping ? cache->crossfade : 0;
+    unsigned int loop_frames = region_end - region_start;
+    const unsigned char* cached = looping ? &cache->data[0] : NULL;
+
+    unsigned char raw[MIX_CHUNK_BYTES];
+    unsigned int rendered = 0;
+
+    while(rendered < frames && total_frames != 0)
+    {
+        //While it has loops left the stream wraps at the loop end. The last pass plays on to the end of the stream.
+        bool wrap = looping && (loop_count == 0 || cursor.loops < loop_count);
+        unsigned int stop = wrap ? region_end : total_frames;
+
+        if(cursor.position >= stop)
+        {
+            if(wrap)
+            {
+                cursor.position = region_start + std::fmod(cursor.position - region_start, (double) loop_frames);
+                cursor.loops++;
+                continue;
+            }
+
+            *end = true;
+            break;
+        }
+
+        //Don't let a chunk run past the loop or stream end, so the wrap (or end) happens on an exact frame.
+        unsigned int n = frames - rendered;
+        if(n > chunk_frames) n = chunk_frames;
+        double until_end = std::ceil((stop - cursor.position) / step);
+        if(n > until_end) n = (unsigned int) until_end;
+        if(n == 0) n = 1;
+
+        unsigned int first = (unsigned int) cursor.position;
+        unsigned int last = (unsigned int) (cursor.position + (n - 1) * step) + 1;
+
+        //Frames from fade_start on come from the loop cache: the crossfade tail, then the loop head standing in for the frame at the loop end.
+        unsigned int fade_start = wrap ? region_end - crossfade : total_frames;
+
+        //A quiet stretch of the asset is skipped without decoding anything. The position moves exactly as if it had been mixed. The
+        //crossfade tail isn't in the map, so it's always mixed.
+        if(peaks && last < fade_start)
+        {
+            unsigned int b = first / FCAL_PEAK_BLOCK_FRAMES, b_last = last / FCAL_PEAK_BLOCK_FRAMES;
+            if(b_last >= peak_count) b_last = peak_count - 1;
+
+            float peak = 0;
+            for(; b <= b_last; b++)
+                if(peaks[b] > peak) peak = peaks[b];
+
+            if(peak < quiet)
+            {
+                cursor.position += n * step;
+                rendered += n;
+                continue;
+            }
+        }
+
+        const unsigned char* chunk = raw;
+        double chunk_first = first, point = cursor.position, chunk_step = step;
+        if(level_data && last < fade_start)
+        {
+            point = cursor.position * level_scale;
+            chunk_first = std::floor(point);
+            chunk_step = step * level_scale;
+            chunk = level_data + (unsigned int) chunk_first * frame_size;
+        }
+        else if(memory && last < fade_start)
+        {
+            chunk = memory + first * frame_size;
+        }
+        else if(wrap && first >= region_start && last < region_start + cache->head && last < fade_start)
+        {
+            chunk = cached + (crossfade + first - region_start) * frame_size;
+        }
+        else
+        {
+            unsigned int f = first;
+            unsigned char* dst = raw;
+
+            unsigned int plain = last + 1 < fade_start ? last + 1 : fade_start;
+            if(f < plain)
+            {
+                if(read_frames(memory, source, f, plain - f, dst)) cursor.starved++;
+                dst += (plain - f) * frame_size;
+                f = plain;
+            }
+
+            if(wrap)
+            {
+                unsigned int faded = last + 1 < region_end ? last + 1 : region_end;
+                if(f < faded)
+                {
+                    memcpy(dst, cached + (f - fade_start) * frame_size, (faded - f) * frame_size);
+                    dst += (faded - f) * frame_size;
+                    f = faded;
+                }
+
+                if(f <= last)
+                {
+                    memcpy(dst, cached + crossfade * frame_size, frame_size);
+                    dst += frame_size;
+                    f++;
+                }
+            }
+
+            if(f <= last)
+                memset(dst, silence_byte(bytes_per_sample, storage), (last + 1 - f) * frame_size);
+        }
+
+        mix_kernel run = exact && cursor.position == first ? exact : kernel;
+        run(chunk, chunk_first, point, chunk_step, src_channels, dst_channels, block_matrix, out + rendered * frame_stride, n, frame_stride,
+            channel_stride);
+
+        cursor.position += n * step;
+        rendered += n;
+    }
+
+    if(!*end && cursor.position >= total_frames && !looping)
+        *end = true;
+
+    return rendered;
+}
+
+//Pulls a subset of data out of a .WAV file and converts to a float stream compliant with the native_format format and modifiers such as gain/balance.
+//This is now a thin wrapper around mix(), for callers that want the data in a buffer of their own.
+float* fcal::audio_stream::pull(unsigned int& frame_offset, unsigned int frames, WAVEFORMATEX* native_format, bool* end, float pitch_master)
+{
+    unsigned int size = frames * native_format->nChannels;
+    float* data = new float[size];
+    for(unsigned int i = 0; i < size; i++)
+        data[i] = 0;
+
+    float gains[FCAL_MAX_CHANNELS];
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        gains[c] = 1;
+
+    play_cursor cursor = { (double) frame_offset, 0, 0, NULL };
+    mix(cursor, frames, native_format, pitch_master, gains, data, end);
+    frame_offset = (unsigned int) cursor.position;
+
+    return data;
+}
+
+//Reads a little-endian 16/32-bit value from the reader. Returns 0 past the end of the data.
+unsigned int read_le(fcal::stream_reader* in, unsigned int bytes)
+{
+    unsigned char b[4] = {0, 0, 0, 0};
+    in->read(b, bytes);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int) b[3] << 24);
+}
+
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+/*
+Obtains necessary information from the .WAV header. A .WAV file is a "RIFF" chunk of type "WAVE" holding a list of sub-chunks, each made of
+a 4 character tag, a 32-bit size and its data (padded to an even size). Only the "fmt " chunk (the sample format), the "data" chunk
+(the samples) and the "smpl" chunk (loop points) are read. Any other chunk (JUNK, LIST, ...) is skipped over, wherever it appears.
+*/
+void fcal::audio_stream::read_wav_header(stream_reader* in)
+{
+    char tag[4];
+    unsigned long long total = in->size();
+
+    in->seek(0);
+    if(in->read(tag, 4) != 4 || memcmp(tag, "RIFF", 4) != 0)
+    {
+        std::cerr << "Invalid .WAV type: " << filepath << std::endl;
+        return;
+    }
+
+    read_le(in, 4); //skip the file length.
+    if(in->read(tag, 4) != 4 || memcmp(tag, "WAVE", 4) != 0)
+    {
+        std::cerr << "WAVE tag not present: " << filepath << std::endl;
+        return;
+    }
+
+    bool has_format = false, has_data = false;
+    unsigned long long offset = 12;
+
+    while(offset + 8 <= total && in->seek(offset) && in->read(tag, 4) == 4)
+    {
+        unsigned long long chunk_size = read_le(in, 4);
+        unsigned long long body = offset + 8;
+
+        if(memcmp(tag, "fmt ", 4) == 0 && chunk_size >= 16)
+        {
+            file_format.wFormatTag = read_le(in, 2);
+            file_format.nChannels = read_le(in, 2);
+            file_format.nSamplesPerSec = read_le(in, 4);
+            file_format.nAvgBytesPerSec = read_le(in, 4);
+            file_format.nBlockAlign = read_le(in, 2);
+            file_format.wBitsPerSample = read_le(in, 2);
+            file_format.cbSize = 0;
+
+            //Extensible files keep the real format tag in the first two bytes of their sub-format GUID.
+            if(file_format.wFormatTag == WAV_FORMAT_EXTENSIBLE && chunk_size >= 40)
+            {
+                in->seek(body + 24);
+                file_format.wFormatTag = read_le(in, 2);
+            }
+
+            has_format = true;
+        }
+        else if(memcmp(tag, "smpl", 4) == 0 && chunk_size >= 36 + 24)
+        {
+            //Sampler chunk. Only the first loop is used. Its end is the last frame played, so one is added to make it exclusive.
+            in->seek(body + 28);
+            if(read_le(in, 4) > 0)
+            {
+                in->seek(body + 36 + 8);
+                loop_start = read_le(in, 4);
+                loop_end = read_le(in, 4) + 1;
+            }
+        }
+        else if(memcmp(tag, "data", 4) == 0)
+        {
+            //Streamed .WAV files can leave the data size unset, so it's clamped to what's actually there.
+            if(body + chunk_size > total) chunk_size = total - body;
+
+            length = chunk_size;
+            file_data_offset = body;
+            has_data = true;
+        }
+
+        offset = body + chunk_size + (chunk_size & 1);
+    }
+
+    if(!has_format)
+    {
+        std::cerr << "Invalid .WAV format: " << filepath << std::endl;
+        return;
+    }
+
+    if(print_info)
+    {
+        std::cout << filepath << " loaded." << std::endl;
+        std::cout << "   Sample rate: " << file_format.nSamplesPerSec << std::endl;
+        std::cout << "   Bit depth:   " << file_format.wBitsPerSample << std::endl;
+        std::cout << "   Channels:    " << file_format.nChannels << std::endl;
+    }
+
+    if(!has_data)
+    {
+        std::cerr << "Missing data: " << filepath << std::endl;
+        return;
+    }
+
+    sample_bytes = file_format.wBitsPerSample / 8;
+    unsigned int frame_size = file_format.nChannels * sample_bytes;
+    if(frame_size == 0)
+    {
+        std::cerr << "Invalid .WAV format: " << filepath << std::endl;
+        return;
+    }
+    length -= length % frame_size;
+
+    success_init = true;
+}
+
+/*
+Sound banks pack many assets into one file, so they can be opened with a single memory mapping and streams can be created from them with no
+per-asset file access. The layout is:
+    bank_header (magic "FCSB", version, asset count, data alignment)
+    bank_entry[count] (name, format, data offset/length and loop points of each asset)
+    asset data, each starting on a multiple of the alignment
+Banks are written by the packer in src/tools.
+*/
+fcal::sound_bank::sound_bank(std::string filepath) : filepath(filepath)
+{
+    success_init = false;
+
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    view = NULL;
+    size = 0;
+    header = NULL;
+    entries = NULL;
+
+    file = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Invalid sound bank filepath! " << filepath << std::endl;
+        return;
+    }
+
+    LARGE_INTEGER file_size;
+    if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (long long) sizeof(bank_header))
+    {
+        std::cerr << "Sound bank too small: " << filepath << std::endl;
+        return;
+    }
+    size = file_size.QuadPart;
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!mapping)
+    {
+        std::cerr << "Couldn't map sound bank: " << filepath << std::endl;
+        return;
+    }
+
+    view = (const unsigned char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!view)
+    {
+        std::cerr << "Couldn't map sound bank: " << filepath << std::endl;
+        return;
+    }
+
+    header = (const bank_header*) view;
+    if(memcmp(header->magic, "FCSB", 4) != 0 || header->version != FCAL_BANK_VERSION)
+    {
+        std::cerr << "Invalid sound bank: " << filepath << std::endl;
+        return;
+    }
+
+    if(sizeof(bank_header) + (unsigned long long) header->count * sizeof(bank_entry) > size)
+    {
+        std::cerr << "Truncated sound bank: " << filepath << std::endl;
+        return;
+    }
+
+    entries = (const bank_entry*) (view + sizeof(bank_header));
+    for(unsigned int i = 0; i < header->count; i++)
+    {
+        const bank_entry& e = entries[i];
+        unsigned int frame_size = e.channels * e.bits_per_sample / 8;
+        if((unsigned long long) e.data_offset + e.data_length > size || frame_size == 0 || e.data_length % frame_size != 0 ||
+            e.sample_rate == 0)
+        {
+            std::cerr << "Invalid sound bank entry " << i << ": " << filepath << std::endl;
+            return;
+        }
+
+        //The peak map is optional, but must cover the whole asset if it's there.
+        unsigned int blocks = (e.data_length / frame_size + FCAL_PEAK_BLOCK_FRAMES - 1) / FCAL_PEAK_BLOCK_FRAMES;
+        if(e.peak_offset && (e.peak_offset % 4 != 0 || e.peak_blocks != blocks || (unsigned long long) e.peak_offset + blocks * 4 > size))
+        {
+            std::cerr << "Invalid peak map for sound bank entry " << i << ": " << filepath << std::endl;
+            return;
+        }
+    }
+
+    if(print_info)
+    {
+        std::cout << filepath << " mapped." << std::endl;
+        std::cout << "   Assets:      " << header->count << std::endl;
+        std::cout << "   Size:        " << size << std::endl;
+    }
+
+    success_init = true;
+}
+
+fcal::sound_bank::~sound_bank()
+{
+    if(view) UnmapViewOfFile(view);
+    if(mapping) CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+unsigned int fcal::sound_bank::get_count()
+{
+    return success_init ? header->count : 0;
+}
+
+//Returns a pointer to the asset's sample data, inside the mapped bank.
+const unsigned char* fcal::sound_bank::get_data(unsigned int id)
+{
+    if(id >= get_count()) return NULL;
+    return view + entries[id].data_offset;
+}
+
+const fcal::bank_entry* fcal::sound_bank::get_entry(unsigned int id)
+{
+    if(id >= get_count()) return NULL;
+    return &entries[id];
+}
+
+//Returns the asset's peak map (see audio_stream), inside the mapped bank, or NULL if it was packed without one.
+const float* fcal::sound_bank::get_peaks(unsigned int id)
+{
+    if(id >= get_count() || !entries[id].peak_offset) return NULL;
+    return (const float*) (view + entries[id].peak_offset);
+}
+
+std::string fcal::sound_bank::get_filepath()
+{
+    return filepath;
+}
+
+//Returns the id of the asset called 'name', or -1 if the bank has no such asset.
+int fcal::sound_bank::find(std::string name)
+{
+    for(unsigned int i = 0; i < get_count(); i++)
+        if(strncmp(entries[i].name, name.c_str(), sizeof(entries[i].name)) == 0)
+            return i;
+    return -1;
+}
+
+bool fcal::sound_bank::is_valid()
+{
+    return success_init;
+}
+
+//Sets the balance (gain in both the 'left' and 'right' speakers) of the audio stream.
+void fcal::audio_stream::set_balance(float left, float right)
+{
+    balance_left = left;
+    balance_right = right;
+}
+
+//Sets one of the stream's filter slots. 'gain_db' is only used by the shelf and peaking filters. Changes are smoothed over one block.
+void fcal::audio_stream::set_filter(unsigned int slot, unsigned int type, float frequency, float q, float gain_db)
+{
+    if(slot >= FCAL_FILTER_SLOTS)
+    {
+        std::cerr << "Invalid filter slot: " << slot << std::endl;
+        return;
+    }
+
+    filters[slot].type = type;
+    filters[slot].frequency = frequency;
+    filters[slot].q = q;
+    filters[slot].gain = gain_db;
+    filter_dirty = true;
+}
+
+//Sets how many times the loop region repeats before playback continues past the loop end to the end of the stream. 0 (the default) loops
+//forever. Only used while the FCAL_STRF_LOOP flag is set.
+void fcal::audio_stream::set_loop_count(unsigned int count)
+{
+    loop_count = count;
+}
+
+//Sets the length, in source frames, of the crossfade from the end of the loop into the frames before the loop start. The crossfade can't be
+//longer than the part of the stream before the loop start.
+void fcal::audio_stream::set_loop_crossfade(unsigned int frames)
+{
+    loop_crossfade = frames;
+    update_loop_cache();
+}
+
+//Sets the loop region, in source frames. 'end' is exclusive, and 0 means the end of the stream. The region is read from the file's smpl
+//chunk when it has one. A looping stream's loop cache is rebuilt here, and voices playing it move to the new region at their next block.
+void fcal::audio_stream::set_loop_points(unsigned int start, unsigned int end)
+{
+    unsigned int frame_size = file_format.nChannels * sample_bytes;
+    unsigned int total_frames = frame_size ? length / frame_size : 0;
+    if(end > total_frames || (end != 0 && start >= end) || (end == 0 && start >= total_frames))
+    {
+        std::cerr << "Invalid loop points: " << start << ", " << end << " (" << filepath << ")" << std::endl;
+        return;
+    }
+
+    loop_start = start;
+    loop_end = end;
+    update_loop_cache();
+}
+
+//Adds a cue 'seconds' into the stream. Every voice playing the stream posts an FCAL_EVENT_CUE event with 'id' when it passes the cue, on every
+//loop. Cues should be added before the stream plays.
+void fcal::audio_stream::add_cue(float seconds, unsigned int id)
+{
+    if(seconds < 0) seconds = 0;
+
+    stream_cue cue = { (double) seconds * file_format.nSamplesPerSec, id };
+    cues.push_back(cue);
+}
+
+void fcal::audio_stream::clear_cues()
+{
+    cues.clear();
+}
+
+unsigned int fcal::audio_stream::get_cue_count()
+{
+    return cues.size();
+}
+
+void fcal::audio_stream::set_pitch(float val)
+{
+    pitch = val;
+}
+
+//Sets the volume (gain) of the audio stream.
+void fcal::audio_stream::set_volume(float val)
+{
+    volume = val;
+}
+
+void fcal::audio_stream::toggle_flag(unsigned int flag)
+{
+    if(flags[flag]) flags[flag] = false;
+    else flags[flag] = true;
+
+    if(flag == FCAL_STRF_LOOP) update_loop_cache();
+}
+
+/*
+Reads the stream's whole data chunk into memory, so later mix() calls read it in place instead of going through the file or reader. Returns
+false if the data couldn't be read, in which case the stream keeps streaming. It replaces the data, peak map and loop cache that voices
+read with no synchronization, so it must be called before the stream plays, like build_mips().
+
+'storage' picks the resident form. FCAL_STORAGE_NATIVE keeps the asset's own sample format. FCAL_STORAGE_INT16 (half the size of float data)
+and FCAL_STORAGE_MULAW (one byte per sample, for effects where its noise floor doesn't matter) convert it, which also works on streams
+that are already in memory, such as sound bank assets.
+*/
+bool fcal::audio_stream::load_resident(unsigned int storage)
+{
+    if(!success_init) return false;
+
+    if(storage > FCAL_STORAGE_MULAW)
+    {
+        std::cerr << "Invalid storage: " << storage << " (" << filepath << ")" << std::endl;
+        return false;
+    }
+
+    //Data that's already in memory in the requested form (or any form, for native storage) is used as is.
+    if(memory && (storage == FCAL_STORAGE_NATIVE || storage == this->storage)) return true;
+    if(memory && storage == FCAL_STORAGE_INT16 && this->storage == FCAL_STORAGE_NATIVE && sample_bytes == 2) return true;
+
+    file_reader file(reader || memory ? "" : filepath);
+    memory_reader stored(memory, length);
+    stream_reader* source = memory ? &stored : reader ? reader : &file;
+    if(!memory && !reader && !file.is_open())
+    {
+        std::cerr << "Couldn't open stream: " << filepath << std::endl;
+        return false;
+    }
+
+    unsigned int out_bytes = storage == FCAL_STORAGE_NATIVE ? sample_bytes : storage == FCAL_STORAGE_INT16 ? 2 : 1;
+    unsigned int samples = length / sample_bytes;
+    unsigned char* data = new unsigned char[samples * out_bytes];
+
+    source->seek(memory ? 0 : file_data_offset);
+
+    //Native data is copied as is. Compact storage is converted a chunk at a time, so the source never has to be in memory as a whole.
+    bool mulaw = this->storage == FCAL_STORAGE_MULAW;
+    unsigned char chunk[MIX_CHUNK_BYTES];
+    unsigned int chunk_samples = MIX_CHUNK_BYTES / sample_bytes;
+    unsigned int done = 0;
+
+    while(done < samples)
+    {
+        unsigned int n = samples - done < chunk_samples ? samples - done : chunk_samples;
+        unsigned char* dst = storage == FCAL_STORAGE_NATIVE ? data + done * sample_bytes : chunk;
+
+        if(source->read(dst, n * sample_bytes) != n * sample_bytes) break;
+
+        if(storage != FCAL_STORAGE_NATIVE)
+            for(unsigned int i = 0; i < n; i++)
+                encode_sample(decode_sample(chunk + i * sample_bytes, sample_bytes, mulaw), data + (done + i) * out_bytes, out_bytes,
+                    storage == FCAL_STORAGE_MULAW);
+
+        done += n;
+    }
+
+    if(done != samples)
+    {
+        std::cerr << "Truncated stream data: " << filepath << std::endl;
+        delete[] data;
+        return false;
+    }
+
+    delete[] resident;
+    resident = data;
+    memory = resident;
+    length = samples * out_bytes;
+    sample_bytes = out_bytes;
+    if(storage != FCAL_STORAGE_NATIVE) this->storage = storage;
+
+    build_peaks();
+    if(mip_count) build_mips(mip_count);
+
+    //The loop cache holds frames in the stored form, and a whole chunk of them only for streams that aren't in memory.
+    update_loop_cache();
+
+    if(print_info && storage != FCAL_STORAGE_NATIVE)
+        std::cout << filepath << " stored as " << (storage == FCAL_STORAGE_INT16 ? "int16" : "mu-law") << " (" << length << " bytes)." << std::endl;
+
+    return true;
+}
+
+//Returns how the stream's resident data is stored: FCAL_STORAGE_NATIVE (the asset's own format), FCAL_STORAGE_INT16 or FCAL_STORAGE_MULAW.
+unsigned int fcal::audio_stream::get_storage()
+{
+    return storage;
+}
+
+//Zeroth-order modified Bessel function of the first kind, for the Kaiser window.
+double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for(unsigned int k = 1; k < 50; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if(term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+/*
+Mip levels are copies of an in-memory stream at half, a quarter... of its rate, like texture mipmaps. Each level is made from the one above by
+a 95-tap Kaiser-windowed lowpass (about -80 dB from half the new rate) and dropping every other frame, so it holds nothing its own rate can't
+represent. A voice stepping through the data faster than one frame per output frame (pitched up, or an asset at a higher rate than the mix)
+reads the level nearest its step instead, where the remaining step is close to one, and its linear interpolation doesn't alias. Frame j of
+level l sits at frame j * 2^l of the stream, so voices switch levels without moving. Levels are stored in the stream's own stored format,
+with a silent frame at the end for interpolation, which takes about as much memory again as the stream.
+*/
+#define MIP_TAPS 95
+
+bool fcal::audio_stream::build_mips(unsigned int levels)
+{
+    if(!success_init) return false;
+
+    if(!memory)
+    {
+        std::cerr << "Mip levels need the stream in memory: " << filepath << std::endl;
+        return false;
+    }
+
+    if(levels > FCAL_MAX_MIP_LEVELS) levels = FCAL_MAX_MIP_LEVELS;
+
+    unsigned int channels = file_format.nChannels;
+    unsigned int frame_size = channels * sample_bytes;
+    unsigned int frames = length / frame_size;
+    bool mulaw = storage == FCAL_STORAGE_MULAW;
+
+    //The halfband lowpass. Its cutoff sits just under a quarter of the input rate, so the stopband starts at the new Nyquist frequency.
+    const double pi = 3.14159265358979323846;
+    const double beta = 7.86;
+    const int half = MIP_TAPS / 2;
+    const double cutoff = 0.25 - 0.027;
+    float taps[MIP_TAPS];
+    double sum = 0;
+    for(int k = 0; k < MIP_TAPS; k++)
+    {
+        double t = k - half;
+        double x = t / (half + 1);
+        double sinc = t == 0 ? 2 * cutoff : std::sin(2 * pi * cutoff * t) / (pi * t);
+        taps[k] = (float) (sinc * bessel_i0(beta * std::sqrt(1 - x * x)) / bessel_i0(beta));
+        sum += taps[k];
+    }
+    for(int k = 0; k < MIP_TAPS; k++)
+        taps[k] = (float) (taps[k] / sum);
+
+    unsigned int offsets[FCAL_MAX_MIP_LEVELS], counts[FCAL_MAX_MIP_LEVELS];
+    unsigned int total = 0;
+    for(unsigned int l = 0; l < levels; l++)
+    {
+        counts[l] = ((frames + (2u << l) - 1) >> (l + 1)) + 1;
+        offsets[l] = total;
+        total += counts[l] * frame_size;
+    }
+
+    unsigned char* data = new unsigned char[total ? total : 1];
+
+    //Each level is filtered from the decoded level above it, which starts as the stream itself.
+    std::vector<float> above(frames * channels), below;
+    for(unsigned int i = 0; i < frames * channels; i++)
+        above[i] = decode_sample(memory + i * sample_bytes, sample_bytes, mulaw);
+    unsigned int above_frames = frames;
+
+    for(unsigned int l = 0; l < levels; l++)
+    {
+        unsigned int n = counts[l] - 1;
+        below.assign(n * channels, 0.0f);
+
+        for(unsigned int j = 0; j < n; j++)
+        {
+            for(unsigned int c = 0; c < channels; c++)
+            {
+                float acc = 0;
+                for(int k = 0; k < MIP_TAPS; k++)
+                {
+                    int f = (int) (2 * j) + k - half;
+                    if(f >= 0 && f < (int) above_frames) acc += taps[k] * above[f * channels + c];
+                }
+                below[j * channels + c] = acc;
+            }
+        }
+
+        unsigned char* level = data + offsets[l];
+        for(unsigned int i = 0; i < n * channels; i++)
+            encode_sample(below[i], level + i * sample_bytes, sample_bytes, mulaw);
+        memset(level + n * frame_size, silence_byte(sample_bytes, storage), frame_size);
+
+        above.swap(below);
+        above_frames = n;
+    }
+
+    //Levels are only replaced along with the data, while the stream isn't playing, so the old ones can go right away.
+    unsigned char* old = mips;
+    for(unsigned int l = 0; l < levels; l++)
+        mip_data[l] = data + offsets[l];
+    mips = data;
+    mip_count = levels;
+    delete[] old;
+
+    return true;
+}
+
+//Returns the number of mip levels the stream has, besides its own data.
+unsigned int fcal::audio_stream::get_mip_levels()
+{
+    return mip_count;
+}
+
+/*
+Builds the peak map of an in-memory stream: the largest magnitude, over every channel, of each block of FCAL_PEAK_BLOCK_FRAMES frames. mix()
+skips the blocks a voice's gains can't bring up to FCAL_SILENCE_THRESHOLD. The map is made from the stored data, so it's rebuilt whenever
+the storage changes. Sound bank assets come with theirs, made by the packer.
+*/
+void fcal::audio_stream::build_peaks()
+{
+    unsigned int channels = file_format.nChannels;
+    unsigned int frames = length / (channels * sample_bytes);
+    unsigned int blocks = (frames + FCAL_PEAK_BLOCK_FRAMES - 1) / FCAL_PEAK_BLOCK_FRAMES;
+    bool mulaw = storage == FCAL_STORAGE_MULAW;
+
+    float* map = new float[blocks ? blocks : 1];
+    for(unsigned int b = 0; b < blocks; b++)
+    {
+        unsigned int first = b * FCAL_PEAK_BLOCK_FRAMES;
+        unsigned int end = first + FCAL_PEAK_BLOCK_FRAMES < frames ? first + FCAL_PEAK_BLOCK_FRAMES : frames;
+
+        float peak = 0;
+        for(unsigned int i = first * channels; i < end * channels; i++)
+        {
+            float v = std::fabs(decode_sample(memory + i * sample_bytes, sample_bytes, mulaw));
+            if(!(v <= peak)) peak = v == v ? v : FLT_MAX; //NaNs count as loud.
+        }
+        map[b] = peak;
+    }
+
+    //Only ever replaced along with the data itself, so never while the stream plays.
+    delete[] peak_map;
+    peak_map = map;
+    peaks = map;
+    peak_blocks = blocks;
+}
+
+//Returns the number of blocks in the stream's peak map, or 0 if it has none (streams read from a file or reader that isn't resident).
+unsigned int fcal::audio_stream::get_peak_blocks()
+{
+    return peaks ? peak_blocks : 0;
+}
+
+/*
+Asynchronous loading. load_async() queues one job per asset on a pool of worker threads (one per core by default), which open, validate and
+optionally make resident each stream. A load_batch tracks how many of its assets are done, so it can be polled from the game loop, waited on,
+or report completion through a callback.
+*/
+struct load_job
+{
+    fcal::load_batch* batch;
+    unsigned int index;
+};
+
+static std::vector<std::thread*> loader_threads;
+static std::deque<load_job> loader_queue;
+static std::mutex loader_lock;
+static std::condition_variable loader_wake;
+static unsigned int loader_thread_count, loader_generation;
+
+//Runs queued jobs until the pool is restarted (the generation changes) and the queue is empty.
+void loader_thread(unsigned int generation)
+{
+    while(true)
+    {
+        load_job job;
+        {
+            std::unique_lock<std::mutex> guard(loader_lock);
+            loader_wake.wait(guard, [generation]{ return generation != loader_generation || !loader_queue.empty(); });
+
+            if(loader_queue.empty()) return;
+
+            job = loader_queue.front();
+            loader_queue.pop_front();
+        }
+
+        job.batch->load(job.index);
+    }
+}
+
+//Starts the worker threads if they aren't running. Must be called with loader_lock held.
+void start_loader()
+{
+    if(!loader_threads.empty()) return;
+
+    unsigned int count = loader_thread_count;
+    if(count == 0) count = std::thread::hardware_concurrency();
+    if(count == 0) count = 1;
+
+    for(unsigned int i = 0; i < count; i++)
+        loader_threads.push_back(new std::thread(loader_thread, loader_generation));
+}
+
+fcal::load_batch::load_batch(const std::vector<std::string>& filepaths, bool resident, load_callback callback, void* user) :
+    filepaths(filepaths), streams(filepaths.size(), NULL), resident(resident), callback(callback), user(user), loaded(0), failed(0)
+{
+    done = filepaths.empty();
+}
+
+//Waits for the batch to finish. The streams it loaded belong to the caller, and aren't deleted with the batch.
+fcal::load_batch::~load_batch()
+{
+    wait();
+}
+
+unsigned int fcal::load_batch::get_count()
+{
+    return filepaths.size();
+}
+
+//Returns how many assets have finished loading, successfully or not.
+unsigned int fcal::load_batch::get_loaded()
+{
+    return loaded;
+}
+
+//Returns how many assets couldn't be loaded. Their streams are still created, but aren't valid.
+unsigned int fcal::load_batch::get_failed()
+{
+    return failed;
+}
+
+//Returns the stream loaded from filepaths[index], or NULL while the batch is still loading.
+fcal::audio_stream* fcal::load_batch::get_stream(unsigned int index)
+{
+    if(index >= streams.size() || !is_done()) return NULL;
+    return streams[index];
+}
+
+bool fcal::load_batch::is_done()
+{
+    return loaded == filepaths.size();
+}
+
+//Loads one asset of the batch. Called by the worker threads.
+void fcal::load_batch::load(unsigned int index)
+{
+    //The count is read first, as the batch may be deleted as soon as the last asset is counted.
+    unsigned int count = filepaths.size();
+
+    audio_stream* stream = new audio_stream(filepaths[index]);
+    if(stream->is_valid() && resident && !stream->load_resident())
+        failed++;
+    else if(!stream->is_valid())
+        failed++;
+
+    streams[index] = stream;
+
+    if(++loaded != count) return;
+
+    if(callback) callback(this, user);
+
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+    finished.notify_all();
+}
+
+//Blocks until every asset of the batch has been loaded and the callback (if any) has returned.
+void fcal::load_batch::wait()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this]{ return done; });
+}
+
+/*
+Loads a batch of .WAV files on the loader threads and returns immediately. If 'resident' is set, each stream's data is also read into memory.
+'callback' is called once, from a loader thread, after the last asset is done. The batch must be deleted by the caller, and deleting it
+waits for any loads still running.
+*/
+fcal::load_batch* fcal::load_async(const std::vector<std::string>& filepaths, bool resident, load_callback callback, void* user)
+{
+    load_batch* batch = new load_batch(filepaths, resident, callback, user);
+
+    if(filepaths.empty())
+    {
+        if(callback) callback(batch, user);
+        return batch;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(loader_lock);
+        start_loader();
+
+        for(unsigned int i = 0; i < filepaths.size(); i++)
+            loader_queue.push_back({ batch, i });
+    }
+    loader_wake.notify_all();
+
+    return batch;
+}
+
+//Stops and joins the worker threads, once they've finished the queued loads. The next load_async() starts them again.
+void stop_loader()
+{
+    std::vector<std::thread*> stopping;
+    {
+        std::lock_guard<std::mutex> guard(loader_lock);
+        loader_generation++;
+        stopping.swap(loader_threads);
+    }
+    loader_wake.notify_all();
+
+    for(unsigned int i = 0; i < stopping.size(); i++)
+    {
+        stopping[i]->join();
+        delete stopping[i];
+    }
+}
+
+//Joins the workers at exit, while the lock and condition variable they wait on still exist (statics are destroyed in reverse order).
+struct loader_shutdown
+{
+    ~loader_shutdown()
+    {
+        stop_loader();
+    }
+};
+
+static loader_shutdown loader_guard;
+
+//Sets the number of loader threads. 0 (the default) uses one thread per core. Running threads finish the queued loads before restarting.
+void fcal::set_loader_threads(unsigned int count)
+{
+    {
+        std::lock_guard<std::mutex> guard(loader_lock);
+        loader_thread_count = count;
+    }
+
+    stop_loader();
+}
+
+/*
+Spatial emitters are stored in structure-of-arrays form so that every emitter can be processed four at a time with SSE once per block. The game
+thread writes to a staging copy, and commit_spatial() publishes it to the audio thread through a triple buffer, so neither thread ever waits on
+the other or reads a half-written emitter. Every engine has its own spatial_state.
+*/
+struct spatial_params
+{
+    alignas(16) float px[FCAL_MAX_EMITTERS], py[FCAL_MAX_EMITTERS], pz[FCAL_MAX_EMITTERS];
+    alignas(16) float vx[FCAL_MAX_EMITTERS], vy[FCAL_MAX_EMITTERS], vz[FCAL_MAX_EMITTERS];
+    alignas(16) float min_distance[FCAL_MAX_EMITTERS], max_distance[FCAL_MAX_EMITTERS], rolloff[FCAL_MAX_EMITTERS];
+    alignas(16) float enabled[FCAL_MAX_EMITTERS], doppler[FCAL_MAX_EMITTERS];
+
+    float listener_position[3], listener_forward[3], listener_up[3], listener_velocity[3];
+    float doppler_factor, speed_of_sound;
+    unsigned int count;
+};
+
+struct fcal::spatial_state
+{
+    //Index 3 is the game thread's staging copy, indices 0-2 are the triple buffer.
+    spatial_params buffers[4];
+    std::atomic<unsigned int> shared;
+    unsigned int back, front;
+
+    //Results of the last update_spatial() call. Set to pass-through (1) on creation, then only ever touched by the audio thread.
+    alignas(16) float gain_left[FCAL_MAX_EMITTERS], gain_right[FCAL_MAX_EMITTERS], pitch[FCAL_MAX_EMITTERS];
+
+    //Freed emitters are retired until the next commit, which publishes them as disabled, and only reused after that.
+    unsigned int free_list[FCAL_MAX_EMITTERS], retired[FCAL_MAX_EMITTERS];
+    unsigned int free_count, retired_count, count;
+};
+
+#define SPATIAL_FRESH 4
+
+//The state is too big for the stack and needs 16-byte alignment, so it's allocated like the FFT work buffers.
+fcal::spatial_state* spatial_create()
+{
+    void* memory = _mm_malloc(sizeof(fcal::spatial_state), 16);
+    memset(memory, 0, sizeof(fcal::spatial_state));
+
+    fcal::spatial_state* s = new(memory) fcal::spatial_state;
+    s->shared = 1;
+    s->back = 0;
+    s->front = 2;
+
+    //Before the audio thread runs, so emitters that haven't been published yet pass audio through.
+    for(unsigned int i = 0; i < FCAL_MAX_EMITTERS; i++)
+        s->gain_left[i] = s->gain_right[i] = s->pitch[i] = 1;
+    return s;
+}
+
+void spatial_destroy(fcal::spatial_state* s)
+{
+    s->~spatial_state();
+    _mm_free(s);
+}
+
+//Returns the staging copy, filling in the listener defaults on first use. A speed of sound of 0 marks a copy that hasn't been set up.
+spatial_params* spatial_staging(fcal::spatial_state* s)
+{
+    spatial_params* p = &s->buffers[3];
+    if(p->speed_of_sound == 0)
+    {
+        p->listener_forward[2] = -1;
+        p->listener_up[1] = 1;
+        p->doppler_factor = 1;
+        p->speed_of_sound = 343.3f;
+    }
+    return p;
+}
+
+//Takes a free emitter and seeds its defaults in the staging copy; the audio thread picks them up with the next commit. Until then, it keeps
+//passing audio through, as a slot is only reused once a commit has published it as disabled.
+unsigned int alloc_emitter(fcal::spatial_state* s)
+{
+    unsigned int e;
+    if(s->free_count > 0)
+        e = s->free_list[--s->free_count];
+    else if(s->count < FCAL_MAX_EMITTERS)
+        e = s->count++;
+    else
+        return FCAL_MAX_EMITTERS;
+
+    spatial_params* p = spatial_staging(s);
+    p->px[e] = p->py[e] = p->pz[e] = 0;
+    p->vx[e] = p->vy[e] = p->vz[e] = 0;
+    p->min_distance[e] = 1;
+    p->max_distance[e] = 1000;
+    p->rolloff[e] = 1;
+    p->enabled[e] = 0;
+    p->doppler[e] = 0;
+    if(e >= p->count) p->count = e + 1;
+    return e;
+}
+
+void free_emitter(fcal::spatial_state* s, unsigned int e)
+{
+    if(e >= FCAL_MAX_EMITTERS) return;
+    spatial_staging(s)->enabled[e] = 0;
+    s->retired[s->retired_count++] = e;
+}
+
+//Copies only the live part of the emitter arrays, so a commit costs time proportional to the number of emitters in use.
+void copy_spatial_params(spatial_params* dst, spatial_params* src)
+{
+    size_t n = ((src->count + 3) & ~3u) * sizeof(float);
+    memcpy(dst->px, src->px, n);
+    memcpy(dst->py, src->py, n);
+    memcpy(dst->pz, src->pz, n);
+    memcpy(dst->vx, src->vx, n);
+    memcpy(dst->vy, src->vy, n);
+    memcpy(dst->vz, src->vz, n);
+    memcpy(dst->min_distance, src->min_distance, n);
+    memcpy(dst->max_distance, src->max_distance, n);
+    memcpy(dst->rolloff, src->rolloff, n);
+    memcpy(dst->enabled, src->enabled, n);
+    memcpy(dst->doppler, src->doppler, n);
+
+    for(int i = 0; i < 3; i++)
+    {
+        dst->listener_position[i] = src->listener_position[i];
+        dst->listener_forward[i] = src->listener_forward[i];
+        dst->listener_up[i] = src->listener_up[i];
+        dst->listener_velocity[i] = src->listener_velocity[i];
+    }
+    dst->doppler_factor = src->doppler_factor;
+    dst->speed_of_sound = src->speed_of_sound;
+    dst->count = src->count;
+}
+
+/*
+Computes distance attenuation, equal-power panning and Doppler pitch for every emitter, four emitters per iteration. This runs on the audio
+thread once per block, before any source is rendered. Attenuation follows the inverse distance clamped model:
+    gain = min / (min + rolloff * (clamp(d, min, max) - min))
+and panning is derived from the projection of the emitter direction on the listener's right axis, so left^2 + right^2 = 1 at any angle.
+*/
+void update_spatial(fcal::spatial_state* s)
+{
+    if(s->shared.load(std::memory_order_acquire) & SPATIAL_FRESH)
+        s->front = s->shared.exchange(s->front, std::memory_order_acq_rel) & 3;
+
+    spatial_params* p = &s->buffers[s->front];
+    if(p->speed_of_sound == 0) return; //Nothing has been committed yet.
+
+    float* f = p->listener_forward;
+    float* u = p->listener_up;
+
+    //Right axis = forward x up, normalized.
+    float rx = f[1] * u[2] - f[2] * u[1];
+    float ry = f[2] * u[0] - f[0] * u[2];
+    float rz = f[0] * u[1] - f[1] * u[0];
+    float rl = std::sqrt(rx * rx + ry * ry + rz * rz);
+    if(rl > 0)
+    {
+        rx /= rl;
+        ry /= rl;
+        rz /= rl;
+    }
+
+    __m128 lpx = _mm_set1_ps(p->listener_position[0]), lpy = _mm_set1_ps(p->listener_position[1]), lpz = _mm_set1_ps(p->listener_position[2]);
+    __m128 lvx = _mm_set1_ps(p->listener_velocity[0]), lvy = _mm_set1_ps(p->listener_velocity[1]), lvz = _mm_set1_ps(p->listener_velocity[2]);
+    __m128 rax = _mm_set1_ps(rx), ray = _mm_set1_ps(ry), raz = _mm_set1_ps(rz);
+
+    __m128 one = _mm_set1_ps(1), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+    __m128 eps = _mm_set1_ps(1e-6f);
+    __m128 df = _mm_set1_ps(p->doppler_factor);
+    __m128 c = _mm_set1_ps(p->speed_of_sound);
+    __m128 c_limit = _mm_set1_ps(p->speed_of_sound * 0.99f);
+    __m128 pitch_min = _mm_set1_ps(0.25f), pitch_max = _mm_set1_ps(4);
+
+    unsigned int count = (p->count + 3) & ~3u;
+    for(unsigned int i = 0; i < count; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_load_ps(p->px + i), lpx);
+        __m128 dy = _mm_sub_ps(_mm_load_ps(p->py + i), lpy);
+        __m128 dz = _mm_sub_ps(_mm_load_ps(p->pz + i), lpz);
+
+        __m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        __m128 inv = _mm_div_ps(one, _mm_max_ps(dist, eps));
+        dx = _mm_mul_ps(dx, inv);
+        dy = _mm_mul_ps(dy, inv);
+        dz = _mm_mul_ps(dz, inv);
+
+        //Equal-power panning.
+        __m128 pan = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rax), _mm_mul_ps(dy, ray)), _mm_mul_ps(dz, raz));
+        __m128 gl = _mm_sqrt_ps(_mm_max_ps(_mm_mul_ps(half, _mm_sub_ps(one, pan)), zero));
+        __m128 gr = _mm_sqrt_ps(_mm_max_ps(_mm_mul_ps(half, _mm_add_ps(one, pan)), zero));
+
+        //Distance attenuation.
+        __m128 dmin = _mm_load_ps(p->min_distance + i);
+        __m128 dmax = _mm_load_ps(p->max_distance + i);
+        __m128 dc = _mm_min_ps(_mm_max_ps(dist, dmin), dmax);
+        __m128 den = _mm_add_ps(dmin, _mm_mul_ps(_mm_load_ps(p->rolloff + i), _mm_sub_ps(dc, dmin)));
+        __m128 att = _mm_div_ps(dmin, _mm_max_ps(den, eps));
+        gl = _mm_mul_ps(gl, att);
+        gr = _mm_mul_ps(gr, att);
+
+        //Doppler. Velocities are projected on the emitter-to-listener axis, which is the negated direction.
+        __m128 vls = _mm_mul_ps(df, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, lvx), _mm_mul_ps(dy, lvy)), _mm_mul_ps(dz, lvz)));
+        __m128 vss = _mm_mul_ps(df, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_load_ps(p->vx + i)), _mm_mul_ps(dy, _mm_load_ps(p->vy + i))),
+            _mm_mul_ps(dz, _mm_load_ps(p->vz + i))));
+        vls = _mm_max_ps(vls, _mm_sub_ps(zero, c_limit));
+        vss = _mm_max_ps(vss, _mm_sub_ps(zero, c_limit));
+        __m128 dp = _mm_div_ps(_mm_add_ps(c, vls), _mm_add_ps(c, vss));
+        dp = _mm_min_ps(_mm_max_ps(dp, pitch_min), pitch_max);
+        dp = _mm_add_ps(one, _mm_mul_ps(_mm_load_ps(p->doppler + i), _mm_sub_ps(dp, one)));
+
+        //Emitters that aren't spatial pass through unchanged.
+        __m128 en = _mm_load_ps(p->enabled + i);
+        gl = _mm_add_ps(one, _mm_mul_ps(en, _mm_sub_ps(gl, one)));
+        gr = _mm_add_ps(one, _mm_mul_ps(en, _mm_sub_ps(gr, one)));
+        dp = _mm_add_ps(one, _mm_mul_ps(en, _mm_sub_ps(dp, one)));
+
+        _mm_store_ps(s->gain_left + i, gl);
+        _mm_store_ps(s->gain_right + i, gr);
+        _mm_store_ps(s->pitch + i, dp);
+    }
+}
+
+/*
+A source's voices, one column per field, so the per-block passes over them (seeks, lane assignment, publishing positions) each walk one dense
+array. Only the audio thread touches the table: play() and stop() queue requests that renew_task() applies. A voice that ends or is stopped
+is swapped with the last one, so removing a voice is O(1), and voices don't keep their play order.
+
+The columns are reserved up front and never grow on the audio thread. When play() would take the source past the table's capacity, it
+prepares a bigger spare table; the audio thread copies the voices into it when it picks the play up, and the game thread deletes the old
+table on a later play() or when the source is destroyed.
+*/
+struct fcal::voice_table
+{
+    std::vector<fcal::audio_stream*> streams;
+    std::vector<double> positions;
+    std::vector<unsigned int> loops, starved;
+    std::vector<fcal::voice_filter> filters;
+    std::vector<char> started, ended;
+    std::vector<int> lanes;
+    std::vector<fcal::reader_slot*> readers;
+};
+
+//The number of voices a new source has room for before play() prepares a bigger table.
+#define VOICE_TABLE_CAPACITY 16
+
+fcal::voice_table* voice_table_create(unsigned int capacity)
+{
+    fcal::voice_table* t = new fcal::voice_table();
+    t->streams.reserve(capacity);
+    t->positions.reserve(capacity);
+    t->loops.reserve(capacity);
+    t->starved.reserve(capacity);
+    t->filters.reserve(capacity);
+    t->started.reserve(capacity);
+    t->ended.reserve(capacity);
+    t->lanes.reserve(capacity);
+    t->readers.reserve(capacity);
+    return t;
+}
+
+//Copies every voice of 'from' into 'to', which has room for them, so nothing is allocated.
+void voice_table_copy(fcal::voice_table* to, const fcal::voice_table* from)
+{
+    to->streams.assign(from->streams.begin(), from->streams.end());
+    to->positions.assign(from->positions.begin(), from->positions.end());
+    to->loops.assign(from->loops.begin(), from->loops.end());
+    to->starved.assign(from->starved.begin(), from->starved.end());
+    to->filters.assign(from->filters.begin(), from->filters.end());
+    to->started.assign(from->started.begin(), from->started.end());
+    to->ended.assign(from->ended.begin(), from->ended.end());
+    to->lanes.assign(from->lanes.begin(), from->lanes.end());
+    to->readers.assign(from->readers.begin(), from->readers.end());
+}
+
+void voice_add(fcal::voice_table* t, fcal::audio_stream* stream, double position, fcal::reader_slot* slot)
+{
+    fcal::voice_filter filter;
+    filter.primed = false;
+
+    t->streams.push_back(stream);
+    t->positions.push_back(position);
+    t->loops.push_back(0);
+    t->starved.push_back(0);
+    t->filters.push_back(filter);
+    t->started.push_back(0);
+    t->ended.push_back(0);
+    t->lanes.push_back(-1);
+    t->readers.push_back(slot);
+}
+
+//Removes voice 'i', and hands its reader back to its stream.
+void voice_remove(fcal::voice_table* t, unsigned int i)
+{
+    unsigned int last = t->streams.size() - 1;
+    release_reader(t->readers[i]);
+
+    t->streams[i] = t->streams[last];
+    t->positions[i] = t->positions[last];
+    t->loops[i] = t->loops[last];
+    t->starved[i] = t->starved[last];
+    t->filters[i] = t->filters[last];
+    t->started[i] = t->started[last];
+    t->ended[i] = t->ended[last];
+    t->lanes[i] = t->lanes[last];
+    t->readers[i] = t->readers[last];
+
+    t->streams.pop_back();
+    t->positions.pop_back();
+    t->loops.pop_back();
+    t->starved.pop_back();
+    t->filters.pop_back();
+    t->started.pop_back();
+    t->ended.pop_back();
+    t->lanes.pop_back();
+    t->readers.pop_back();
+}
+
+fcal::audio_source::audio_source() : voice_count(0)
+{
+    voices = voice_table_create(VOICE_TABLE_CAPACITY);
+    spare_voices = NULL;
+    retired_voices = NULL;
+    voice_capacity = VOICE_TABLE_CAPACITY;
+
+    task = new audio_task();
+    task->data = new float[1];
+    task->length = 0;
+    task_capacity = 1;
+    task->offset = 0;
+
+    balance_left = 1;
+    balance_right = 1;
+
+    volume = 1;
+
+    pitch = 1;
+
+    tail = 0;
+    conv = NULL;
+    conv_busy = false;
+    generators = NULL;
+    tap = NULL;
+    tap_busy = false;
+    metering = false;
+
+    for(int i = 0; i < FCAL_FILTER_SLOTS; i++)
+    {
+        filters[i].type = FCAL_FILTER_NONE;
+        filters[i].frequency = 1000;
+        filters[i].q = 0.7071f;
+        filters[i].gain = 0;
+    }
+    source_filter.primed = false;
+    filter_rate = 0;
+    filter_dirty = true;
+
+    //Spatial parameters are kept here and copied to an emitter of the engine the source is registered with.
+    owner = NULL;
+    emitter = FCAL_MAX_EMITTERS;
+    for(int i = 0; i < 3; i++)
+        position[i] = velocity[i] = 0;
+    min_distance = 1;
+    max_distance = 1000;
+    rolloff = 1;
+    spatial = false;
+    doppler = false;
+}
+
+fcal::audio_source::~audio_source()
+{
+    if(owner) free_emitter(owner->spatial, emitter);
+
+    for(unsigned int i = 0; i < voices->readers.size(); i++)
+        release_reader(voices->readers[i]);
+    for(unsigned int i = 0; i < play_requests.size(); i++)
+        release_reader(play_requests[i].slot);
+
+    delete voices;
+    delete spare_voices;
+    delete retired_voices;
+    delete[] task->data;
+    delete task;
+}
+
+float fcal::audio_source::get_balance_left()
+{
+    return balance_left;
+}
+
+float fcal::audio_source::get_balance_right()
+{
+    return balance_right;
+}
+
+float fcal::audio_source::get_volume()
+{
+    return volume;
+}
+
+float fcal::audio_source::get_pitch()
+{
+    return pitch;
+}
+
+fcal::audio_task* fcal::audio_source::get_task()
+{
+    return task;
+}
+
+//Returns the number of streams the source is playing, including ones whose play() the audio thread hasn't picked up yet.
+unsigned int fcal::audio_source::get_stream_list_size()
+{
+    return voice_count;
+}
+
+//Returns true while an attached convolver is still ringing out after the last stream ended.
+bool fcal::audio_source::has_tail()
+{
+    return tail != 0;
+}
+
+//Returns how far, in seconds, the voice playing 'stream' is into it, as of the last mixed block (or the pending seek). Returns -1 if the
+//source isn't playing the stream.
+float fcal::audio_source::tell(audio_stream* stream)
+{
+    double rate = stream->get_format().nSamplesPerSec;
+
+    std::lock_guard<std::mutex> guard(request_lock);
+    for(unsigned int i = 0; i < seek_requests.size(); i++)
+        if(seek_requests[i].stream == stream)
+            return seek_requests[i].position / rate;
+
+    for(unsigned int i = 0; i < published_streams.size(); i++)
+        if(published_streams[i] == stream)
+            return published_positions[i] / rate;
+
+    return -1;
+}
+
+//Returns true while the source has streams playing, or attached generators sounding.
+bool fcal::audio_source::is_playing()
+{
+    generator_bank* bank = generators;
+    return voice_count != 0 || (bank && bank->is_playing());
+}
+
+//Sizes the buffers renew_task() needs for blocks of up to 'frames' frames of 'channels' channels. Called by the engine, on the game thread,
+//while the source isn't being mixed.
+void fcal::audio_source::reserve(unsigned int frames, unsigned int channels)
+{
+    if(task_capacity < frames * channels)
+    {
+        delete[] task->data;
+        task->data = new float[frames * channels];
+        task_capacity = frames * channels;
+    }
+
+    if(quad.size() < frames * channels * 4)
+        quad.resize(frames * channels * 4);
+}
+
+void fcal::audio_source::renew_task(unsigned int frame_length, WAVEFORMATEX* format)
+{
+    if(task->offset < task->length) return;
+
+    voice_table* t = voices;
+
+    //Read once, as remove_source() may clear it from another thread.
+    engine* e = owner;
+
+    //Plays, stops and seeks are handed over under a lock the audio thread only tries to take, so it never waits on the game thread. A
+    //request that misses a block is applied on the next one.
+    if(request_lock.try_lock())
+    {
+        //The spare table has room for every voice play() has counted, so the plays below can't outgrow it.
+        if(spare_voices)
+        {
+            voice_table_copy(spare_voices, t);
+            retired_voices = t;
+            voices = t = spare_voices;
+            spare_voices = NULL;
+        }
+
+        //A play made before the source was registered is checked against the engine here, and dropped if its stream is another's. With
+        //no engine (the source is being removed) there's nothing to check against, so pending plays are dropped.
+        for(unsigned int i = 0; i < play_requests.size(); i++)
+        {
+            if(e && play_requests[i].stream->bind(e))
+                voice_add(t, play_requests[i].stream, play_requests[i].position, play_requests[i].slot);
+            else
+            {
+                release_reader(play_requests[i].slot);
+                voice_count--;
+            }
+        }
+        play_requests.clear();
+
+        for(unsigned int i = 0; i < stop_requests.size(); i++)
+        {
+            for(unsigned int j = 0; j < t->streams.size(); j++)
+            {
+                if(t->streams[j] == stop_requests[i])
+                {
+                    if(e) e->push_event(FCAL_EVENT_ENDED, this, t->streams[j], 1);
+                    voice_remove(t, j);
+                    voice_count--;
+                    break;
+                }
+            }
+        }
+        stop_requests.clear();
+
+        for(unsigned int i = 0; i < seek_requests.size(); i++)
+        {
+            for(unsigned int j = 0; j < t->streams.size(); j++)
+            {
+                if(t->streams[j] == seek_requests[i].stream)
+                {
+                    t->positions[j] = seek_requests[i].position;
+                    t->loops[j] = 0;
+                    break;
+                }
+            }
+        }
+        seek_requests.clear();
+
+        request_lock.unlock();
+    }
+
+    unsigned int channels = format->nChannels;
+    unsigned int size = frame_length * channels;
+
+    //The mix buffer is kept between blocks, and sized by the engine for the longest one, so this only grows for a source mixed some
+    //other way.
+    if(task_capacity < size)
+    {
+        delete[] task->data;
+        task->data = new float[size];
+        task_capacity = size;
+    }
+
+    float* sum_data = task->data;
+    for(unsigned int i = 0; i < size; i++)
+        sum_data[i] = 0;
+
+    float pitch_source = pitch;
+    float left = balance_left;
+    float right = balance_right;
+    float master_volume = 1;
+
+    if(e)
+    {
+        pitch_source *= e->master_pitch;
+        left *= e->master_balance_left;
+        right *= e->master_balance_right;
+        master_volume = e->master_volume;
+
+        if(emitter != FCAL_MAX_EMITTERS)
+        {
+            pitch_source *= e->spatial->pitch[emitter];
+            left *= e->spatial->gain_left[emitter];
+            right *= e->spatial->gain_right[emitter];
+        }
+    }
+
+    //Source, master and spatial gains, handed to every stream so they end up in its gain matrix.
+    float gains[FCAL_MAX_CHANNELS];
+    channel_gains(channels, left, right, gains);
+    for(unsigned int c = 0; c < channels; c++)
+        gains[c] *= volume * master_volume;
+
+    //Filtered voices are rendered in groups of four into quad buffers (four voices side by side for every sample), so their filters can
+    //run in SSE lanes. Unfiltered voices are mixed straight into the source's buffer. One quad is filled and filtered at a time, so one
+    //buffer does for any number of voices. A voice that isn't filtered this block starts its filter afresh when it is again, instead of
+    //ramping from stale coefficients and state.
+    unsigned int count = t->streams.size();
+    unsigned int filtered = 0;
+    for(unsigned int i = 0; i < count; i++)
+    {
+        t->lanes[i] = t->streams[i]->has_filter() ? (int) filtered++ : -1;
+        if(t->lanes[i] < 0) t->filters[i].primed = false;
+    }
+
+    //Sized by the engine when the source is registered or the engine opened, so this only grows for a source mixed some other way.
+    unsigned int quad_size = frame_length * channels * 4;
+    if(filtered && quad.size() < quad_size)
+        quad.resize(quad_size);
+
+    fcal::voice_filter* quad_voices[4];
+    const float* quad_targets[4];
+    for(unsigned int i = 0; i < count; i++)
+    {
+        bool end = false;
+
+        play_cursor cursor = { t->positions[i], t->loops[i], t->starved[i], t->readers[i] ? t->readers[i]->reader : NULL };
+        int l = t->lanes[i];
+
+        if(l >= 0)
+        {
+            if(l % 4 == 0)
+            {
+                for(unsigned int k = 0; k < quad_size; k++)
+                    quad[k] = 0;
+            }
+
+            t->streams[i]->mix(cursor, frame_length, format, pitch_source, gains, &quad[l % 4], &end, channels * 4, 4);
+
+            quad_voices[l % 4] = &t->filters[i];
+            quad_targets[l % 4] = t->streams[i]->get_filter_coefficients(format->nSamplesPerSec);
+
+            if(l % 4 == 3 || (unsigned int) l == filtered - 1)
+            {
+                for(int k = l % 4 + 1; k < 4; k++)
+                    quad_voices[k] = NULL;
+                mix_quad(&quad[0], frame_length, channels, quad_voices, quad_targets, sum_data);
+            }
+        }
+        else
+        {
+            t->streams[i]->mix(cursor, frame_length, format, pitch_source, gains, sum_data, &end);
+        }
+
+        if(e)
+        {
+            play_cursor from = { t->positions[i], t->loops[i], t->starved[i], NULL };
+            bool started = t->started[i] != 0;
+            e->post_voice_events(this, t->streams[i], started, from, cursor, end);
+            t->started[i] = started;
+        }
+
+        t->positions[i] = cursor.position;
+        t->loops[i] = cursor.loops;
+        t->starved[i] = cursor.starved;
+        t->ended[i] = end;
+    }
+
+    //Walking down, a swapped-in voice has already been checked.
+    for(unsigned int i = count; i-- > 0;)
+    {
+        if(t->ended[i])
+        {
+            voice_remove(t, i);
+            voice_count--;
+        }
+    }
+
+    //Positions for tell(), including voices still waiting to start. Skipped if the game thread holds the lock, in which case tell() sees the
+    //previous block's positions.
+    if(request_lock.try_lock())
+    {
+        published_streams = t->streams;
+        published_positions = t->positions;
+        for(unsigned int i = 0; i < play_requests.size(); i++)
+        {
+            published_streams.push_back(play_requests[i].stream);
+            published_positions.push_back(play_requests[i].position);
+        }
+        request_lock.unlock();
+    }
+
+    //Generators are mixed in with the streams, so they go through the same gains, filters and effects.
+    generator_bank* bank = generators;
+    if(bank)
+        bank->render(sum_data, frame_length, channels, gains, format->nSamplesPerSec, pitch_source);
+
+    if(filter_dirty || filter_rate != format->nSamplesPerSec)
+    {
+        filter_dirty = false;
+        filter_rate = format->nSamplesPerSec;
+        for(int i = 0; i < FCAL_FILTER_SLOTS; i++)
+            design_biquad(filters[i], filter_rate, filter_coefficients + i * 5);
+    }
+    filter_interleaved(sum_data, frame_length, channels, &source_filter, filter_coefficients);
+
+    //set_convolver() waits on conv_busy, so a convolver is never used after it's been detached.
+    conv_busy = true;
+    convolver* attached = conv;
+    if(attached)
+    {
+        attached->process(sum_data, frame_length);
+
+        if(!t->streams.empty() || (bank && bank->is_playing()))
+            tail = attached->get_tail_frames();
+        else
+            tail -= tail < frame_length ? tail : frame_length;
+    }
+    else
+    {
+        tail = 0;
+    }
+    conv_busy = false;
+
+    if(metering)
+        meter.measure(sum_data, frame_length, channels);
+
+    //set_tap() waits on tap_busy, so a tap is never written to after it's been detached.
+    tap_busy = true;
+    audio_tap* published = tap;
+    if(published)
+        published->write(sum_data, frame_length, channels, format->nSamplesPerSec);
+    tap_busy = false;
+
+    task->length = size;
+    task->offset = 0;
+    task->stream_end = false;
+    task->type = TASKTYPE_SOURCE;
+}
+
+//Starts playing 'stream' on the source, 'start' seconds into it.
+void fcal::audio_source::play(audio_stream* stream, float start)
+{
+    if(start < 0) start = 0;
+
+    if(owner && !stream->bind(owner))
+    {
+        std::cerr << "Stream " << stream->filepath << " is already played by another engine." << std::endl;
+        return;
+    }
+
+    play_request request;
+    request.stream = stream;
+    request.position = (double) start * stream->get_format().nSamplesPerSec;
+    request.slot = stream->acquire_reader();
+
+    std::lock_guard<std::mutex> guard(request_lock);
+    play_requests.push_back(request);
+    published_streams.push_back(stream);
+    published_positions.push_back(request.position);
+    voice_count++;
+
+    //The table plus the plays waiting for it never hold more than voice_count voices. If that's more than the newest table has room for,
+    //a bigger one is prepared here, so the audio thread never grows the table itself.
+    delete retired_voices;
+    retired_voices = NULL;
+    if(voice_count > voice_capacity)
+    {
+        voice_capacity = voice_count * 2;
+        delete spare_voices;
+        spare_voices = voice_table_create(voice_capacity);
+    }
+
+    //The audio thread copies the table into these for tell(), which then fits without allocating.
+    published_streams.reserve(voice_capacity);
+    published_positions.reserve(voice_capacity);
+}
+
+/*
+Moves the voice playing 'stream' (the first one, if it's playing more than once) to 'seconds' into the stream. The seek is queued and applied
+by the audio thread at its next block, so this never waits on mixing. Seeking is constant-time, as PCM data is addressed directly by frame.
+The voice's loop count starts over, so a stream with a set number of loops plays all of them again from the new position.
+*/
+void fcal::audio_source::seek(audio_stream* stream, float seconds)
+{
+    if(seconds < 0) seconds = 0;
+
+    seek_request request;
+    request.stream = stream;
+    request.position = (double) seconds * stream->get_format().nSamplesPerSec;
+
+    std::lock_guard<std::mutex> guard(request_lock);
+    for(unsigned int i = 0; i < seek_requests.size(); i++)
+    {
+        if(seek_requests[i].stream == stream)
+        {
+            seek_requests[i] = request;
+            return;
+        }
+    }
+    seek_requests.push_back(request);
+}
+
+//Stops the voice playing 'stream' (the first one, if it's playing more than once). Like seeks, the stop is applied at the next block.
+void fcal::audio_source::stop(audio_stream* stream)
+{
+    std::lock_guard<std::mutex> guard(request_lock);
+    for(unsigned int i = 0; i < published_streams.size(); i++)
+    {
+        if(published_streams[i] == stream)
+        {
+            stop_requests.push_back(stream);
+            return;
+        }
+    }
+
+    std::cerr << "Could not locate stream to stop: " << stream << std::endl;
+}
+
+void fcal::audio_source::set_balance(float left, float right)
+{
+    balance_left = left;
+    balance_right = right;
+}
+
+void fcal::audio_source::set_volume(float value)
+{
+    volume = value;
+}
+
+void fcal::audio_source::set_pitch(float value)
+{
+    pitch = value;
+}
+
+//Attaches a convolver to the source's mix, or detaches it if 'conv' is NULL. A convolver keeps per-channel history, so it should only be
+//attached to one source (or the master mix) at a time. Once this returns the render thread won't use the previous convolver again, so it can
+//be deleted.
+void fcal::audio_source::set_convolver(convolver* conv)
+{
+    this->conv = conv;
+
+    while(conv_busy)
+        std::this_thread::yield();
+}
+
+//Mixes the oscillators of 'bank' into the source, or detaches them if 'bank' is NULL. A bank should only be attached to one source at a time.
+void fcal::audio_source::set_generators(generator_bank* bank)
+{
+    generators = bank;
+}
+
+//Returns the levels of the source's last block. Only updated while metering is enabled.
+fcal::meter_levels fcal::audio_source::get_levels()
+{
+    return meter.get_levels();
+}
+
+//Enables peak/RMS metering of the source's mix. Off by default.
+void fcal::audio_source::set_metering(bool enabled)
+{
+    metering = enabled;
+}
+
+//Publishes every block of the source's mix (after its filters and convolver) to 'tap', or stops if 'tap' is NULL. Like a convolver, a tap
+//should only be attached to one source (or the master mix) at a time. Once this returns the render thread won't touch the previous tap
+//again, so it can be deleted.
+void fcal::audio_source::set_tap(audio_tap* tap)
+{
+    this->tap = tap;
+
+    while(tap_busy)
+        std::this_thread::yield();
+}
+
+//Sets one of the filter slots applied to the source's whole mix. 'gain_db' is only used by the shelf and peaking filters.
+void fcal::audio_source::set_filter(unsigned int slot, unsigned int type, float frequency, float q, float gain_db)
+{
+    if(slot >= FCAL_FILTER_SLOTS)
+    {
+        std::cerr << "Invalid filter slot: " << slot << std::endl;
+        return;
+    }
+
+    filters[slot].type = type;
+    filters[slot].frequency = frequency;
+    filters[slot].q = q;
+    filters[slot].gain = gain_db;
+    filter_dirty = true;
+}
+
+//Makes the source a positional emitter. Its gains and pitch are then driven by the listener and emitter state published by commit_spatial().
+void fcal::audio_source::set_spatial(bool enabled)
+{
+    spatial = enabled;
+    sync_emitter();
+}
+
+void fcal::audio_source::set_doppler(bool enabled)
+{
+    doppler = enabled;
+    sync_emitter();
+}
+
+void fcal::audio_source::set_position(float x, float y, float z)
+{
+    position[0] = x;
+    position[1] = y;
+    position[2] = z;
+    sync_emitter();
+}
+
+void fcal::audio_source::set_velocity(float x, float y, float z)
+{
+    velocity[0] = x;
+    velocity[1] = y;
+    velocity[2] = z;
+    sync_emitter();
+}
+
+//Sets the distance attenuation parameters. The source plays at full gain up to min_distance, and stops getting quieter past max_distance.
+void fcal::audio_source::set_distance(float min_distance, float max_distance, float rolloff)
+{
+    this->min_distance = min_distance;
+    this->max_distance = max_distance;
+    this->rolloff = rolloff;
+    sync_emitter();
+}
+
+//Copies the source's spatial parameters to its emitter in the owning engine's staging copy, if it's registered with one.
+void fcal::audio_source::sync_emitter()
+{
+    if(!owner || emitter == FCAL_MAX_EMITTERS) return;
+
+    spatial_params* p = spatial_staging(owner->spatial);
+    p->px[emitter] = position[0];
+    p->py[emitter] = position[1];
+    p->pz[emitter] = position[2];
+    p->vx[emitter] = velocity[0];
+    p->vy[emitter] = velocity[1];
+    p->vz[emitter] = velocity[2];
+    p->min_distance[emitter] = min_distance;
+    p->max_distance[emitter] = max_distance;
+    p->rolloff[emitter] = rolloff;
+    p->enabled[emitter] = spatial ? 1 : 0;
+    p->doppler[emitter] = doppler ? 1 : 0;
+}
+
+/*
+The fft_setup structure holds the tables for a real FFT of 'size' points, computed as a complex FFT of 'half' points on split (separate real
+and imaginary) arrays. Every table and work buffer is allocated once by fft_create(), so transforms never touch the heap. Stage twiddles for
+a butterfly span of h are stored at offset h, which keeps them 16-byte aligned for spans of 4 and up.
+*/
+struct fcal::fft_setup
+{
+    unsigned int size, half;
+    unsigned int* bitrev;
+    float* tw_re;
+    float* tw_im;
+    float* split_re;
+    float* split_im;
+    float* work_re;
+    float* work_im;
+};
+
+float* alloc_floats(unsigned int count)
+{
+    float* p = (float*) _mm_malloc(count * sizeof(float), 16);
+    memset(p, 0, count * sizeof(float));
+    return p;
+}
+
+//Creates the tables for a real FFT of 'size' points. 'size' must be a power of two, 8 or larger.
+fcal::fft_setup* fft_create(unsigned int size)
+{
+    fcal::fft_setup* s = new fcal::fft_setup();
+    s->size = size;
+    s->half = size / 2;
+
+    unsigned int m = s->half;
+    unsigned int bits = 0;
+    while((1u << bits) < m) bits++;
+
+    s->bitrev = new unsigned int[m];
+    for(unsigned int i = 0; i < m; i++)
+    {
+        unsigned int r = 0;
+        for(unsigned int b = 0; b < bits; b++)
+            if(i & (1u << b)) r |= 1u << (bits - 1 - b);
+        s->bitrev[i] = r;
+    }
+
+    s->tw_re = alloc_floats(m);
+    s->tw_im = alloc_floats(m);
+    for(unsigned int h = 1; h < m; h *= 2)
+    {
+        for(unsigned int j = 0; j < h; j++)
+        {
+            double a = -3.14159265358979323846 * j / h;
+            s->tw_re[h + j] = std::cos(a);
+            s->tw_im[h + j] = std::sin(a);
+        }
+    }
+
+    s->split_re = alloc_floats(m + 1);
+    s->split_im = alloc_floats(m + 1);
+    for(unsigned int k = 0; k <= m; k++)
+    {
+        double a = -2 * 3.14159265358979323846 * k / size;
+        s->split_re[k] = std::cos(a);
+        s->split_im[k] = std::sin(a);
+    }
+
+    s->work_re = alloc_floats(m);
+    s->work_im = alloc_floats(m);
+    return s;
+}
+
+void fft_destroy(fcal::fft_setup* s)
+{
+    delete[] s->bitrev;
+    _mm_free(s->tw_re);
+    _mm_free(s->tw_im);
+    _mm_free(s->split_re);
+    _mm_free(s->split_im);
+    _mm_free(s->work_re);
+    _mm_free(s->work_im);
+    delete s;
+}
+
+//In-place forward complex FFT of s->half points (radix-2, decimation in time). Spans of 4 and up are done four butterflies at a time.
+void fft_complex(fcal::fft_setup* s, float* re, float* im)
+{
+    unsigned int m = s->half;
+
+    for(unsigned int i = 0; i < m; i++)
+    {
+        unsigned int j = s->bitrev[i];
+        if(j > i)
+        {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for(unsigned int i = 0; i < m; i += 2)
+    {
+        float ar = re[i], ai = im[i], br = re[i + 1], bi = im[i + 1];
+        re[i] = ar + br; im[i] = ai + bi;
+        re[i + 1] = ar - br; im[i + 1] = ai - bi;
+    }
+
+    //Span of 2: the twiddles are 1 and -i.
+    for(unsigned int i = 0; i < m; i += 4)
+    {
+        float ar = re[i], ai = im[i], br = re[i + 2], bi = im[i + 2];
+        re[i] = ar + br; im[i] = ai + bi;
+        re[i + 2] = ar - br; im[i + 2] = ai - bi;
+
+        ar = re[i + 1]; ai = im[i + 1]; br = im[i + 3]; bi = -re[i + 3];
+        re[i + 1] = ar + br; im[i + 1] = ai + bi;
+        re[i + 3] = ar - br; im[i + 3] = ai - bi;
+    }
+
+    for(unsigned int h = 4; h < m; h *= 2)
+    {
+        for(unsigned int b = 0; b < m; b += 2 * h)
+        {
+            for(unsigned int j = 0; j < h; j += 4)
+            {
+                __m128 wr = _mm_load_ps(s->tw_re + h + j), wi = _mm_load_ps(s->tw_im + h + j);
+                __m128 ar = _mm_load_ps(re + b + j), ai = _mm_load_ps(im + b + j);
+                __m128 br = _mm_load_ps(re + b + j + h), bi = _mm_load_ps(im + b + j + h);
+
+                __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+                __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+
+                _mm_store_ps(re + b + j, _mm_add_ps(ar, tr));
+                _mm_store_ps(im + b + j, _mm_add_ps(ai, ti));
+                _mm_store_ps(re + b + j + h, _mm_sub_ps(ar, tr));
+                _mm_store_ps(im + b + j + h, _mm_sub_ps(ai, ti));
+            }
+        }
+    }
+}
+
+//Forward real FFT. Writes bins 0 to s->half (inclusive) of the spectrum of 'x' to out_re/out_im.
+void fft_real(fcal::fft_setup* s, const float* x, float* out_re, float* out_im)
+{
+    unsigned int m = s->half;
+    float* zr = s->work_re;
+    float* zi = s->work_im;
+
+    for(unsigned int n = 0; n < m; n++)
+    {
+        zr[n] = x[2 * n];
+        zi[n] = x[2 * n + 1];
+    }
+
+    fft_complex(s, zr, zi);
+
+    //Separate the spectra of the even and odd samples, then combine them: X[k] = E[k] + W^k * O[k].
+    for(unsigned int k = 0; k <= m; k++)
+    {
+        unsigned int a = k % m, b = (m - k) % m;
+        float er = 0.5f * (zr[a] + zr[b]), ei = 0.5f * (zi[a] - zi[b]);
+        float orr = 0.5f * (zi[a] + zi[b]), oi = -0.5f * (zr[a] - zr[b]);
+
+        out_re[k] = er + s->split_re[k] * orr - s->split_im[k] * oi;
+        out_im[k] = ei + s->split_re[k] * oi + s->split_im[k] * orr;
+    }
+}
+
+//Inverse real FFT, without the 1/half normalization. Reads bins 0 to s->half (inclusive) and writes s->size samples to 'x'.
+void fft_real_inverse(fcal::fft_setup* s, const float* in_re, const float* in_im, float* x)
+{
+    unsigned int m = s->half;
+    float* zr = s->work_re;
+    float* zi = s->work_im;
+
+    //Rebuild Z[k] = E[k] + i * O[k], conjugated so the forward transform can be reused.
+    for(unsigned int k = 0; k < m; k++)
+    {
+        float xr = in_re[k], xi = in_im[k];
+        float yr = in_re[m - k], yi = -in_im[m - k];
+
+        float er = 0.5f * (xr + yr), ei = 0.5f * (xi + yi);
+        float dr = 0.5f * (xr - yr), di = 0.5f * (xi - yi);
+        float orr = dr * s->split_re[k] + di * s->split_im[k];
+        float oi = di * s->split_re[k] - dr * s->split_im[k];
+
+        zr[k] = er - oi;
+        zi[k] = -(ei + orr);
+    }
+
+    fft_complex(s, zr, zi);
+
+    for(unsigned int n = 0; n < m; n++)
+    {
+        x[2 * n] = zr[n];
+        x[2 * n + 1] = -zi[n];
+    }
+}
+
+/*
+The convolver uses uniformly partitioned overlap-save convolution. The impulse response is cut into partitions of 'block' frames, and each
+partition's spectrum is computed once. Every time 'block' input frames have been gathered, the latest 2 * block input frames are transformed
+and pushed into a frequency-domain delay line (FDL), and the output spectrum is the sum of each FDL entry multiplied by the matching IR
+partition. The cost per block is one forward and one inverse FFT plus one complex multiply-add per partition, and the latency is 'block'
+frames no matter how long the impulse response is. The convolver runs at the output format of 'host' (the default engine if NULL), which
+must be open.
+*/
+fcal::convolver::convolver(audio_stream* impulse_response, unsigned int partition_size, engine* host)
+{
+    success_init = false;
+
+    fft = NULL;
+    ir_spectra = fdl = input = output = accum = time = NULL;
+    block = bins = partitions = channels = sample_rate = position = slot = 0;
+
+    dry = 0;
+    wet = 1;
+
+    if(!host) host = get_default_engine();
+    if(!host->is_open())
+    {
+        std::cerr << "fcal must be opened before creating a convolver." << std::endl;
+        return;
+    }
+
+    if(!impulse_response || !impulse_response->is_valid())
+    {
+        std::cerr << "Invalid impulse response for convolver." << std::endl;
+        return;
+    }
+
+    block = 16;
+    while(block < partition_size)
+        block *= 2;
+
+    bins = block + 4; //block + 1 bins, padded for SSE.
+    //Convolvers process the mix, so they run at the mix rate.
+    WAVEFORMATEX format = host->get_format();
+    format.nSamplesPerSec = host->get_mix_rate();
+    channels = format.nChannels;
+    sample_rate = format.nSamplesPerSec;
+
+    fft = fft_create(block * 2);
+    time = alloc_floats(block * 2);
+    accum = alloc_floats(bins * 2);
+
+    load_impulse_response(impulse_response, &format);
+
+    fdl = alloc_floats(channels * partitions * bins * 2);
+    input = alloc_floats(channels * block * 2);
+    output = alloc_floats(channels * block);
+
+    success_init = true;
+}
+
+fcal::convolver::~convolver()
+{
+    if(fft) fft_destroy(fft);
+
+    _mm_free(ir_spectra);
+    _mm_free(fdl);
+    _mm_free(input);
+    _mm_free(output);
+    _mm_free(accum);
+    _mm_free(time);
+}
+
+//Reads the whole impulse response through audio_stream::mix(), already converted to the device format, and computes each partition's spectrum.
+void fcal::convolver::load_impulse_response(audio_stream* impulse_response, WAVEFORMATEX* format)
+{
+    unsigned int ir_frames = impulse_response->get_duration() * sample_rate;
+    unsigned int chunk = 4096;
+
+    std::vector<float> ir(((ir_frames + chunk) / chunk) * chunk * channels, 0);
+
+    float gains[FCAL_MAX_CHANNELS];
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        gains[c] = 1;
+
+    play_cursor cursor = { 0, 0, 0, NULL };
+    bool end = false;
+    for(unsigned int read = 0; read < ir_frames && !end; read += chunk)
+        impulse_response->mix(cursor, chunk, format, 1, gains, &ir[read * channels], &end);
+
+    partitions = (ir_frames + block - 1) / block;
+    if(partitions == 0) partitions = 1;
+
+    //The inverse FFT is left unnormalized, so the 1/block factor is folded into the IR spectra here.
+    float scale = 1.0f / block;
+
+    ir_spectra = alloc_floats(channels * partitions * bins * 2);
+    for(unsigned int c = 0; c < channels; c++)
+    {
+        for(unsigned int p = 0; p < partitions; p++)
+        {
+            for(unsigned int i = 0; i < block * 2; i++)
+            {
+                unsigned int f = p * block + i;
+                time[i] = (i < block && f < ir_frames) ? ir[f * channels + c] * scale : 0;
+            }
+
+            float* spectrum = ir_spectra + (c * partitions + p) * bins * 2;
+            fft_real(fft, time, spectrum, spectrum + bins);
+        }
+    }
+
+    if(print_info)
+    {
+        std::cout << "Convolver loaded." << std::endl;
+        std::cout << "   IR frames:   " << ir_frames << std::endl;
+        std::cout << "   Block size:  " << block << std::endl;
+        std::cout << "   Partitions:  " << partitions << std::endl;
+    }
+}
+
+void fcal::convolver::run_block(unsigned int channel)
+{
+    float* in = input + channel * block * 2;
+    float* spectra = fdl + channel * partitions * bins * 2;
+    float* irs = ir_spectra + channel * partitions * bins * 2;
+
+    float* newest = spectra + slot * bins * 2;
+    fft_real(fft, in, newest, newest + bins);
+
+    float* acc_re = accum;
+    float* acc_im = accum + bins;
+    memset(accum, 0, bins * 2 * sizeof(float));
+
+    for(unsigned int p = 0; p < partitions; p++)
+    {
+        unsigned int index = (slot + partitions - p) % partitions;
+        float* x_re = spectra + index * bins * 2;
+        float* x_im = x_re + bins;
+        float* h_re = irs + p * bins * 2;
+        float* h_im = h_re + bins;
+
+        for(unsigned int k = 0; k < bins; k += 4)
+        {
+            __m128 xr = _mm_load_ps(x_re + k), xi = _mm_load_ps(x_im + k);
+            __m128 hr = _mm_load_ps(h_re + k), hi = _mm_load_ps(h_im + k);
+
+            __m128 yr = _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi));
+            __m128 yi = _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr));
+
+            _mm_store_ps(acc_re + k, _mm_add_ps(_mm_load_ps(acc_re + k), yr));
+            _mm_store_ps(acc_im + k, _mm_add_ps(_mm_load_ps(acc_im + k), yi));
+        }
+    }
+
+    fft_real_inverse(fft, acc_re, acc_im, time);
+
+    //Overlap-save: only the second half of the circular convolution is valid.
+    memcpy(output + channel * block, time + block, block * sizeof(float));
+    memcpy(in, in + block, block * sizeof(float));
+}
+
+//Convolves 'frames' interleaved frames in place. Any frame count is accepted, as input is gathered until a full partition is available.
+void fcal::convolver::process(float* data, unsigned int frames)
+{
+    if(!success_init) return;
+
+    for(unsigned int f = 0; f < frames; f++)
+    {
+        for(unsigned int c = 0; c < channels; c++)
+        {
+            float x = data[f * channels + c];
+            input[c * block * 2 + block + position] = x;
+            data[f * channels + c] = dry * x + wet * output[c * block + position];
+        }
+
+        position++;
+        if(position == block)
+        {
+            for(unsigned int c = 0; c < channels; c++)
+                run_block(c);
+
+            slot = (slot + 1) % partitions;
+            position = 0;
+        }
+    }
+}
+
+unsigned int fcal::convolver::get_channels()
+{
+    return channels;
+}
+
+//Returns the delay of the wet signal, in frames.
+unsigned int fcal::convolver::get_latency()
+{
+    return block;
+}
+
+unsigned int fcal::convolver::get_sample_rate()
+{
+    return sample_rate;
+}
+
+//Returns how many frames the convolver keeps producing output for after its input goes silent.
+unsigned int fcal::convolver::get_tail_frames()
+{
+    return block * (partitions + 1);
+}
+
+bool fcal::convolver::is_valid()
+{
+    return success_init;
+}
+
+//Sets the gain of the unprocessed and convolved signals. Defaults to 0 and 1 (fully wet).
+void fcal::convolver::set_mix(float dry, float wet)
+{
+    this->dry = dry;
+    this->wet = wet;
+}
+
+/*
+Taps publish blocks of the master mix or of a source to a consumer thread through a lock-free single-producer/single-consumer ring. The
+render thread never waits: if the consumer has fallen behind and a whole block doesn't fit, the block is dropped and counted. The ring has
+room for FCAL_MAX_CHANNELS channels, so a tap can be created before the device format is known.
+*/
+fcal::audio_tap::audio_tap(unsigned int capacity_frames) : capacity(capacity_frames), channels(0), sample_rate(0), dropped(0), read_position(0),
+    write_position(0)
+{
+    if(capacity == 0) capacity = 1;
+    ring = new float[capacity * FCAL_MAX_CHANNELS];
+}
+
+fcal::audio_tap::~audio_tap()
+{
+    delete[] ring;
+}
+
+//Returns how many frames are waiting to be read.
+unsigned int fcal::audio_tap::get_available()
+{
+    return write_position.load(std::memory_order_acquire) - read_position.load(std::memory_order_relaxed);
+}
+
+//Returns the channel count of the published blocks, or 0 before the first one.
+unsigned int fcal::audio_tap::get_channels()
+{
+    return channels;
+}
+
+//Returns how many blocks were dropped because the consumer fell behind.
+unsigned int fcal::audio_tap::get_dropped()
+{
+    return dropped;
+}
+
+unsigned int fcal::audio_tap::get_sample_rate()
+{
+    return sample_rate;
+}
+
+//Copies up to 'frames' interleaved frames into 'out' and returns how many were read. Should only be called from one consumer thread.
+unsigned int fcal::audio_tap::read(float* out, unsigned int frames)
+{
+    unsigned long long r = read_position.load(std::memory_order_relaxed);
+    unsigned long long w = write_position.load(std::memory_order_acquire);
+
+    //The channel count is stored before the frames are published, so it's only read once they're visible.
+    unsigned int c = channels.load(std::memory_order_relaxed);
+
+    unsigned int n = w - r < frames ? (unsigned int) (w - r) : frames;
+    for(unsigned int done = 0; done < n;)
+    {
+        unsigned int offset = (r + done) % capacity;
+        unsigned int count = n - done;
+        if(count > capacity - offset) count = capacity - offset;
+
+        memcpy(out + done * c, ring + offset * c, count * c * sizeof(float));
+        done += count;
+    }
+
+    read_position.store(r + n, std::memory_order_release);
+    return n;
+}
+
+//Publishes one block. Called from the render thread.
+void fcal::audio_tap::write(const float* data, unsigned int frames, unsigned int channels, unsigned int sample_rate)
+{
+    unsigned long long w = write_position.load(std::memory_order_relaxed);
+    unsigned long long r = read_position.load(std::memory_order_acquire);
+
+    if(channels > FCAL_MAX_CHANNELS || capacity - (w - r) < frames)
+    {
+        dropped++;
+        return;
+    }
+
+    this->channels = channels;
+    this->sample_rate = sample_rate;
+
+    for(unsigned int done = 0; done < frames;)
+    {
+        unsigned int offset = (w + done) % capacity;
+        unsigned int count = frames - done;
+        if(count > capacity - offset) count = capacity - offset;
+
+        memcpy(ring + offset * channels, data + done * channels, count * channels * sizeof(float));
+        done += count;
+    }
+
+    write_position.store(w + frames, std::memory_order_release);
+}
+
+/*
+Level meters measure each block as it's mixed, and publish the results with a sequence lock: the sequence is odd while the render thread is
+writing, and readers retry until they see the same even sequence before and after reading. Readers never block the render thread, and any
+number of threads can read.
+*/
+fcal::level_meter::level_meter() : sequence(0), channels(0), clips(0)
+{
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+    {
+        peak[c] = 0;
+        rms[c] = 0;
+    }
+}
+
+//Returns the peak and RMS level of each channel in the last block, and the number of clipped samples (at or over full scale) so far.
+fcal::meter_levels fcal::level_meter::get_levels()
+{
+    meter_levels levels;
+    unsigned int before, after;
+
+    do
+    {
+        before = sequence.load(std::memory_order_acquire);
+
+        levels.channels = channels.load(std::memory_order_relaxed);
+        levels.clips = clips.load(std::memory_order_relaxed);
+        for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        {
+            levels.peak[c] = peak[c].load(std::memory_order_relaxed);
+            levels.rms[c] = rms[c].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    }
+    while((before & 1) || before != after);
+
+    return levels;
+}
+
+/*
+Measures one interleaved block. Samples are read four at a time, and every lane keeps its own peak and sum of squares. Channel c lands in
+the same lanes every lcm(channels, 4) samples, so the lanes are only folded into channels once, at the end of the block.
+*/
+void fcal::level_meter::measure(const float* data, unsigned int frames, unsigned int channels)
+{
+    static const unsigned int bit_count[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+    if(channels == 0 || channels > FCAL_MAX_CHANNELS) return;
+
+    unsigned int period = channels;
+    while(period % 4) period += channels;
+    unsigned int vectors = period / 4;
+
+    __m128 lane_peak[FCAL_MAX_CHANNELS], lane_power[FCAL_MAX_CHANNELS];
+    for(unsigned int v = 0; v < vectors; v++)
+    {
+        lane_peak[v] = _mm_setzero_ps();
+        lane_power[v] = _mm_setzero_ps();
+    }
+
+    __m128 sign = _mm_set1_ps(-0.0f), full_scale = _mm_set1_ps(1.0f);
+    unsigned int clipped = 0;
+
+    unsigned int count = frames * channels;
+    unsigned int whole = count - count % period;
+    for(unsigned int i = 0; i < whole; i += period)
+    {
+        for(unsigned int v = 0; v < vectors; v++)
+        {
+            __m128 x = _mm_loadu_ps(data + i + v * 4);
+            __m128 a = _mm_andnot_ps(sign, x);
+
+            lane_peak[v] = _mm_max_ps(lane_peak[v], a);
+            lane_power[v] = _mm_add_ps(lane_power[v], _mm_mul_ps(x, x));
+            clipped += bit_count[_mm_movemask_ps(_mm_cmpge_ps(a, full_scale))];
+        }
+    }
+
+    alignas(16) float peaks[FCAL_MAX_CHANNELS * 4], powers[FCAL_MAX_CHANNELS * 4];
+    for(unsigned int v = 0; v < vectors; v++)
+    {
+        _mm_store_ps(peaks + v * 4, lane_peak[v]);
+        _mm_store_ps(powers + v * 4, lane_power[v]);
+    }
+
+    float channel_peak[FCAL_MAX_CHANNELS], channel_power[FCAL_MAX_CHANNELS];
+    for(unsigned int c = 0; c < channels; c++)
+    {
+        channel_peak[c] = 0;
+        channel_power[c] = 0;
+    }
+
+    for(unsigned int k = 0; k < period; k++)
+    {
+        unsigned int c = k % channels;
+        if(peaks[k] > channel_peak[c]) channel_peak[c] = peaks[k];
+        channel_power[c] += powers[k];
+    }
+
+    //The samples left over after the last whole period start on a frame boundary.
+    for(unsigned int i = whole; i < count; i++)
+    {
+        unsigned int c = i % channels;
+        float a = std::fabs(data[i]);
+        if(a > channel_peak[c]) channel_peak[c] = a;
+        channel_power[c] += data[i] * data[i];
+        if(a >= 1) clipped++;
+    }
+
+    unsigned int seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    this->channels.store(channels, std::memory_order_relaxed);
+    clips.store(clips.load(std::memory_order_relaxed) + clipped, std::memory_order_relaxed);
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+    {
+        peak[c].store(c < channels ? channel_peak[c] : 0, std::memory_order_relaxed);
+        rms[c].store(c < channels && frames ? std::sqrt(channel_power[c] / frames) : 0, std::memory_order_relaxed);
+    }
+
+    sequence.store(seq + 2, std::memory_order_release);
+}
+
+/*
+Spectrum analyzers compute a Hann-windowed FFT of the latest 'size' samples published to a tap (mixed down to mono), off the audio thread.
+update() is called by one consumer thread, and publishes the magnitudes with a sequence lock like the level meters, so any thread can read
+them. 'size' must be a power of two, 8 or larger.
+*/
+fcal::spectrum_analyzer::spectrum_analyzer(audio_tap* tap, unsigned int size) : tap(tap), size(size), sequence(0), sample_rate(0)
+{
+    success_init = false;
+    fft = NULL;
+    position = 0;
+    history = window = frame = spectrum_re = spectrum_im = block = NULL;
+    magnitudes = NULL;
+
+    if(!tap || size < 8 || (size & (size - 1)) != 0)
+    {
+        std::cerr << "Invalid spectrum analyzer size: " << size << std::endl;
+        return;
+    }
+
+    fft = fft_create(size);
+    history = alloc_floats(size);
+    window = alloc_floats(size);
+    frame = alloc_floats(size);
+    spectrum_re = alloc_floats(size / 2 + 1);
+    spectrum_im = alloc_floats(size / 2 + 1);
+    block = alloc_floats(1024 * FCAL_MAX_CHANNELS);
+
+    magnitudes = new std::atomic<float>[size / 2 + 1];
+    for(unsigned int k = 0; k <= size / 2; k++)
+        magnitudes[k] = 0;
+
+    window_gain = 0;
+    for(unsigned int i = 0; i < size; i++)
+    {
+        history[i] = 0;
+        window[i] = 0.5f - 0.5f * std::cos(2 * 3.14159265358979323846 * i / size);
+        window_gain += window[i];
+    }
+
+    success_init = true;
+}
+
+fcal::spectrum_analyzer::~spectrum_analyzer()
+{
+    if(fft) fft_destroy(fft);
+    _mm_free(history);
+    _mm_free(window);
+    _mm_free(frame);
+    _mm_free(spectrum_re);
+    _mm_free(spectrum_im);
+    _mm_free(block);
+    delete[] magnitudes;
+}
+
+unsigned int fcal::spectrum_analyzer::get_bins()
+{
+    return size / 2 + 1;
+}
+
+//Returns the center frequency of a bin, in Hz, or 0 before any audio has arrived.
+float fcal::spectrum_analyzer::get_bin_frequency(unsigned int bin)
+{
+    return (float) bin * sample_rate / size;
+}
+
+//Copies the latest magnitudes (the linear amplitude of a sine at each bin's frequency) to 'out', which needs room for get_bins() floats.
+//Returns the number of bins.
+unsigned int fcal::spectrum_analyzer::get_spectrum(float* out)
+{
+    if(!success_init) return 0;
+
+    unsigned int bins = size / 2 + 1, before, after;
+    do
+    {
+        before = sequence.load(std::memory_order_acquire);
+        for(unsigned int k = 0; k < bins; k++)
+            out[k] = magnitudes[k].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = sequence.load(std::memory_order_relaxed);
+    }
+    while((before & 1) || before != after);
+
+    return bins;
+}
+
+bool fcal::spectrum_analyzer::is_valid()
+{
+    return success_init;
+}
+
+//Reads everything waiting in the tap and recomputes the spectrum. Returns false if there was nothing new.
+bool fcal::spectrum_analyzer::update()
+{
+    if(!success_init) return false;
+
+    bool fresh = false;
+    unsigned int n;
+    while((n = tap->read(block, 1024)) != 0)
+    {
+        unsigned int channels = tap->get_channels();
+        float scale = 1.0f / channels;
+        for(unsigned int i = 0; i < n; i++)
+        {
+            float sum = 0;
+            for(unsigned int c = 0; c < channels; c++)
+                sum += block[i * channels + c];
+
+            history[position] = sum * scale;
+            position = (position + 1) % size;
+        }
+        fresh = true;
+    }
+
+    if(!fresh) return false;
+    sample_rate = tap->get_sample_rate();
+
+    //'position' is the oldest sample.
+    for(unsigned int i = 0; i < size; i++)
+        frame[i] = history[(position + i) % size] * window[i];
+
+    fft_real(fft, frame, spectrum_re, spectrum_im);
+
+    unsigned int seq = sequence.load(std::memory_order_relaxed);
+    sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    float scale = 2 / window_gain;
+    for(unsigned int k = 0; k <= size / 2; k++)
+        magnitudes[k].store(std::sqrt(spectrum_re[k] * spectrum_re[k] + spectrum_im[k] * spectrum_im[k]) * scale, std::memory_order_relaxed);
+
+    sequence.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+/*
+Writes everything published to a tap to a 32-bit float .WAV file, from its own thread. The header is written with empty sizes once the first
+block arrives (when the format is known), and filled in by stop().
+*/
+fcal::wav_writer::wav_writer(audio_tap* tap, std::string filepath) : tap(tap), filepath(filepath), channels(0), sample_rate(0),
+    frames_written(0), running(false), thread(NULL)
+{
+    success_init = false;
+
+    file = fopen(filepath.c_str(), "wb");
+    if(!tap || !file)
+    {
+        std::cerr << "Couldn't open .WAV file for writing: " << filepath << std::endl;
+        return;
+    }
+
+    success_init = true;
+    running = true;
+    thread = new std::thread(&wav_writer::run, this);
+}
+
+fcal::wav_writer::~wav_writer()
+{
+    stop();
+}
+
+void fcal::wav_writer::run()
+{
+    std::vector<float> block;
+
+    while(true)
+    {
+        bool last = !running;
+
+        if(channels == 0 && tap->get_channels() != 0)
+        {
+            channels = tap->get_channels();
+            sample_rate = tap->get_sample_rate();
+            block.resize(4096 * channels);
+            finish_header();
+        }
+
+        unsigned int n = channels ? tap->read(&block[0], 4096) : 0;
+        if(n)
+        {
+            fwrite(&block[0], sizeof(float), n * channels, file);
+            frames_written += n;
+            continue;
+        }
+
+        if(last) break;
+        Sleep(10);
+    }
+}
+
+//Writes (or rewrites) the 44 byte header of a float .WAV file holding the frames written so far.
+void fcal::wav_writer::finish_header()
+{
+    unsigned int data_size = frames_written * channels * sizeof(float);
+    unsigned int riff_size = 36 + data_size;
+    unsigned short format_tag = 3, bits = 32, block_align = channels * sizeof(float), header_channels = channels;
+    unsigned int bytes_per_second = sample_rate * block_align, fmt_size = 16;
+
+    long end = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format_tag, 2, 1, file);
+    fwrite(&header_channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&bytes_per_second, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+
+    if(end > 44) fseek(file, end, SEEK_SET);
+}
+
+unsigned long long fcal::wav_writer::get_frames_written()
+{
+    return frames_written;
+}
+
+bool fcal::wav_writer::is_valid()
+{
+    return success_init;
+}
+
+//Writes out whatever is left in the tap, completes the header and closes the file. Detach the tap from the mix first, or blocks published
+//after this are simply left in the tap.
+void fcal::wav_writer::stop()
+{
+    if(!thread) return;
+
+    running = false;
+    thread->join();
+    delete thread;
+    thread = NULL;
+
+    if(channels) finish_header();
+    fclose(file);
+    file = NULL;
+}
+
+/*
+Generator voices are oscillators driven by 32-bit phase accumulators, which wrap around on their own once per cycle. Sine, saw, square and
+triangle read 2048-point wavetables. The band-limited shapes get one table per octave ("level"), built by inverse FFT from only the
+harmonics that stay under Nyquist at the highest pitch the level is used for, so no level aliases. Noise is a xorshift generator. Banks
+render their oscillators four at a time, one per SSE lane, straight into the block being mixed.
+*/
+#define WAVETABLE_BITS 11
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define WAVETABLE_LEVELS 10
+
+#define GENERATOR_IDLE 0
+#define GENERATOR_PLAYING 1
+#define GENERATOR_RELEASING 2
+
+struct wavetable_set
+{
+    //Every table has one extra point, a copy of the first, so interpolation never has to wrap.
+    float sine[WAVETABLE_SIZE + 1];
+    float shapes[3][WAVETABLE_LEVELS][WAVETABLE_SIZE + 1];
+
+    wavetable_set();
+
+    const float* get(unsigned int waveform, unsigned int increment) const;
+};
+
+//Level 'l' holds 512 >> l harmonics of the Fourier series of each shape.
+wavetable_set::wavetable_set()
+{
+    const double pi = 3.14159265358979323846;
+
+    for(unsigned int i = 0; i <= WAVETABLE_SIZE; i++)
+        sine[i] = (float) std::sin(2 * pi * i / WAVETABLE_SIZE);
+
+    fcal::fft_setup* fft = fft_create(WAVETABLE_SIZE);
+    std::vector<float> re(WAVETABLE_SIZE / 2 + 1, 0), im(WAVETABLE_SIZE / 2 + 1);
+
+    for(unsigned int w = 0; w < 3; w++)
+    {
+        unsigned int waveform = FCAL_WAVE_SAW + w;
+
+        for(unsigned int l = 0; l < WAVETABLE_LEVELS; l++)
+        {
+            std::fill(im.begin(), im.end(), 0.0f);
+
+            unsigned int harmonics = 512 >> l;
+            for(unsigned int n = 1; n <= harmonics; n++)
+            {
+                double a = 0;
+                if(waveform == FCAL_WAVE_SAW)
+                    a = (n % 2 ? 2 : -2) / (pi * n);
+                else if(n % 2 && waveform == FCAL_WAVE_SQUARE)
+                    a = 4 / (pi * n);
+                else if(n % 2)
+                    a = ((n / 2) % 2 ? -8 : 8) / (pi * pi * n * n);
+
+                //A negative imaginary part comes out as a sine.
+                im[n] = (float) -a;
+            }
+
+            float* table = shapes[w][l];
+            fft_real_inverse(fft, &re[0], &im[0], table);
+            table[WAVETABLE_SIZE] = table[0];
+        }
+    }
+
+    fft_destroy(fft);
+}
+
+//Returns the table to play 'waveform' from at a phase increment of 'increment' per frame.
+const float* wavetable_set::get(unsigned int waveform, unsigned int increment) const
+{
+    if(waveform < FCAL_WAVE_SAW || waveform > FCAL_WAVE_TRIANGLE) return sine;
+
+    //Level l is clean up to an increment of 2^(22 + l), where its top harmonic reaches Nyquist.
+    unsigned int level = 0;
+    while(level < WAVETABLE_LEVELS - 1 && increment > (1u << (22 + level)))
+        level++;
+
+    return shapes[waveform - FCAL_WAVE_SAW][level];
+}
+
+//The tables are built the first time a bank renders. Initialization of a function-local static is thread-safe.
+const wavetable_set& get_wavetables()
+{
+    static const wavetable_set tables;
+    return tables;
+}
+
+//What the game thread asked for, per oscillator.
+struct generator_slot
+{
+    unsigned int waveform;
+    float frequency, amplitude, duration;
+    bool used, restart;
+};
+
+//The audio thread's copy of four oscillators, one per lane.
+struct generator_quad
+{
+    unsigned int phase[4], increment[4], noise[4];
+    float amplitude[4], target[4], frequency[4];
+    unsigned int waveform[4], remaining[4];
+    unsigned char state[4], expired[4];
+
+    //Set up once per render() call, which may be rendered in several pieces.
+    const float* table[4];
+    float step[4], end[4];
+    unsigned int noise_mask[4];
+};
+
+//The most frames a bank renders at once. Longer calls are rendered in pieces, so the mono sum has a fixed size.
+#define GENERATOR_BLOCK 256
+
+/*
+add(), remove() and the setters only write the slots, under a lock the audio thread only tries to take once per block (like seeks), and the
+audio thread copies them into its quads when it gets it. Voices fade in over their first block and out over their last one, so starting,
+stopping and running out never click. A voice that ran out is handed back to the game thread on the next copy.
+*/
+struct fcal::generator_state
+{
+    unsigned int capacity, quad_count, used, seed;
+    std::vector<generator_slot> slots;
+    std::mutex lock;
+
+    generator_quad* quads;
+    std::atomic<unsigned int> playing, pending;
+
+    //Sum of every oscillator, before channel gains.
+    float mono[GENERATOR_BLOCK];
+};
+
+//Copies the slots into the quads. Called by the audio thread, holding the lock.
+void generator_sync(fcal::generator_state* s, unsigned int sample_rate)
+{
+    for(unsigned int i = 0; i < s->capacity; i++)
+    {
+        generator_slot& slot = s->slots[i];
+        generator_quad& q = s->quads[i / 4];
+        unsigned int k = i % 4;
+
+        if(slot.restart)
+        {
+            if(q.state[k] == GENERATOR_IDLE && !q.expired[k]) s->playing++;
+
+            q.state[k] = GENERATOR_PLAYING;
+            q.expired[k] = 0;
+            q.phase[k] = 0;
+            q.amplitude[k] = 0;
+            q.remaining[k] = slot.duration > 0 ? (unsigned int) (slot.duration * sample_rate + 0.5f) : 0;
+            if(slot.duration > 0 && q.remaining[k] == 0) q.remaining[k] = 1;
+
+            //Xorshift never leaves zero, so every voice gets its own non-zero seed.
+            s->seed = s->seed * 1664525 + 1013904223;
+            q.noise[k] = s->seed ? s->seed : 1;
+
+            slot.restart = false;
+            s->pending--;
+        }
+        else if(q.expired[k])
+        {
+            q.expired[k] = 0;
+            s->playing--;
+            if(slot.used)
+            {
+                slot.used = false;
+                s->used--;
+            }
+        }
+
+        if(q.state[k] == GENERATOR_IDLE) continue;
+
+        if(!slot.used)
+        {
+            q.state[k] = GENERATOR_RELEASING;
+            continue;
+        }
+
+        q.waveform[k] = slot.waveform;
+        q.frequency[k] = slot.frequency;
+        q.target[k] = slot.amplitude;
+    }
+}
+
+/*
+A bank of up to 'capacity' oscillators, mixed as one mono signal. Attach it to a source with audio_source::set_generators() to run it
+through the source's gains, filters and effects like any stream. Nothing is allocated per voice, and nothing is rendered ahead.
+*/
+fcal::generator_bank::generator_bank(unsigned int capacity)
+{
+    state = new generator_state();
+    state->capacity = capacity;
+    state->quad_count = (capacity + 3) / 4;
+    state->used = 0;
+    state->seed = 0x9E3779B9;
+    state->playing = 0;
+    state->pending = 0;
+
+    generator_slot empty = { FCAL_WAVE_SINE, 0, 0, 0, false, false };
+    state->slots.assign(capacity, empty);
+
+    state->quads = (generator_quad*) _mm_malloc(state->quad_count * sizeof(generator_quad), 16);
+    memset(state->quads, 0, state->quad_count * sizeof(generator_quad));
+}
+
+//The bank must not be rendering, so detach it from its source first.
+fcal::generator_bank::~generator_bank()
+{
+    _mm_free(state->quads);
+    delete state;
+}
+
+unsigned int fcal::generator_bank::get_capacity()
+{
+    return state->capacity;
+}
+
+//Returns the number of oscillators added and not yet removed or run out.
+unsigned int fcal::generator_bank::get_count()
+{
+    std::lock_guard<std::mutex> guard(state->lock);
+    return state->used;
+}
+
+//Returns true while any oscillator is sounding, or about to.
+bool fcal::generator_bank::is_playing()
+{
+    return state->playing != 0 || state->pending != 0;
+}
+
+/*
+Starts an oscillator and returns its id, or -1 if all of them are in use. 'frequency' is in Hz, and 'amplitude' is the peak of the ideal
+waveform (the band-limited saw and square overshoot it slightly). The oscillator plays for 'duration' seconds, or until it's removed if 0.
+Ids are reused once their oscillator is removed or runs out.
+*/
+int fcal::generator_bank::add(unsigned int waveform, float frequency, float amplitude, float duration)
+{
+    if(waveform > FCAL_WAVE_NOISE)
+    {
+        std::cerr << "Invalid waveform: " << waveform << std::endl;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    for(unsigned int i = 0; i < state->capacity; i++)
+    {
+        generator_slot& slot = state->slots[i];
+        if(slot.used) continue;
+
+        slot.waveform = waveform;
+        slot.frequency = frequency;
+        slot.amplitude = amplitude < 0 ? 0 : amplitude;
+        slot.duration = duration;
+        slot.used = true;
+        state->used++;
+
+        if(!slot.restart)
+        {
+            slot.restart = true;
+            state->pending++;
+        }
+
+        return i;
+    }
+
+    return -1;
+}
+
+//Stops oscillator 'id', fading it out over the next block.
+void fcal::generator_bank::remove(unsigned int id)
+{
+    if(id >= state->capacity) return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    generator_slot& slot = state->slots[id];
+    if(!slot.used) return;
+
+    slot.used = false;
+    state->used--;
+
+    if(slot.restart)
+    {
+        slot.restart = false;
+        state->pending--;
+    }
+}
+
+//Stops every oscillator.
+void fcal::generator_bank::clear()
+{
+    for(unsigned int i = 0; i < state->capacity; i++)
+        remove(i);
+}
+
+//Sets the peak amplitude of oscillator 'id'. Changes are ramped over a block.
+void fcal::generator_bank::set_amplitude(unsigned int id, float amplitude)
+{
+    if(id >= state->capacity) return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    if(state->slots[id].used) state->slots[id].amplitude = amplitude < 0 ? 0 : amplitude;
+}
+
+//Sets the frequency of oscillator 'id', in Hz. The phase carries on, so sweeps stay continuous.
+void fcal::generator_bank::set_frequency(unsigned int id, float frequency)
+{
+    if(id >= state->capacity) return;
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    if(state->slots[id].used) state->slots[id].frequency = frequency;
+}
+
+/*
+Adds the next 'frames' frames of every oscillator, scaled by 'gains' (one per channel), to the interleaved 'out'. Frequencies are multiplied
+by 'pitch'. Called by the audio thread; a bank must only be rendered from one place.
+*/
+void fcal::generator_bank::render(float* out, unsigned int frames, unsigned int channels, const float* gains, unsigned int sample_rate, float pitch)
+{
+    generator_state* s = state;
+
+    if(s->lock.try_lock())
+    {
+        generator_sync(s, sample_rate);
+        s->lock.unlock();
+    }
+
+    if(s->playing == 0 || frames == 0) return;
+
+    const wavetable_set& tables = get_wavetables();
+    double nyquist = sample_rate * 0.5;
+
+    const __m128i frac_mask = _mm_set1_epi32((1 << (32 - WAVETABLE_BITS)) - 1);
+    const __m128 frac_scale = _mm_set1_ps(1.0f / (1 << (32 - WAVETABLE_BITS)));
+    const __m128 noise_scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    for(unsigned int g = 0; g < s->quad_count; g++)
+    {
+        generator_quad& q = s->quads[g];
+        if(!(q.state[0] | q.state[1] | q.state[2] | q.state[3])) continue;
+
+        for(unsigned int k = 0; k < 4; k++)
+        {
+            q.table[k] = tables.sine;
+            q.step[k] = 0;
+            q.end[k] = 0;
+            q.noise_mask[k] = 0;
+            q.increment[k] = 0;
+
+            if(q.state[k] == GENERATOR_IDLE) continue;
+
+            double frequency = (double) q.frequency[k] * pitch;
+            if(frequency < 0) frequency = 0;
+            if(frequency > nyquist) frequency = nyquist;
+            q.increment[k] = (unsigned int) (frequency / sample_rate * 4294967296.0);
+
+            q.table[k] = tables.get(q.waveform[k], q.increment[k]);
+            if(q.waveform[k] == FCAL_WAVE_NOISE) q.noise_mask[k] = 0xFFFFFFFF;
+
+            //Ramp to the target over the block, or to silence over what's left of an ending voice.
+            unsigned int ramp = frames;
+            q.end[k] = q.target[k];
+            if(q.state[k] == GENERATOR_RELEASING)
+                q.end[k] = 0;
+            else if(q.remaining[k] && q.remaining[k] <= frames)
+            {
+                q.end[k] = 0;
+                ramp = q.remaining[k];
+            }
+
+            q.step[k] = (q.end[k] - q.amplitude[k]) / ramp;
+        }
+    }
+
+    float* mono = s->mono;
+    for(unsigned int done = 0; done < frames; done += GENERATOR_BLOCK)
+    {
+        unsigned int count = frames - done < GENERATOR_BLOCK ? frames - done : GENERATOR_BLOCK;
+        memset(mono, 0, count * sizeof(float));
+
+        for(unsigned int g = 0; g < s->quad_count; g++)
+        {
+            generator_quad& q = s->quads[g];
+            if(!(q.state[0] | q.state[1] | q.state[2] | q.state[3])) continue;
+
+            const float* const* table = q.table;
+            __m128i phase = _mm_loadu_si128((__m128i*) q.phase);
+            __m128i increment = _mm_loadu_si128((__m128i*) q.increment);
+            __m128i noise = _mm_loadu_si128((__m128i*) q.noise);
+            __m128 amplitude = _mm_loadu_ps(q.amplitude);
+            __m128 delta = _mm_loadu_ps(q.step);
+            __m128 is_noise = _mm_castsi128_ps(_mm_loadu_si128((__m128i*) q.noise_mask));
+
+            alignas(16) unsigned int index[4];
+            for(unsigned int f = 0; f < count; f++)
+            {
+                _mm_store_si128((__m128i*) index, _mm_srli_epi32(phase, 32 - WAVETABLE_BITS));
+
+                __m128 a = _mm_set_ps(table[3][index[3]], table[2][index[2]], table[1][index[1]], table[0][index[0]]);
+                __m128 b = _mm_set_ps(table[3][index[3] + 1], table[2][index[2] + 1], table[1][index[1] + 1], table[0][index[0] + 1]);
+                __m128 frac = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(phase, frac_mask)), frac_scale);
+                __m128 v = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), frac));
+
+                noise = _mm_xor_si128(noise, _mm_slli_epi32(noise, 13));
+                noise = _mm_xor_si128(noise, _mm_srli_epi32(noise, 17));
+                noise = _mm_xor_si128(noise, _mm_slli_epi32(noise, 5));
+                __m128 n = _mm_mul_ps(_mm_cvtepi32_ps(noise), noise_scale);
+                v = _mm_or_ps(_mm_andnot_ps(is_noise, v), _mm_and_ps(is_noise, n));
+
+                v = _mm_mul_ps(v, amplitude);
+                amplitude = _mm_max_ps(_mm_add_ps(amplitude, delta), zero);
+                phase = _mm_add_epi32(phase, increment);
+
+                __m128 sum = _mm_add_ps(v, _mm_movehl_ps(v, v));
+                sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+                mono[f] += _mm_cvtss_f32(sum);
+            }
+
+            _mm_storeu_si128((__m128i*) q.phase, phase);
+            _mm_storeu_si128((__m128i*) q.noise, noise);
+            _mm_storeu_ps(q.amplitude, amplitude);
+        }
+
+        float* block = out + done * channels;
+        for(unsigned int f = 0; f < count; f++)
+            for(unsigned int c = 0; c < channels; c++)
+                block[f * channels + c] += mono[f] * gains[c];
+    }
+
+    for(unsigned int g = 0; g < s->quad_count; g++)
+    {
+        generator_quad& q = s->quads[g];
+
+        for(unsigned int k = 0; k < 4; k++)
+        {
+            if(q.state[k] == GENERATOR_IDLE) continue;
+
+            //Set exactly, so ramps don't drift.
+            q.amplitude[k] = q.end[k];
+
+            //Still counted as playing until handed back, so the bank keeps being rendered until it is.
+            if(q.state[k] == GENERATOR_RELEASING || (q.remaining[k] && q.remaining[k] <= frames))
+            {
+                q.state[k] = GENERATOR_IDLE;
+                q.expired[k] = 1;
+            }
+            else if(q.remaining[k])
+            {
+                q.remaining[k] -= frames;
+            }
+        }
+    }
+}
+
+/*
+The master resampler converts the summed mix from the engine's mix rate to its output rate, so voices at the mix rate skip resampling and
+the mix is converted once, however many voices it has. It's a polyphase windowed-sinc filter: RESAMPLER_TAPS taps under a Kaiser window
+(about 85 dB of stopband rejection), tabulated at RESAMPLER_PHASES phases and interpolated between them. The cutoff sits just under the
+lower of the two Nyquist frequencies. The input position is a whole frame plus a remainder in units of 1 / output rate, so it never drifts.
+*/
+#define RESAMPLER_TAPS 64
+#define RESAMPLER_PHASES 256
+
+struct fcal::master_resampler
+{
+    unsigned int channels, in_rate, out_rate;
+    unsigned int position, remainder;
+
+    //RESAMPLER_PHASES + 1 rows of RESAMPLER_TAPS taps, the last row being the first one moved by a whole frame.
+    float* kernel;
+
+    //Input history, one row of 'capacity' frames per channel, of which the first 'filled' are valid.
+    float* history;
+    unsigned int capacity, filled;
+
+    //The interleaved mix, before it's split into channels, 'capacity' frames.
+    float* input;
+};
+
+//The most input frames one call producing 'frames' output frames needs: up to the taps of its last frame, which is at most one frame past
+//frames * in_rate / out_rate.
+unsigned int resampler_input_frames(unsigned int frames, unsigned int in_rate, unsigned int out_rate)
+{
+    return (unsigned int) ((unsigned long long) frames * in_rate / out_rate) + 1 + RESAMPLER_TAPS;
+}
+
+//Creates a resampler for calls of up to 'max_frames' output frames. Everything it needs is allocated here, so it never allocates while mixing.
+fcal::master_resampler* resampler_create(unsigned int channels, unsigned int in_rate, unsigned int out_rate, unsigned int max_frames)
+{
+    fcal::master_resampler* r = new fcal::master_resampler();
+    r->channels = channels;
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->position = 0;
+    r->remainder = 0;
+
+    const double pi = 3.14159265358979323846;
+    const double beta = 8.6;
+    double half = RESAMPLER_TAPS / 2;
+    double cutoff = 0.92 * (out_rate < in_rate ? (double) out_rate / in_rate : 1);
+
+    r->kernel = alloc_floats((RESAMPLER_PHASES + 1) * RESAMPLER_TAPS);
+    for(unsigned int p = 0; p <= RESAMPLER_PHASES; p++)
+    {
+        float* row = r->kernel + p * RESAMPLER_TAPS;
+        double sum = 0;
+
+        for(unsigned int k = 0; k < RESAMPLER_TAPS; k++)
+        {
+            //Distance, in input frames, between tap k and the output frame.
+            double t = k - (half - 1) - (double) p / RESAMPLER_PHASES;
+            double x = t / half;
+            double window = x * x < 1 ? bessel_i0(beta * std::sqrt(1 - x * x)) / bessel_i0(beta) : 0;
+            double sinc = t == 0 ? cutoff : std::sin(pi * cutoff * t) / (pi * t);
+
+            row[k] = (float) (sinc * window);
+            sum += row[k];
+        }
+
+        //Unity gain at DC for every phase.
+        for(unsigned int k = 0; k < RESAMPLER_TAPS; k++)
+            row[k] = (float) (row[k] / sum);
+    }
+
+    //The first output frame lands on the first mixed frame; the history before it is silence.
+    r->capacity = resampler_input_frames(max_frames, in_rate, out_rate);
+    r->history = alloc_floats(channels * r->capacity);
+    r->filled = RESAMPLER_TAPS / 2 - 1;
+
+    r->input = new float[channels * r->capacity];
+    return r;
+}
+
+void resampler_destroy(fcal::master_resampler* r)
+{
+    if(!r) return;
+
+    _mm_free(r->kernel);
+    _mm_free(r->history);
+    delete[] r->input;
+    delete r;
+}
+
+/*
+An engine owns everything needed to produce one mix: its sources and test tones, master effects, spatial state, output format and backend, and
+the threads that drive them. Engines share no mutable state with each other, so any number of them can run side by side. The free functions
+in the fcal namespace act on the default engine.
+*/
+struct fcal::device_output
+{
+    IMMDeviceEnumerator* device_enumerator;
+    IMMDevice* audio_device;
+    IAudioClient* audio_client;
+    IAudioRenderClient* audio_render_client;
+
+    unsigned int buffer_frame_size;
+};
+
+/*
+One-shots are fire-and-forget voices taken from a fixed pool, so starting one never allocates and finishing one is O(1). Voice indices move
+between threads through two single-producer/single-consumer rings: play_oneshot() pops an idle voice from the free ring and pushes it on the
+start ring, and the audio thread moves started voices to its active list, then pushes them back on the free ring when they end. The active
+list is only touched by the audio thread, and a finished voice is swapped with the last active one. Ring positions are counters that only
+grow; FCAL_MAX_ONESHOTS is a power of two, so they stay valid when they wrap around.
+*/
+struct oneshot_voice
+{
+    fcal::audio_stream* stream;
+    fcal::reader_slot* slot;
+    fcal::play_cursor cursor;
+    fcal::voice_filter filter;
+    float volume, pitch, balance_left, balance_right;
+    bool started;
+};
+
+struct fcal::oneshot_pool
+{
+    oneshot_voice voices[FCAL_MAX_ONESHOTS];
+
+    unsigned int free_ring[FCAL_MAX_ONESHOTS];
+    std::atomic<unsigned int> free_read, free_write;
+
+    unsigned int start_ring[FCAL_MAX_ONESHOTS];
+    std::atomic<unsigned int> start_read, start_write;
+
+    unsigned int active[FCAL_MAX_ONESHOTS];
+    std::atomic<unsigned int> active_count;
+
+    //Serializes play_oneshot() callers, so one-shots can be started from any thread. The audio thread never takes it.
+    std::mutex lock;
+
+    //Filtered voices are rendered here first. Sized at open(), for the longest block.
+    float* scratch;
+    unsigned int scratch_size;
+};
+
+fcal::oneshot_pool* oneshot_create()
+{
+    fcal::oneshot_pool* pool = new fcal::oneshot_pool();
+
+    for(unsigned int i = 0; i < FCAL_MAX_ONESHOTS; i++)
+        pool->free_ring[i] = i;
+    pool->free_read = 0;
+    pool->free_write = FCAL_MAX_ONESHOTS;
+    pool->start_read = 0;
+    pool->start_write = 0;
+    pool->active_count = 0;
+
+    pool->scratch = NULL;
+    pool->scratch_size = 0;
+    return pool;
+}
+
+//Makes the scratch buffer hold at least 'samples' samples. Only called while the engine is closed.
+void oneshot_reserve(fcal::oneshot_pool* pool, unsigned int samples)
+{
+    if(pool->scratch_size >= samples) return;
+
+    delete[] pool->scratch;
+    pool->scratch = new float[samples];
+    pool->scratch_size = samples;
+}
+
+void oneshot_destroy(fcal::oneshot_pool* pool)
+{
+    delete[] pool->scratch;
+    delete pool;
+}
+
+fcal::engine::engine() : active(false), taps_busy(false), ring_read(0), ring_write(0), underruns(0), queue_frames(0), late(false),
+    event_read(0), event_write(0)
+{
+    audio_thread = NULL;
+    mix_thread = NULL;
+    offline = false;
+
+    req_buffer_ms = buffer_duration_ms = 0;
+    frame_per_msec = 0;
+    format = NULL;
+    memset(&offline_format, 0, sizeof(offline_format));
+
+    mix_rate = 0;
+    memset(&mix_format, 0, sizeof(mix_format));
+    resampler = NULL;
+    max_frames = max_mix_frames = 0;
+    output = NULL;
+
+    device = new device_output();
+
+    master_volume = 1;
+    master_pitch = 1;
+    master_balance_left = 1;
+    master_balance_right = 1;
+
+    master_convolver = NULL;
+    convolver_busy = false;
+    master_metering = false;
+
+    for(unsigned int i = 0; i < FCAL_MAX_TAPS; i++)
+        master_taps[i] = NULL;
+
+    ahead_blocks = 0;
+    ahead_block_ms = 10;
+    ring_frames = block_frames = 0;
+    ring = NULL;
+
+    adaptive_ms = 0;
+    queue_min = queue_max = queue_step = stable_frames = 0;
+
+    sources_ready = false;
+
+    spatial = spatial_create();
+    oneshots = oneshot_create();
+    tones = new generator_bank();
+}
+
+fcal::engine::~engine()
+{
+    close();
+
+    for(unsigned int i = 0; i < source_list.size(); i++)
+    {
+        if(source_list[i]->owner == this)
+        {
+            source_list[i]->owner = NULL;
+            source_list[i]->emitter = FCAL_MAX_EMITTERS;
+        }
+    }
+
+    spatial_destroy(spatial);
+    oneshot_destroy(oneshots);
+    delete tones;
+    delete device;
+}
+
+//Plays a test sound (sine wave at 400 Hz) for 'ms' milliseconds.
+void fcal::engine::play_test_sound(unsigned int ms)
+{
+    if(!format) return;
+
+    tones->add(FCAL_WAVE_SINE, 400, 1, ms / 1000.0f);
+}
+
+//Plays 'stream' once, with no source to manage. Returns false if all FCAL_MAX_ONESHOTS voices are busy, in which case nothing is played. The
+//stream must stay alive until it's done playing.
+bool fcal::engine::play_oneshot(audio_stream* stream, const oneshot_params& params)
+{
+    if(!stream || !stream->is_valid()) return false;
+
+    if(!stream->bind(this))
+    {
+        std::cerr << "Stream " << stream->filepath << " is already played by another engine." << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(oneshots->lock);
+
+    unsigned int r = oneshots->free_read.load(std::memory_order_relaxed);
+    if(r == oneshots->free_write.load(std::memory_order_acquire))
+        return false;
+
+    unsigned int v = oneshots->free_ring[r % FCAL_MAX_ONESHOTS];
+    oneshots->free_read.store(r + 1, std::memory_order_release);
+
+    oneshot_voice& voice = oneshots->voices[v];
+    voice.stream = stream;
+    voice.slot = stream->acquire_reader();
+    voice.cursor.position = (double) (params.start > 0 ? params.start : 0) * stream->get_format().nSamplesPerSec;
+    voice.cursor.loops = 0;
+    voice.cursor.starved = 0;
+    voice.cursor.reader = voice.slot ? voice.slot->reader : NULL;
+    voice.filter.primed = false;
+    voice.started = false;
+    voice.volume = params.volume;
+    voice.pitch = params.pitch;
+    voice.balance_left = params.balance_left;
+    voice.balance_right = params.balance_right;
+
+    //The start ring can't be full: it only holds voices that were taken from the free ring.
+    unsigned int w = oneshots->start_write.load(std::memory_order_relaxed);
+    oneshots->start_ring[w % FCAL_MAX_ONESHOTS] = v;
+    oneshots->start_write.store(w + 1, std::memory_order_release);
+
+    return true;
+}
+
+//Returns how many one-shots were playing at the end of the last block.
+unsigned int fcal::engine::get_oneshot_count()
+{
+    return oneshots->active_count;
+}
+
+//Mixes every playing one-shot into 'data', and returns the voices that ended to the free ring.
+void fcal::engine::mix_oneshots(float* data, unsigned int frames)
+{
+    oneshot_pool* pool = oneshots;
+    unsigned int channels = mix_format.nChannels;
+    unsigned int count = pool->active_count.load(std::memory_order_relaxed);
+
+    unsigned int r = pool->start_read.load(std::memory_order_relaxed);
+    unsigned int w = pool->start_write.load(std::memory_order_acquire);
+    for(; r != w; r++)
+        pool->active[count++] = pool->start_ring[r % FCAL_MAX_ONESHOTS];
+    pool->start_read.store(r, std::memory_order_release);
+
+    for(unsigned int i = 0; i < count;)
+    {
+        oneshot_voice& voice = pool->voices[pool->active[i]];
+
+        float gains[FCAL_MAX_CHANNELS];
+        channel_gains(channels, voice.balance_left * master_balance_left, voice.balance_right * master_balance_right, gains);
+        for(unsigned int c = 0; c < channels; c++)
+            gains[c] *= voice.volume * master_volume;
+
+        play_cursor from = voice.cursor;
+        bool end = false;
+        if(voice.stream->has_filter())
+        {
+            memset(pool->scratch, 0, frames * channels * sizeof(float));
+            voice.stream->mix(voice.cursor, frames, &mix_format, voice.pitch * master_pitch, gains, pool->scratch, &end);
+            filter_interleaved(pool->scratch, frames, channels, &voice.filter, voice.stream->get_filter_coefficients(mix_format.nSamplesPerSec));
+
+            for(unsigned int k = 0; k < frames * channels; k++)
+                data[k] += pool->scratch[k];
+        }
+        else
+        {
+            voice.stream->mix(voice.cursor, frames, &mix_format, voice.pitch * master_pitch, gains, data, &end);
+        }
+
+        post_voice_events(NULL, voice.stream, voice.started, from, voice.cursor, end);
+
+        if(!end)
+        {
+            i++;
+            continue;
+        }
+
+        release_reader(voice.slot);
+
+        unsigned int fw = pool->free_write.load(std::memory_order_relaxed);
+        pool->free_ring[fw % FCAL_MAX_ONESHOTS] = pool->active[i];
+        pool->free_write.store(fw + 1, std::memory_order_release);
+
+        pool->active[i] = pool->active[--count];
+    }
+
+    pool->active_count.store(count, std::memory_order_relaxed);
+}
+
+/*
+The render thread mixes 'sources', which only it touches. register_source() and remove_source() change 'source_list' on the game thread and
+publish a copy of it in 'next_sources', which the render thread swaps in at the start of its next block, under a lock it only tries to
+take, like a source's play requests. The swap hands the old list back in 'next_sources', so the render thread never allocates or frees.
+When no thread renders on its own (the engine is closed, or offline and rendered by the caller) the copy is swapped in right away.
+*/
+void fcal::engine::publish_sources()
+{
+    {
+        std::lock_guard<std::mutex> guard(source_lock);
+        next_sources = source_list;
+
+        if(!active || offline)
+        {
+            sources.swap(next_sources);
+            sources_ready = false;
+            return;
+        }
+
+        sources_ready = true;
+    }
+
+    //Once the render thread has swapped the list in, it starts its blocks from it, so anything removed is no longer touched.
+    while(sources_ready)
+        std::this_thread::yield();
+}
+
+//Adds an audio_source object to the sources list. This means that the playback thread will be listening for streams playing on this source.
+//A source can only be registered with one engine at a time. Sources are registered and removed from the game thread; on an offline engine,
+//not while another thread is in render().
+void fcal::engine::register_source(fcal::audio_source* source)
+{
+    if(source->owner && source->owner != this)
+    {
+        std::cerr << "Source " << source << " is already registered with another engine." << std::endl;
+        return;
+    }
+
+    if(!source->owner)
+    {
+        source->owner = this;
+        source->emitter = alloc_emitter(spatial);
+        if(source->emitter == FCAL_MAX_EMITTERS)
+            std::cerr << "Out of spatial emitters, source " << source << " can't be positioned." << std::endl;
+        source->sync_emitter();
+
+        //Not mixed yet, so its buffers can be sized here rather than on the audio thread.
+        if(format) source->reserve(max_mix_frames, mix_format.nChannels);
+    }
+
+    source_list.push_back(source);
+    publish_sources();
+}
+
+//Removes an audio_source object from the sources list. The audio playback thread will no longer listen to streams on this source. Once
+//this returns the render thread won't touch the source again, so it can be deleted.
+void fcal::engine::remove_source(fcal::audio_source* source)
+{
+    for(unsigned int i = 0; i < source_list.size(); i++)
+    {
+        if(source_list[i] == source)
+        {
+            source_list.erase(source_list.begin() + i);
+            break;
+        }
+        if(i == source_list.size() - 1)
+        {
+            std::cerr << "Couldn't locate source to remove: " << source << std::endl;
+        }
+    }
+
+    publish_sources();
+
+    for(unsigned int i = 0; i < source_list.size(); i++)
+        if(source_list[i] == source) return;
+
+    if(source->owner == this)
+    {
+        free_emitter(spatial, source->emitter);
+        source->emitter = FCAL_MAX_EMITTERS;
+        source->owner = NULL;
+    }
+}
+
+//Error checker utility function for the WASAPI.
+bool check_result(HRESULT result)
+{
+    if(FAILED(result))
+    {
+        _com_error err(result);
+        std::cerr << err.ErrorMessage() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+//Mixes 'frames' frames at the output rate into 'data', which must be zeroed. Without a resampler, this is just mix_block(). Anything longer
+//than the buffers open() sized is mixed in pieces.
+void fcal::engine::mix_output(float* data, unsigned int frames)
+{
+    while(frames > max_frames)
+    {
+        mix_output(data, max_frames);
+        data += max_frames * format->nChannels;
+        frames -= max_frames;
+    }
+
+    master_resampler* r = resampler;
+    if(!r)
+    {
+        mix_block(data, frames);
+        return;
+    }
+
+    if(frames == 0) return;
+
+    unsigned int channels = r->channels;
+
+    //Drop the frames the previous call moved past.
+    if(r->position)
+    {
+        for(unsigned int c = 0; c < channels; c++)
+        {
+            float* row = r->history + c * r->capacity;
+            memmove(row, row + r->position, (r->filled - r->position) * sizeof(float));
+        }
+        r->filled -= r->position;
+        r->position = 0;
+    }
+
+    //Mix just enough frames to cover the taps of the last output frame, in one block.
+    unsigned long long last = ((unsigned long long) r->remainder + (unsigned long long) (frames - 1) * r->in_rate) / r->out_rate;
+    unsigned int needed = (unsigned int) last + RESAMPLER_TAPS;
+    if(needed > r->filled)
+    {
+        unsigned int count = needed - r->filled;
+        memset(r->input, 0, count * channels * sizeof(float));
+        mix_block(r->input, count);
+
+        for(unsigned int c = 0; c < channels; c++)
+        {
+            float* row = r->history + c * r->capacity + r->filled;
+            for(unsigned int i = 0; i < count; i++)
+                row[i] = r->input[i * channels + c];
+        }
+        r->filled = needed;
+    }
+
+    alignas(16) float taps[RESAMPLER_TAPS];
+    for(unsigned int i = 0; i < frames; i++)
+    {
+        //The taps for this frame's phase, interpolated between the two nearest rows.
+        double phase = (double) r->remainder * RESAMPLER_PHASES / r->out_rate;
+        unsigned int p = (unsigned int) phase;
+        __m128 t = _mm_set1_ps((float) (phase - p));
+
+        const float* k0 = r->kernel + p * RESAMPLER_TAPS;
+        const float* k1 = k0 + RESAMPLER_TAPS;
+        for(unsigned int k = 0; k < RESAMPLER_TAPS; k += 4)
+        {
+            __m128 a = _mm_load_ps(k0 + k);
+            _mm_store_ps(taps + k, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(k1 + k), a), t)));
+        }
+
+        for(unsigned int c = 0; c < channels; c++)
+        {
+            const float* x = r->history + c * r->capacity + r->position;
+
+            __m128 sum = _mm_setzero_ps();
+            for(unsigned int k = 0; k < RESAMPLER_TAPS; k += 4)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(taps + k)));
+
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+            data[i * channels + c] += _mm_cvtss_f32(sum);
+        }
+
+        r->remainder += r->in_rate;
+        r->position += r->remainder / r->out_rate;
+        r->remainder %= r->out_rate;
+    }
+}
+
+//Mixes 'frame_length' frames of every test tone and source, plus the master effects, into 'f_data' at the mix rate. 'f_data' must be zeroed.
+void fcal::engine::mix_block(float* f_data, unsigned int frame_length)
+{
+    unsigned int float_array_length = frame_length * mix_format.nChannels;
+
+    if(sources_ready && source_lock.try_lock())
+    {
+        sources.swap(next_sources);
+        sources_ready = false;
+        source_lock.unlock();
+    }
+
+    update_spatial(spatial);
+
+    //Test tones go to every channel at full scale, bypassing the master gains.
+    if(tones->is_playing())
+    {
+        float unity[FCAL_MAX_CHANNELS];
+        for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+            unity[c] = 1;
+        tones->render(f_data, frame_length, mix_format.nChannels, unity, mix_format.nSamplesPerSec);
+    }
+
+    //Whether a source plays is decided once per block, so a source that ends during its block still has all of it mixed.
+    for(unsigned int s = 0; s < sources.size(); s++)
+    {
+        if(!sources[s]->is_playing() && !sources[s]->has_tail()) continue;
+
+        sources[s]->renew_task(frame_length, &mix_format);
+
+        fcal::audio_task* t = sources[s]->get_task();
+        for(unsigned int i = 0; i < float_array_length; i++)
+        {
+            f_data[i] += t->data[t->offset];
+            t->offset++;
+        }
+    }
+
+    mix_oneshots(f_data, frame_length);
+
+    //set_convolver() waits on convolver_busy, like remove_tap() on taps_busy.
+    convolver_busy = true;
+    convolver* attached = master_convolver;
+    if(attached)
+        attached->process(f_data, frame_length);
+    convolver_busy = false;
+
+    if(master_metering)
+        master_meter.measure(f_data, frame_length, mix_format.nChannels);
+
+    //remove_tap() waits on taps_busy, so a tap is never written to after it's been removed.
+    taps_busy = true;
+    for(unsigned int i = 0; i < FCAL_MAX_TAPS; i++)
+    {
+        fcal::audio_tap* tap = master_taps[i];
+        if(tap) tap->write(f_data, frame_length, mix_format.nChannels, mix_format.nSamplesPerSec);
+    }
+    taps_busy = false;
+}
+
+/*
+Render-ahead mode. A mixing thread renders fixed-size blocks ahead of the device into a lock-free single-producer/single-consumer ring, and
+the device thread only converts what's in the ring, so a slow block eats into the headroom instead of glitching right away. The ring holds
+a whole number of blocks, so every block is written in one piece. Read and write positions are frame counts that only ever grow.
+*/
+void fcal::engine::mix_thread_run()
+{
+    unsigned int channels = format->nChannels;
+
+    while(active)
+    {
+        unsigned long long w = ring_write.load(std::memory_order_relaxed);
+        unsigned long long r = ring_read.load(std::memory_order_acquire);
+
+        //Only fills the ring up to the current queue length, which is all of it unless the latency is adaptive.
+        if(w - r + block_frames > queue_frames)
+        {
+            Sleep(1);
+            continue;
+        }
+
+        float* block = ring + (w % ring_frames) * channels;
+        for(unsigned int i = 0; i < block_frames * channels; i++)
+            block[i] = 0;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mix_output(block, block_frames);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        //A block that took longer to render than to play is a missed deadline, even if the headroom hid it this time.
+        if(elapsed * format->nSamplesPerSec > block_frames) late = true;
+
+        ring_write.store(w + block_frames, std::memory_order_release);
+    }
+}
+
+//Returns how many rendered frames are waiting in the ring. Called from the device thread.
+unsigned int fcal::engine::ring_available()
+{
+    return (unsigned int) (ring_write.load(std::memory_order_acquire) - ring_read.load(std::memory_order_relaxed));
+}
+
+//Converts 'frames' frames from the ring into the device buffer. The device thread never asks for more than ring_available().
+void fcal::engine::read_ring(unsigned char* data, unsigned int frames)
+{
+    unsigned int channels = format->nChannels;
+    unsigned int bytes_per_sample = format->wBitsPerSample / 8;
+
+    unsigned long long r = ring_read.load(std::memory_order_relaxed);
+    unsigned long long w = ring_write.load(std::memory_order_acquire);
+
+    unsigned int available = w - r < frames ? (unsigned int) (w - r) : frames;
+    unsigned int done = 0;
+
+    while(done < available)
+    {
+        unsigned int offset = (r + done) % ring_frames;
+        unsigned int n = available - done;
+        if(n > ring_frames - offset) n = ring_frames - offset;
+
+        conv_floats_to_bytes(data + done * channels * bytes_per_sample, ring + offset * channels, n * channels, bytes_per_sample);
+        done += n;
+    }
+
+    ring_read.store(r + available, std::memory_order_release);
+}
+
+//Writes the audio output (rendering) buffer.
+void fcal::engine::write_buffer(unsigned char* data, unsigned int buffer_frame_length)
+{
+    if(ring)
+    {
+        read_ring(data, buffer_frame_length);
+        return;
+    }
+
+    unsigned int float_array_length = buffer_frame_length * format->nChannels;
+
+    //Sized for the whole device buffer at open(), so nothing is allocated here.
+    float* f_data = output;
+    for(unsigned int i = 0; i < float_array_length; i++)
+    {
+        f_data[i] = 0;
+    }
+
+    mix_output(f_data, buffer_frame_length);
+
+    conv_floats_to_bytes(data, f_data, float_array_length, format->wBitsPerSample / 8);
+}
+
+//Releases whatever part of the WASAPI output has been acquired.
+void release_device(fcal::device_output* device)
+{
+    if(device->audio_render_client) device->audio_render_client->Release();
+    if(device->audio_client) device->audio_client->Release();
+    if(device->audio_device) device->audio_device->Release();
+    if(device->device_enumerator) device->device_enumerator->Release();
+
+    memset(device, 0, sizeof(fcal::device_output));
+}
+
+HRESULT fcal::engine::wasapi_init()
+{
+    //Initialize Windows COM library.
+    HRESULT hr = CoInitialize(NULL);
+    VERIFY(hr);
+
+    //Create a Windows multimedia device enumerator instance. As of 2023, this is only used for getting audio endpoint devices.
+    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**) &device->device_enumerator);
+    VERIFY(hr);
+
+    //Get the actual audio device (headphones/speakers) to be used for playback (rendering).
+    hr = device->device_enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &device->audio_device);
+    VERIFY(hr);
+
+    //The AudioClient interface is what we use to create an audio stream between the application and engine layer.
+
+    hr = device->audio_device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**) &device->audio_client);
+    VERIFY(hr);
+
+    //Getting the format of the endpoint device (sample rate, bit depth, etc).
+    hr = device->audio_client->GetMixFormat(&format);
+    VERIFY(hr);
+
+    //Initializing the audio stream.
+    hr = device->audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, (REFERENCE_TIME) (req_buffer_ms * 10000), 0, format, NULL);
+    VERIFY(hr);
+    hr = device->audio_client->GetBufferSize(&device->buffer_frame_size);
+    VERIFY(hr);
+
+    //Getting a render client. This will let us actually write to the rendering buffer, which will then get sent down to the audio engine.
+    hr = device->audio_client->GetService(__uuidof(IAudioRenderClient), (void**) &device->audio_render_client);
+    VERIFY(hr);
+
+    //Should be the duration in ms of the actual buffer - assuming everything goes right.
+    buffer_duration_ms = (device->buffer_frame_size * 1000) / format->nSamplesPerSec;
+    frame_per_msec = (double) format->nSamplesPerSec / (1000 * format->nChannels * format->wBitsPerSample / 8);
+
+    if(print_info)
+    {
+        std::cout << "Audio client initialized." << std::endl;
+        std::cout << "   Sample rate: " << format->nSamplesPerSec << std::endl;
+        std::cout << "   Bit depth:   " << format->wBitsPerSample << std::endl;
+        std::cout << "   Channels:    " << format->nChannels << ((format->nChannels == 1) ? " (mono)" : " (stereo)") << std::endl;
+        std::cout << "   Buffer size: " << device->buffer_frame_size << std::endl;
+        std::cout << "     Duration:  " << buffer_duration_ms << "ms" << std::endl;
+        std::cout << "     Frames/ms: " << frame_per_msec << std::endl;
+    }
+
+    return hr;
+}
+
+//Opens and maintains the audio rendering thread, used by WASAPI.
+HRESULT fcal::engine::thread_open()
+{
+    IAudioClient* audio_client = device->audio_client;
+    IAudioRenderClient* audio_render_client = device->audio_render_client;
+
+    //Starting the audio client, this will begin playback.
+    HRESULT hr = audio_client->Start();
+    VERIFY(hr);
+
+    unsigned char* data;
+    unsigned int used_buffer_size;
+    bool started = false;
+
+    while(active)
+    {
+        //Get size of remaining buffer space.
+        hr = audio_client->GetCurrentPadding(&used_buffer_size);
+        VERIFY(hr);
+        unsigned int remaining_buffer_size = device->buffer_frame_size - used_buffer_size;
+
+        //An empty buffer once audio has been written means the device ran dry and played silence.
+        bool missed = started && used_buffer_size == 0;
+        if(missed) underruns++;
+
+        //In render-ahead mode, only what the mixing thread has rendered is written. Whatever is still queued in the device keeps playing
+        //meanwhile, so a ring that's momentarily behind (or still filling after open()) doesn't insert silence.
+        if(ring)
+        {
+            unsigned int available = ring_available();
+            if(available < remaining_buffer_size) remaining_buffer_size = available;
+        }
+
+        //With adaptive latency (and no ring, which has its own queue), only keep the current queue length in the device buffer.
+        if(adaptive_ms && !ring)
+        {
+            unsigned int queue = queue_frames;
+            unsigned int wanted = queue > used_buffer_size ? queue - used_buffer_size : 0;
+            if(wanted < remaining_buffer_size) remaining_buffer_size = wanted;
+        }
+
+        double elapsed = 0;
+        if(remaining_buffer_size)
+        {
+            //Getting a pointer to the data, so that we can write to it.
+            hr = audio_render_client->GetBuffer(remaining_buffer_size, &data);
+            VERIFY(hr);
+
+            //Continue writing to that space.
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            write_buffer(data, remaining_buffer_size);
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            //Release it to the audio client.
+            hr = audio_render_client->ReleaseBuffer(remaining_buffer_size, 0);
+            VERIFY(hr);
+        }
+
+        if(adaptive_ms)
+        {
+            //Without a ring, rendering through most of what was still queued is a near miss. With one, the device getting down to less
+            //than a block (the ring couldn't keep it fed) or a block rendering slower than real time is.
+            if(!ring) missed = missed || (started && elapsed * format->nSamplesPerSec > used_buffer_size * 0.75);
+            else missed = missed || (started && used_buffer_size < block_frames) || late.exchange(false);
+
+            adapt_latency(missed, remaining_buffer_size);
+        }
+
+        if(remaining_buffer_size) started = true;
+
+        if(adaptive_ms && !ring)
+        {
+            unsigned int queue_ms = queue_frames * 1000 / format->nSamplesPerSec;
+            Sleep(queue_ms / 4 ? queue_ms / 4 : 1);
+        }
+        else if(ring)
+        {
+            //The device only gets what the ring held (up to the queue length), so it's topped up again before that much has played.
+            unsigned int ring_ms = queue_frames * 1000 / format->nSamplesPerSec;
+            unsigned int wait = ring_ms < buffer_duration_ms ? ring_ms / 2 : buffer_duration_ms / 2;
+            Sleep(wait ? wait : 1);
+        }
+        else
+            Sleep(buffer_duration_ms / 2);
+    }
+
+    //Stop the audio stream.
+    hr = audio_client->Stop();
+    VERIFY(hr);
+
+    //Release all COM resources.
+    release_device(device);
+
+    return hr;
+}
+
+/*
+Sets up the mix format: the output's channels as 32-bit floats, at the mix rate. Adds the master resampler if that isn't the output rate.
+'frames' is the most output frames one mix_output() call is asked for; the buffers the mix needs are sized for it here, so the audio thread
+never allocates.
+*/
+void fcal::engine::open_mix(unsigned int frames)
+{
+    mix_format = *format;
+    mix_format.wFormatTag = 3; //WAVE_FORMAT_IEEE_FLOAT
+    mix_format.wBitsPerSample = 32;
+    mix_format.nBlockAlign = format->nChannels * 4;
+    mix_format.cbSize = 0;
+    if(mix_rate) mix_format.nSamplesPerSec = mix_rate;
+    mix_format.nAvgBytesPerSec = mix_format.nBlockAlign * mix_format.nSamplesPerSec;
+
+    max_frames = frames;
+    max_mix_frames = frames;
+
+    if(mix_format.nSamplesPerSec != format->nSamplesPerSec)
+    {
+        resampler = resampler_create(format->nChannels, mix_format.nSamplesPerSec, format->nSamplesPerSec, frames);
+        max_mix_frames = resampler->capacity;
+
+        if(print_info)
+            std::cout << "Mixing at " << mix_format.nSamplesPerSec << " Hz, resampled to " << format->nSamplesPerSec << " Hz." << std::endl;
+    }
+
+    //Nothing renders yet, so the list is brought up to date here.
+    oneshot_reserve(oneshots, max_mix_frames * mix_format.nChannels);
+    sources = source_list;
+    sources_ready = false;
+    for(unsigned int i = 0; i < sources.size(); i++)
+        sources[i]->reserve(max_mix_frames, mix_format.nChannels);
+}
+
+//Opens the audio rendering (playback) thread on the default output device.
+void fcal::engine::open(unsigned int requested_buffer_time)
+{
+    if(active)
+    {
+        std::cerr << "Engine " << this << " is already open." << std::endl;
+        return;
+    }
+
+    tones->clear();
+    active = true;
+    offline = false;
+    req_buffer_ms = requested_buffer_time;
+
+    HRESULT hr = wasapi_init();
+
+    if(!check_result(hr))
+    {
+        std::cerr << "Failed to start audio playback thread." << std::endl;
+
+        release_device(device);
+        if(format) CoTaskMemFree(format);
+        format = NULL;
+        active = false;
+        return;
+    }
+
+    underruns = 0;
+
+    if(ahead_blocks)
+    {
+        block_frames = format->nSamplesPerSec * ahead_block_ms / 1000;
+        if(block_frames == 0) block_frames = 1;
+        ring_frames = block_frames * ahead_blocks;
+        ring = new float[ring_frames * format->nChannels];
+        ring_read = 0;
+        ring_write = 0;
+        open_mix(block_frames);
+    }
+    else
+    {
+        open_mix(device->buffer_frame_size);
+        output = new float[device->buffer_frame_size * format->nChannels];
+    }
+
+    //The queue adaptive latency works on: the device buffer, or the ring in render-ahead mode, in whole blocks. Without adaptive latency it
+    //stays at its maximum, which is how fcal always worked.
+    queue_max = ring ? ring_frames : device->buffer_frame_size;
+    queue_step = ring ? block_frames : (format->nSamplesPerSec + 999) / 1000;
+    queue_min = queue_max;
+    if(adaptive_ms)
+    {
+        queue_min = (format->nSamplesPerSec * adaptive_ms / 1000 + queue_step - 1) / queue_step * queue_step;
+        if(queue_min < queue_step) queue_min = queue_step;
+        if(queue_min > queue_max) queue_min = queue_max;
+    }
+    queue_frames = queue_min;
+    stable_frames = 0;
+    late = false;
+
+    if(ring)
+    {
+        mix_thread = new std::thread(&fcal::engine::mix_thread_run, this);
+
+        if(print_info)
+            std::cout << "Rendering " << ahead_blocks << " blocks of " << block_frames << " frames ahead." << std::endl;
+    }
+
+    audio_thread = new std::thread(&fcal::engine::thread_open, this);
+}
+
+//The block an offline engine mixes in; render() calls asking for more are split into blocks this long.
+#define OFFLINE_BLOCK_FRAMES 4096
+
+/*
+Opens the engine without an output device. Nothing plays on its own: every call to render() mixes the next block on the calling thread, as
+32-bit float frames of 'channels' channels at 'sample_rate'. This is meant for servers and tools rendering many independent mixes at once, one
+engine per mix, on as many threads as there are cores.
+*/
+void fcal::engine::open_offline(unsigned int sample_rate, unsigned int channels)
+{
+    if(active)
+    {
+        std::cerr << "Engine " << this << " is already open." << std::endl;
+        return;
+    }
+
+    if(sample_rate == 0 || channels == 0 || channels > FCAL_MAX_CHANNELS)
+    {
+        std::cerr << "Invalid offline format: " << sample_rate << " Hz, " << channels << " channels." << std::endl;
+        return;
+    }
+
+    offline_format.wFormatTag = 3; //WAVE_FORMAT_IEEE_FLOAT
+    offline_format.nChannels = channels;
+    offline_format.nSamplesPerSec = sample_rate;
+    offline_format.wBitsPerSample = 32;
+    offline_format.nBlockAlign = channels * 4;
+    offline_format.nAvgBytesPerSec = offline_format.nBlockAlign * sample_rate;
+    offline_format.cbSize = 0;
+
+    tones->clear();
+    format = &offline_format;
+    frame_per_msec = sample_rate / 1000.0;
+    open_mix(OFFLINE_BLOCK_FRAMES);
+    offline = true;
+    active = true;
+}
+
+//Closes the audio rendering (playback) thread. Does nothing if the engine isn't open.
+void fcal::engine::close()
+{
+    if(!active) return;
+    active = false;
+
+    if(audio_thread)
+    {
+        audio_thread->join();
+        delete audio_thread;
+        audio_thread = NULL;
+    }
+
+    if(mix_thread)
+    {
+        mix_thread->join();
+        delete mix_thread;
+        mix_thread = NULL;
+
+        delete[] ring;
+        ring = NULL;
+    }
+
+    delete[] output;
+    output = NULL;
+
+    resampler_destroy(resampler);
+    resampler = NULL;
+
+    if(!offline) CoTaskMemFree(format);
+    format = NULL;
+}
+
+bool fcal::engine::is_open()
+{
+    return active;
+}
+
+//Returns the engine's output format. All zeroes if the engine isn't open.
+WAVEFORMATEX fcal::engine::get_format()
+{
+    WAVEFORMATEX result;
+    if(format)
+        result = *format;
+    else
+        memset(&result, 0, sizeof(result));
+    return result;
+}
+
+//Mixes the next 'frames' frames of an offline engine into 'out', overwriting it. Separate engines can be rendered from separate threads at
+//the same time.
+void fcal::engine::render(float* out, unsigned int frames)
+{
+    if(!active || !offline)
+    {
+        std::cerr << "Engine " << this << " isn't open for offline rendering." << std::endl;
+        return;
+    }
+
+    memset(out, 0, frames * format->nChannels * sizeof(float));
+    mix_output(out, frames);
+}
+
+/*
+Sets the rate everything is mixed at from the next open() or open_offline(). The mix is then converted to the output rate once, on the
+master bus, so voices already at the mix rate aren't resampled one by one. 0 (the default) mixes at the output rate, with no conversion.
+*/
+void fcal::engine::set_mix_rate(unsigned int sample_rate)
 {
-    return balance_right;
+    mix_rate = sample_rate;
 }
 
-float fcal::audio_source::get_volume()
+//Returns the rate the engine mixes at, which is what sources, effects and taps see. 0 if the engine isn't open.
+unsigned int fcal::engine::get_mix_rate()
 {
-    return volume;
+    return format ? mix_format.nSamplesPerSec : 0;
 }
 
-float fcal::audio_source::get_pitch()
+//Enables render-ahead mode from the next open(): mixing moves to its own thread, which stays 'blocks' blocks of 'block_ms' ms ahead of the
+//device. This adds up to blocks * block_ms of latency, in exchange for tolerating slow blocks. 0 blocks (the default) mixes on the device
+//thread. Offline engines ignore this, as render() is already driven by the caller.
+void fcal::engine::set_render_ahead(unsigned int blocks, unsigned int block_ms)
 {
-    return pitch;
+    ahead_blocks = blocks;
+    ahead_block_ms = block_ms ? block_ms : 1;
 }
 
-fcal::audio_task* fcal::audio_source::get_task()
+//Returns how many times the device buffer has run dry since open(), each of which played some silence.
+unsigned int fcal::engine::get_underrun_count()
 {
-    return task;
+    return underruns;
 }
 
-unsigned int fcal::audio_source::get_stream_list_size()
+/*
+Enables adaptive latency from the next open(). fcal then keeps only 'target_ms' queued ahead of the device (in render-ahead mode, in the
+ring), and measures every pass: a missed deadline (the device running dry, or rendering taking too long for what was queued) grows the queue
+right away, by a quarter; every two seconds without one shrinks it by a step, back toward the target. open()'s buffer time (or the ring) is
+the most it can grow to. 0 (the default) disables it, keeping the whole buffer full.
+*/
+void fcal::engine::set_adaptive_latency(unsigned int target_ms)
 {
-    return streams.size();
+    adaptive_ms = target_ms;
 }
 
-bool fcal::audio_source::is_playing()
+//Returns the latency the engine currently adds, in ms: what it keeps queued in the device buffer, plus the render-ahead ring. 0 if the engine
+//isn't playing on a device.
+float fcal::engine::get_latency()
 {
-    return streams.size() != 0;
+    if(!active || offline || !format) return 0;
+
+    float frames = queue_frames;
+    if(ring) frames += device->buffer_frame_size;
+    return frames * 1000 / format->nSamplesPerSec;
 }
 
-void fcal::audio_source::renew_task(unsigned int frame_length, WAVEFORMATEX* format)
+/*
+Posts the events for one voice's block, from the audio thread: started on its first block, starved when its reader couldn't deliver some of
+the data, a cue for every cue it passed between 'from' and 'to', looped for every new pass, and ended at its end. A voice that wrapped in
+this block passed everything from where it was to the loop end, then (after the wrap) from the loop start on. 'source' is NULL for one-shots.
+*/
+void fcal::engine::post_voice_events(audio_source* source, audio_stream* stream, bool& started, const play_cursor& from, const play_cursor& to,
+    bool end)
 {
-    if(task->offset < task->length) return;
-
-    //Maybe I should find a better way to do this.
-    for(unsigned int i = 0; i < stop_requests.size(); i++)
+    if(!started)
     {
-        for(unsigned int j = 0; j < streams.size(); j++)
-        {
-            if(streams[j] == stop_requests[i])
-            {
-                streams.erase(streams.begin() + j);
-                stream_offsets.erase(stream_offsets.begin() + j);
-                break;
-            }
-        }
-
-        stop_requests.erase(stop_requests.begin() + i);
-        i--;
+        started = true;
+        push_event(FCAL_EVENT_STARTED, source, stream, 0);
     }
 
-    unsigned int size = frame_length * format->nChannels;
+    if(to.starved != from.starved)
+        push_event(FCAL_EVENT_STARVED, source, stream, to.starved - from.starved);
 
-    float* sum_data = new float[size];
+    //The region the voice wrapped over is the one its loop cache was built for (see build_loop_cache()).
+    unsigned int region_start = 0, region_end = 0;
+    if(stream->cache)
+    {
+        region_start = stream->cache->start;
+        region_end = stream->cache->end;
+    }
 
-    for(unsigned int i = 0; i < size; i++)
-        sum_data[i] = 0;
+    bool wrapped = to.loops != from.loops;
+    for(unsigned int i = 0; i < stream->cues.size(); i++)
+    {
+        double cue = stream->cues[i].frame;
+        bool passed = wrapped ? cue >= from.position && cue < region_end : cue >= from.position && (cue < to.position || end);
+        if(passed) push_event(FCAL_EVENT_CUE, source, stream, stream->cues[i].id);
+    }
 
-    for(unsigned int i = 0; i < streams.size(); i++)
+    if(wrapped)
     {
-        bool end = false;
-        float prev = stream_offsets[i];
-        float* data = streams[i]->pull(stream_offsets[i], frame_length, format, &end, pitch * FCAL_master_pitch);
+        push_event(FCAL_EVENT_LOOPED, source, stream, to.loops);
 
-        for(unsigned int j = 0; j < size; j++)
+        for(unsigned int i = 0; i < stream->cues.size(); i++)
         {
-            sum_data[j] += data[j];
+            double cue = stream->cues[i].frame;
+            if(cue >= region_start && (cue < to.position || end)) push_event(FCAL_EVENT_CUE, source, stream, stream->cues[i].id);
         }
+    }
 
-        delete[] data;
+    if(end)
+        push_event(FCAL_EVENT_ENDED, source, stream, 0);
+}
 
-        if(end)
-        {
-            if(streams[i]->get_flag(FCAL_STRF_LOOP))
-            {
-                unsigned int diff = stream_offsets[i] - prev;
-                stream_offsets[i] = 0;
-                float* new_data = streams[i]->pull(stream_offsets[i], frame_length - diff, format, &end, pitch * FCAL_master_pitch);
-                for(unsigned int j = diff * format->nChannels; j < size; j++)
-                {
-                    sum_data[j] += new_data[j - (diff * format->nChannels)];
-                }
-                delete[] new_data;
-            }
-            else
-            {
-                streams.erase(streams.begin() + i);
-                stream_offsets.erase(stream_offsets.begin() + i);
-                i--;
-            }
-        }
-    }
+/*
+Playback events go from the audio thread to the game through a single-producer/single-consumer ring, like the one-shot rings: the audio thread
+only ever writes an event and moves the write position, and poll_event() reads one and moves the read position, so neither side waits. When
+the ring is full, new events are dropped. Positions are counters that only grow; FCAL_EVENT_CAPACITY is a power of two.
+*/
+void fcal::engine::push_event(unsigned int type, audio_source* source, audio_stream* stream, unsigned int value)
+{
+    unsigned int w = event_write.load(std::memory_order_relaxed);
+    if(w - event_read.load(std::memory_order_acquire) >= FCAL_EVENT_CAPACITY)
+        return;
 
-    apply_balance(sum_data, size);
-    apply_volume(sum_data, size);
+    playback_event& event = events[w % FCAL_EVENT_CAPACITY];
+    event.type = type;
+    event.source = source;
+    event.stream = stream;
+    event.value = value;
 
-    delete[] task->data;
-    task->data = sum_data;
-    task->length = size;
-    task->offset = 0;
-    task->stream_end = false;
-    task->type = TASKTYPE_SOURCE;
+    event_write.store(w + 1, std::memory_order_release);
 }
 
-void fcal::audio_source::play(audio_stream* stream)
+//Takes the oldest playback event off the queue. Returns false if there are none. Meant to be called in a loop once per game frame, from one
+//thread, until it returns false.
+bool fcal::engine::poll_event(playback_event& event)
 {
-    streams.push_back(stream);
-    stream_offsets.push_back(0);
+    unsigned int r = event_read.load(std::memory_order_relaxed);
+    if(r == event_write.load(std::memory_order_acquire))
+        return false;
+
+    event = events[r % FCAL_EVENT_CAPACITY];
+    event_read.store(r + 1, std::memory_order_release);
+    return true;
 }
 
-void fcal::audio_source::stop(audio_stream* stream)
+//Feeds one pass of the device thread to the adaptive latency controller. Misses grow the queue at once; shrinking waits for 2 s of clean output.
+void fcal::engine::adapt_latency(bool missed, unsigned int frames)
 {
-    for(unsigned int i = 0; i < streams.size(); i++)
+    unsigned int queue = queue_frames;
+
+    if(missed)
     {
-        if(streams[i] == stream)
-        {
-            stop_requests.push_back(stream);
-            break;
-        }
-        if(i == streams.size() - 1)
+        unsigned int grow = (queue / 4 + queue_step - 1) / queue_step * queue_step;
+        if(grow < queue_step) grow = queue_step;
+        queue = queue_max - queue > grow ? queue + grow : queue_max;
+        stable_frames = 0;
+    }
+    else
+    {
+        stable_frames += frames;
+        if(stable_frames >= format->nSamplesPerSec * 2)
         {
-            std::cerr << "Could not locate stream to stop: " << stream << std::endl;
+            stable_frames = 0;
+            queue = queue - queue_min > queue_step ? queue - queue_step : queue_min;
         }
     }
+
+    queue_frames = queue;
 }
 
-void fcal::audio_source::set_balance(float left, float right)
+float fcal::engine::get_balance_left()
 {
-    balance_left = left;
-    balance_right = right;
+    return master_balance_left;
 }
 
-void fcal::audio_source::set_volume(float value)
+float fcal::engine::get_balance_right()
 {
-    volume = value;
+    return master_balance_right;
 }
 
-void fcal::audio_source::set_pitch(float value)
+float fcal::engine::get_pitch()
 {
-    pitch = value;
+    return master_pitch;
 }
 
-static std::thread* audio_thread;
-
-static bool active;
-
-static int req_buffer_ms, buffer_duration_ms, sin_offset;
-static double frame_per_msec;
-static WAVEFORMATEX* format;
-
-static std::vector<fcal::audio_task> tasks;
-static std::vector<fcal::audio_source*> sources;
-
-//Generates a sine wave at 400 hz for buffer_frame_length frames. This is used as a test sound.
-float* generate_sin_wave(unsigned int buffer_frame_length)
+float fcal::engine::get_volume()
 {
-    DWORD sample_rate = format->nSamplesPerSec;
-    WORD channels = format->nChannels;
+    return master_volume;
+}
 
-    int floats_per_frame = channels;
+void fcal::engine::set_balance(float left, float right)
+{
+    master_balance_left = left;
+    master_balance_right = right;
+}
 
-    float freq = 400;
-    float factor = (float) sample_rate / freq;
+void fcal::engine::set_pitch(float value)
+{
+    master_pitch = value;
+}
 
-    float* data = new float[buffer_frame_length * floats_per_frame];
+void fcal::engine::set_volume(float value)
+{
+    master_volume = value;
+}
 
-    for(UINT32 i = 0; i < buffer_frame_length; i++)
-    {
-        float s = std::sin((float) sin_offset * 3.1415926f * 2 / factor);
-        for(int c = 0; c < floats_per_frame; c++)
-        {
-            int b = i * floats_per_frame + c;
-            data[b] = s;
-        }
-        sin_offset++;
-    }
+//Attaches a convolver to the master mix, or detaches it if 'conv' is NULL. Once this returns the render thread won't use the previous
+//convolver again, so it can be deleted.
+void fcal::engine::set_convolver(convolver* conv)
+{
+    master_convolver = conv;
 
-    return data;
+    while(convolver_busy)
+        std::this_thread::yield();
 }
 
-//Plays a test sound (sine wave at 400 Hz) for 'ms' milliseconds.
-void fcal::play_test_sound(unsigned int ms)
+//Returns the levels of the master mix's last block. Only updated while metering is enabled.
+fcal::meter_levels fcal::engine::get_levels()
 {
-    audio_task task;
-    task.data = generate_sin_wave(frame_per_msec * ms);
-    task.length = frame_per_msec * ms * format->nChannels;
-    task.offset = 0;
-    task.type = TASKTYPE_SINGLE;
-    tasks.push_back(task);
+    return master_meter.get_levels();
 }
 
-//Adds an audio_source object to the sources list. This means that the playback thread will be listening for streams playing on this source.
-void fcal::register_source(fcal::audio_source* source)
+//Enables peak/RMS metering of the master mix. Off by default.
+void fcal::engine::set_metering(bool enabled)
 {
-    sources.push_back(source);
+    master_metering = enabled;
 }
 
-//Removes an audio_source object from the sources list. The audio playback thread will no longer listen to streams on this source.
-void fcal::remove_source(fcal::audio_source* source)
+//Publishes every block of the master mix to 'tap'. Returns false if FCAL_MAX_TAPS taps are already attached.
+bool fcal::engine::add_tap(audio_tap* tap)
 {
-    for(unsigned int i = 0; i < sources.size(); i++)
+    for(unsigned int i = 0; i < FCAL_MAX_TAPS; i++)
     {
-        if(sources[i] == source)
-        {
-            sources.erase(sources.begin() + i);
-            break;
-        }
-        if(i == sources.size() - 1)
-        {
-            std::cerr << "Couldn't locate source to remove: " << source << std::endl;
-        }
+        audio_tap* empty = NULL;
+        if(master_taps[i].compare_exchange_strong(empty, tap))
+            return true;
     }
+
+    std::cerr << "Too many taps on the master mix: " << tap << std::endl;
+    return false;
 }
 
-//Error checker utility function for the WASAPI.
-bool check_result(HRESULT result)
+//Detaches a tap from the master mix. Once this returns the render thread won't touch the tap again, so it can be deleted.
+void fcal::engine::remove_tap(audio_tap* tap)
 {
-    if(FAILED(result))
+    for(unsigned int i = 0; i < FCAL_MAX_TAPS; i++)
     {
-        _com_error err(result);
-        std::cerr << err.ErrorMessage() << std::endl;
-        return false;
+        audio_tap* expected = tap;
+        master_taps[i].compare_exchange_strong(expected, NULL);
     }
 
-    return true;
+    while(taps_busy)
+        std::this_thread::yield();
 }
 
-//Writes the audio output (rendering) buffer.
-void write_buffer(unsigned char* data, unsigned int buffer_frame_length)
+void fcal::engine::set_listener_position(float x, float y, float z)
 {
-    WORD bit_depth = format->wBitsPerSample;
-    WORD channels = format->nChannels;
+    spatial_params* p = spatial_staging(spatial);
+    p->listener_position[0] = x;
+    p->listener_position[1] = y;
+    p->listener_position[2] = z;
+}
 
-    int bytes_per_sample = bit_depth / 8;
-    unsigned int float_array_length = buffer_frame_length * channels;
+//Sets the listener's facing direction and up vector. By default the listener faces -Z with +Y up, so +X is to the right.
+void fcal::engine::set_listener_orientation(float forward_x, float forward_y, float forward_z, float up_x, float up_y, float up_z)
+{
+    spatial_params* p = spatial_staging(spatial);
+    p->listener_forward[0] = forward_x;
+    p->listener_forward[1] = forward_y;
+    p->listener_forward[2] = forward_z;
+    p->listener_up[0] = up_x;
+    p->listener_up[1] = up_y;
+    p->listener_up[2] = up_z;
+}
 
-    float* f_data = new float[float_array_length];
+void fcal::engine::set_listener_velocity(float x, float y, float z)
+{
+    spatial_params* p = spatial_staging(spatial);
+    p->listener_velocity[0] = x;
+    p->listener_velocity[1] = y;
+    p->listener_velocity[2] = z;
+}
 
-    for(unsigned int i = 0; i < float_array_length; i++)
-    {
-        f_data[i] = 0;
-    }
+void fcal::engine::set_doppler_factor(float factor)
+{
+    spatial_staging(spatial)->doppler_factor = factor;
+}
 
-    for(unsigned int i = 0; i < float_array_length; i++)
+void fcal::engine::set_speed_of_sound(float speed)
+{
+    if(!(speed > 0))
     {
-        for(unsigned int t = 0; t < tasks.size(); t++)
-        {
-            f_data[i] += tasks[t].data[tasks[t].offset];
-            tasks[t].offset++;
-            if(tasks[t].offset >= tasks[t].length)
-            {
-                delete[] tasks[t].data;
-                tasks.erase(tasks.begin() + t);
-            }
-        }
-        for(unsigned int s = 0; s < sources.size(); s++)
-        {
-            if(sources[s]->is_playing())
-            {
-                sources[s]->renew_task(buffer_frame_length, format);
-                fcal::audio_task* t = sources[s]->get_task();
-                f_data[i] += t->data[t->offset];
-                t->offset++;
-            }
-        }
+        std::cerr << "Invalid speed of sound: " << speed << std::endl;
+        return;
     }
 
-    conv_floats_to_bytes(data, f_data, float_array_length, bytes_per_sample);
-    delete[] f_data;
+    spatial_staging(spatial)->speed_of_sound = speed;
 }
 
-static IMMDeviceEnumerator* device_enumerator;
-static IMMDevice* audio_device;
-static IAudioClient* audio_client;
-static IAudioRenderClient* audio_render_client;
-
-static unsigned int buffer_frame_size;
-
-HRESULT wasapi_init()
+//Publishes every listener and emitter change made since the last commit to the audio thread. Should be called once per game frame, from the
+//same thread that positions the sources.
+void fcal::engine::commit_spatial()
 {
-    //Initialize Windows COM library.
-    HRESULT hr = CoInitialize(NULL);
-    VERIFY(hr);
-
-    //Create a Windows multimedia device enumerator instance. As of 2023, this is only used for getting audio endpoint devices.
-    hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL, __uuidof(IMMDeviceEnumerator), (void**) &device_enumerator);
-    VERIFY(hr);
-
-    //Get the actual audio device (headphones/speakers) to be used for playback (rendering).
-    hr = device_enumerator->GetDefaultAudioEndpoint(eRender, eConsole, &audio_device);
-    VERIFY(hr);
-
-    //The AudioClient interface is what we use to create an audio stream between the application and engine layer.
-    
-    hr = audio_device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**) &audio_client);
-    VERIFY(hr);
-
-    //Getting the format of the endpoint device (sample rate, bit depth, etc).
-    hr = audio_client->GetMixFormat(&format);
-    VERIFY(hr);
-
-    //Initializing the audio stream.
-    hr = audio_client->Initialize(AUDCLNT_SHAREMODE_SHARED, 0, (REFERENCE_TIME) (req_buffer_ms * 10000), 0, format, NULL);
-    VERIFY(hr);
-    hr = audio_client->GetBufferSize(&buffer_frame_size);
-    VERIFY(hr);
-
-    //Getting a render client. This will let us actually write to the rendering buffer, which will then get sent down to the audio engine.
-    hr = audio_client->GetService(__uuidof(IAudioRenderClient), (void**) &audio_render_client);
-    VERIFY(hr);
-
-    //Should be the duration in ms of the actual buffer - assuming everything goes right.
-    buffer_duration_ms = (buffer_frame_size * 1000) / format->nSamplesPerSec;
-    frame_per_msec = (double) format->nSamplesPerSec / (1000 * format->nChannels * format->wBitsPerSample / 8);
-
-    if(print_info)
-    {
-        std::cout << "Audio client initialized." << std::endl;
-        std::cout << "   Sample rate: " << format->nSamplesPerSec << std::endl;
-        std::cout << "   Bit depth:   " << format->wBitsPerSample << std::endl;
-        std::cout << "   Channels:    " << format->nChannels << ((format->nChannels == 1) ? " (mono)" : " (stereo)") << std::endl;
-        std::cout << "   Buffer size: " << buffer_frame_size << std::endl;
-        std::cout << "     Duration:  " << buffer_duration_ms << "ms" << std::endl;
-        std::cout << "     Frames/ms: " << frame_per_msec << std::endl;
-    }
+    copy_spatial_params(&spatial->buffers[spatial->back], spatial_staging(spatial));
+    spatial->back = spatial->shared.exchange(spatial->back | SPATIAL_FRESH, std::memory_order_acq_rel) & 3;
 
-    return hr;
+    //Emitters freed before this commit are now published as disabled, so they can be reused.
+    while(spatial->retired_count > 0)
+        spatial->free_list[spatial->free_count++] = spatial->retired[--spatial->retired_count];
 }
 
-//Opens and maintains the audio rendering thread, used by WASAPI.
-HRESULT thread_open()
+//Returns the engine the free functions below act on. It's created on first use, and closed at exit if it's still open.
+fcal::engine* fcal::get_default_engine()
 {
-    //Starting the audio client, this will begin playback.
-    HRESULT hr = audio_client->Start();
-    VERIFY(hr);
-
-    unsigned char* data;
-    unsigned int used_buffer_size;
+    static engine default_engine;
+    return &default_engine;
+}
 
-    while(active)
-    {
-        //Get size of remaining buffer space.
-        hr = audio_client->GetCurrentPadding(&used_buffer_size);
-        VERIFY(hr);
-        unsigned int remaining_buffer_size = buffer_frame_size - used_buffer_size;
+//Opens the default engine's audio rendering (playback) thread.
+void fcal::open(unsigned int requested_buffer_time)
+{
+    get_default_engine()->open(requested_buffer_time);
+}
 
-        //Getting a pointer to the data, so that we can write to it.
-        hr = audio_render_client->GetBuffer(remaining_buffer_size, &data);
-        VERIFY(hr);
-        
-        //Continue writing to that space.
-        write_buffer(data, remaining_buffer_size);
+//Closes the default engine's audio rendering (playback) thread.
+void fcal::close()
+{
+    get_default_engine()->close();
+}
 
-        //Release it to the audio client.
-        hr = audio_render_client->ReleaseBuffer(remaining_buffer_size, 0);
-        VERIFY(hr);
+void fcal::play_test_sound(unsigned int ms)
+{
+    get_default_engine()->play_test_sound(ms);
+}
 
-        Sleep(buffer_duration_ms / 2);
-    }
+bool fcal::play_oneshot(audio_stream* stream, const oneshot_params& params)
+{
+    return get_default_engine()->play_oneshot(stream, params);
+}
 
-    //Stop the audio stream.
-    hr = audio_client->Stop();
-    VERIFY(hr);
+void fcal::register_source(fcal::audio_source* source)
+{
+    get_default_engine()->register_source(source);
+}
 
-    //Release all COM resources.
-    audio_client->Release();
-    audio_render_client->Release();
-    audio_device->Release();
-    device_enumerator->Release();
+void fcal::remove_source(fcal::audio_source* source)
+{
+    get_default_engine()->remove_source(source);
+}
 
-    return hr;
+void fcal::set_render_ahead(unsigned int blocks, unsigned int block_ms)
+{
+    get_default_engine()->set_render_ahead(blocks, block_ms);
 }
 
-//Opens the audio rendering (playback) thread.
-void fcal::open(unsigned int requested_buffer_time)
+void fcal::set_mix_rate(unsigned int sample_rate)
 {
-    sin_offset = 0;
-    std::vector<audio_task>().swap(tasks);
-    active = true;
-    req_buffer_ms = requested_buffer_time;
+    get_default_engine()->set_mix_rate(sample_rate);
+}
 
-    FCAL_master_volume = 1;
-    FCAL_master_pitch = 1;
-    FCAL_master_balance_left = 1;
-    FCAL_master_balance_right = 1;
+unsigned int fcal::get_underrun_count()
+{
+    return get_default_engine()->get_underrun_count();
+}
 
-    HRESULT hr = wasapi_init();
-    
-    if(check_result(hr)) 
-        audio_thread = new std::thread(thread_open);
-    else
-        std::cerr << "Failed to start audio playback thread." << std::endl;
+void fcal::set_adaptive_latency(unsigned int target_ms)
+{
+    get_default_engine()->set_adaptive_latency(target_ms);
 }
 
-//Closes the audio rendering (playback) thread.
-void fcal::close()
+float fcal::get_latency()
 {
-    active = false;
+    return get_default_engine()->get_latency();
+}
 
-    audio_thread->join();
-    delete audio_thread;
+bool fcal::poll_event(playback_event& event)
+{
+    return get_default_engine()->poll_event(event);
 }
 
 //Enable info printing. This will print information to the standard output relating to audio_stream objects and the audio playback thread, such
@@ -1078,36 +6476,90 @@ void fcal::enable_info_print()
 
 float fcal::get_balance_left()
 {
-    return FCAL_master_balance_left;
+    return get_default_engine()->get_balance_left();
 }
 
 float fcal::get_balance_right()
 {
-    return FCAL_master_balance_right;
+    return get_default_engine()->get_balance_right();
 }
 
 float fcal::get_pitch()
 {
-    return FCAL_master_pitch;
+    return get_default_engine()->get_pitch();
 }
 
 float fcal::get_volume()
 {
-    return FCAL_master_volume;
+    return get_default_engine()->get_volume();
 }
 
 void fcal::set_balance(float left, float right)
 {
-    FCAL_master_balance_left = left;
-    FCAL_master_balance_right = right;
+    get_default_engine()->set_balance(left, right);
 }
 
 void fcal::set_pitch(float value)
 {
-    FCAL_master_pitch = value;
+    get_default_engine()->set_pitch(value);
 }
 
 void fcal::set_volume(float value)
 {
-    FCAL_master_volume = value;
+    get_default_engine()->set_volume(value);
+}
+
+void fcal::set_convolver(convolver* conv)
+{
+    get_default_engine()->set_convolver(conv);
+}
+
+fcal::meter_levels fcal::get_levels()
+{
+    return get_default_engine()->get_levels();
+}
+
+void fcal::set_metering(bool enabled)
+{
+    get_default_engine()->set_metering(enabled);
+}
+
+bool fcal::add_tap(audio_tap* tap)
+{
+    return get_default_engine()->add_tap(tap);
+}
+
+void fcal::remove_tap(audio_tap* tap)
+{
+    get_default_engine()->remove_tap(tap);
+}
+
+void fcal::set_listener_position(float x, float y, float z)
+{
+    get_default_engine()->set_listener_position(x, y, z);
+}
+
+void fcal::set_listener_orientation(float forward_x, float forward_y, float forward_z, float up_x, float up_y, float up_z)
+{
+    get_default_engine()->set_listener_orientation(forward_x, forward_y, forward_z, up_x, up_y, up_z);
+}
+
+void fcal::set_listener_velocity(float x, float y, float z)
+{
+    get_default_engine()->set_listener_velocity(x, y, z);
+}
+
+void fcal::set_doppler_factor(float factor)
+{
+    get_default_engine()->set_doppler_factor(factor);
+}
+
+void fcal::set_speed_of_sound(float speed)
+{
+    get_default_engine()->set_speed_of_sound(speed);
+}
+
+void fcal::commit_spatial()
+{
+    get_default_engine()->commit_spatial();
 }
\ No newline at end of file
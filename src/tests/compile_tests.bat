@@ -0,0 +1,22 @@
+::Compiles with MinGW_w64. vorbis.cpp also needs libvorbisfile, libvorbis and libogg.
+
+::formats.cpp
+g++ -std=c++11 -Wall ../fcal.cpp formats.cpp -lole32 -lpthread -o formats.exe
+
+::convolution.cpp
+g++ -std=c++11 -Wall ../fcal.cpp convolution.cpp -lole32 -lpthread -o convolution.exe
+
+::storage.cpp
+g++ -std=c++11 -Wall ../fcal.cpp storage.cpp -lole32 -lpthread -o storage.exe
+
+::voices.cpp
+g++ -std=c++11 -Wall ../fcal.cpp voices.cpp -lole32 -lpthread -o voices.exe
+
+::loops.cpp
+g++ -std=c++11 -Wall ../fcal.cpp loops.cpp -lole32 -lpthread -o loops.exe
+
+::events.cpp
+g++ -std=c++11 -Wall ../fcal.cpp events.cpp -lole32 -lpthread -o events.exe
+
+::vorbis.cpp
+g++ -std=c++11 -Wall -DFCAL_VORBIS ../fcal.cpp vorbis.cpp -lvorbisfile -lvorbis -logg -lole32 -lpthread -o vorbis.exe
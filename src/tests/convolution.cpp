@@ -0,0 +1,54 @@
+#include "../fcal.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+//Benchmarks fcal::convolver. Reports the processing cost per second of audio, normalized by the length of the impulse response, for a few
+//partition sizes. Uses the device format, so fcal is opened (but nothing is played).
+int main()
+{
+    fcal::open(50);
+
+    const char* impulse_responses[] = { "resources/ambient.wav", "resources/dance.wav" };
+    unsigned int partition_sizes[] = { 128, 256, 512, 1024 };
+
+    const unsigned int seconds = 10;
+    const unsigned int device_block = 480;
+
+    for(int i = 0; i < 2; i++)
+    {
+        fcal::audio_stream ir(impulse_responses[i]);
+        if(!ir.is_valid()) continue;
+
+        std::cout << impulse_responses[i] << " (" << ir.get_duration() << "s IR)" << std::endl;
+
+        for(int j = 0; j < 4; j++)
+        {
+            fcal::convolver conv(&ir, partition_sizes[j]);
+            if(!conv.is_valid()) continue;
+
+            unsigned int channels = conv.get_channels();
+            unsigned int frames = conv.get_sample_rate() * seconds;
+
+            std::vector<float> data(device_block * channels);
+            for(unsigned int k = 0; k < data.size(); k++)
+                data[k] = (float) (rand() % 2000 - 1000) / 1000;
+
+            auto start = std::chrono::high_resolution_clock::now();
+            for(unsigned int f = 0; f < frames; f += device_block)
+                conv.process(&data[0], device_block);
+            auto stop = std::chrono::high_resolution_clock::now();
+
+            double ms = std::chrono::duration<double, std::milli>(stop - start).count() / seconds;
+
+            std::cout << "   Partition " << partition_sizes[j] << ": " << ms << " ms per audio second, "
+                << ms / ir.get_duration() << " ms per audio second per IR second (" << channels << " channels)" << std::endl;
+        }
+    }
+
+    fcal::close();
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include "../fcal.h"
+#include "test_utils.h"
+
+#include <iostream>
+#include <vector>
+
+//Checks playback events: the order of a voice's events over its life, cues on both sides of a loop wrap, the events of one-shots and of
+//stopped voices, and a full queue dropping new events while keeping the oldest. Renders offline, so no device is opened. Returns the number
+//of failed checks.
+
+const unsigned int rate = 8000;
+const unsigned int block = 100;
+
+//Builds a 16-bit mono .WAV file in memory holding 'frames' frames of a constant.
+std::vector<unsigned char> make_wav(unsigned int frames)
+{
+    std::vector<short> data(frames, 0x0101);
+    return build_wav(16, 1, rate, frames, &data[0]);
+}
+
+//Adds a cue at source frame 'frame'.
+void add_cue(fcal::audio_stream& stream, unsigned int frame, unsigned int id)
+{
+    stream.add_cue((float) frame / rate, id);
+}
+
+//Takes every event off the engine's queue.
+std::vector<fcal::playback_event> poll_all(fcal::engine& engine)
+{
+    std::vector<fcal::playback_event> events;
+    fcal::playback_event event;
+    while(engine.poll_event(event))
+        events.push_back(event);
+    return events;
+}
+
+//Returns true if 'events' are the types and values listed in 'expected' (type, value, type, value...), all for 'stream' on 'source'.
+bool same_events(const std::vector<fcal::playback_event>& events, const unsigned int* expected, unsigned int count, fcal::audio_source* source,
+    fcal::audio_stream* stream)
+{
+    if(events.size() != count) return false;
+
+    for(unsigned int i = 0; i < count; i++)
+        if(events[i].type != expected[i * 2] || events[i].value != expected[i * 2 + 1] || events[i].source != source ||
+            events[i].stream != stream)
+            return false;
+
+    return true;
+}
+
+int main()
+{
+    fcal::disable_info_print();
+    int failed = 0;
+
+    fcal::engine engine;
+    engine.open_offline(rate, 1);
+
+    fcal::audio_source source;
+    engine.register_source(&source);
+    std::vector<float> out(block);
+
+    //A two-and-a-half-block stream that loops once, with a cue early in the stream and one just before its end. The wrap happens halfway
+    //through the third block, and the voice ends in the block after its last frame.
+    std::vector<unsigned char> wav = make_wav(250);
+    fcal::audio_stream looped(&wav[0], wav.size());
+    add_cue(looped, 50, 1);
+    add_cue(looped, 230, 2);
+    looped.set_loop_count(1);
+    looped.toggle_flag(FCAL_STRF_LOOP);
+
+    source.play(&looped);
+    for(unsigned int b = 0; b < 8; b++)
+        engine.render(&out[0], block);
+
+    const unsigned int life[] = { FCAL_EVENT_STARTED, 0, FCAL_EVENT_CUE, 1, FCAL_EVENT_CUE, 2, FCAL_EVENT_LOOPED, 1, FCAL_EVENT_CUE, 1,
+        FCAL_EVENT_CUE, 2, FCAL_EVENT_ENDED, 0 };
+    failed += !report("events in order", same_events(poll_all(engine), life, 7, &source, &looped));
+
+    //A loop from frame 100 to 250, with cues just after its start and just before its end. The third block wraps, passing the cue before the
+    //end, then the one after the start: they come on either side of the loop event.
+    std::vector<unsigned char> long_wav = make_wav(300);
+    fcal::audio_stream region(&long_wav[0], long_wav.size());
+    region.set_loop_points(100, 250);
+    add_cue(region, 120, 3);
+    add_cue(region, 240, 4);
+    region.toggle_flag(FCAL_STRF_LOOP);
+
+    source.play(&region);
+    for(unsigned int b = 0; b < 2; b++)
+        engine.render(&out[0], block);
+    poll_all(engine);
+
+    engine.render(&out[0], block);
+    const unsigned int wrap[] = { FCAL_EVENT_CUE, 4, FCAL_EVENT_LOOPED, 1, FCAL_EVENT_CUE, 3 };
+    failed += !report("cues across a loop wrap", same_events(poll_all(engine), wrap, 3, &source, &region));
+
+    //A stopped voice ends with a value of 1, whether it was playing or was stopped before its first block.
+    source.stop(&region);
+    engine.render(&out[0], block);
+    const unsigned int stopped[] = { FCAL_EVENT_ENDED, 1 };
+    bool stop_ok = same_events(poll_all(engine), stopped, 1, &source, &region);
+
+    source.play(&region);
+    source.stop(&region);
+    engine.render(&out[0], block);
+    failed += !report("stop posts ended", stop_ok && same_events(poll_all(engine), stopped, 1, &source, &region));
+
+    //One-shots post events too, with no source.
+    fcal::audio_stream shot(&wav[0], wav.size());
+    add_cue(shot, 120, 5);
+    engine.play_oneshot(&shot);
+    for(unsigned int b = 0; b < 4; b++)
+        engine.render(&out[0], block);
+
+    const unsigned int oneshot[] = { FCAL_EVENT_STARTED, 0, FCAL_EVENT_CUE, 5, FCAL_EVENT_ENDED, 0 };
+    failed += !report("one-shot events", same_events(poll_all(engine), oneshot, 3, NULL, &shot));
+
+    //A cue on every frame of a 2000-frame stream, never polled while it plays, overflows the queue: the first FCAL_EVENT_CAPACITY events
+    //are kept in order, the rest are dropped, and events are queued again once it's drained.
+    std::vector<unsigned char> cued_wav = make_wav(2000);
+    fcal::audio_stream cued(&cued_wav[0], cued_wav.size());
+    for(unsigned int f = 0; f < 2000; f++)
+        add_cue(cued, f, f);
+
+    source.play(&cued);
+    for(unsigned int b = 0; b < 22; b++)
+        engine.render(&out[0], block);
+
+    std::vector<fcal::playback_event> events = poll_all(engine);
+    bool kept = events.size() == FCAL_EVENT_CAPACITY && events[0].type == FCAL_EVENT_STARTED;
+    for(unsigned int i = 1; kept && i < events.size(); i++)
+        kept = events[i].type == FCAL_EVENT_CUE && events[i].value == i - 1;
+
+    source.play(&looped);
+    engine.render(&out[0], block);
+    events = poll_all(engine);
+    failed += !report("full queue drops new events", kept && !events.empty() && events[0].type == FCAL_EVENT_STARTED);
+
+    source.stop(&looped);
+    engine.render(&out[0], block);
+    engine.remove_source(&source);
+    engine.close();
+
+    return failed;
+}
@@ -0,0 +1,206 @@
+#include "../fcal.h"
+#include "test_utils.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+//Checks loop regions: a stream plays its loop the set number of times and then on to its end, the crossfade splices the end of the loop into
+//the frames before its start, loop points are read from smpl chunks, and new loop points apply to a stream that's already playing. Renders
+//offline at each asset's own rate, so every output sample is one source sample and no device is opened. Returns the number of failed checks.
+
+const unsigned int block = 441;
+
+//Plays 'stream' on a source of 'engine' and renders until it ends (or 'limit' frames), including the block in which it ends.
+std::vector<float> render_all(fcal::engine& engine, fcal::audio_stream& stream, unsigned int limit)
+{
+    unsigned int channels = engine.get_format().nChannels;
+
+    fcal::audio_source source;
+    engine.register_source(&source);
+    source.play(&stream);
+
+    std::vector<float> out;
+    std::vector<float> data(block * channels);
+    while(out.size() < limit * channels)
+    {
+        engine.render(&data[0], block);
+        out.insert(out.end(), data.begin(), data.end());
+        if(!source.is_playing()) break;
+    }
+
+    engine.remove_source(&source);
+    return out;
+}
+
+//Returns the largest difference between 'out' and the source frames 'order' lists, taken from 'plain'. Everything 'out' holds past them
+//must be silent, and no more than the two blocks it takes to notice the end.
+double worst_error(const std::vector<float>& out, const std::vector<float>& plain, const std::vector<unsigned int>& order, unsigned int channels)
+{
+    if(out.size() < order.size() * channels || out.size() > (order.size() + block * 2) * channels) return 1;
+
+    double worst = 0;
+    for(unsigned int i = 0; i < out.size(); i++)
+    {
+        float expected = i < order.size() * channels ? plain[order[i / channels] * channels + i % channels] : 0;
+        double error = std::fabs(out[i] - expected);
+        if(error > worst) worst = error;
+    }
+
+    return worst;
+}
+
+//Appends the source frames from 'first' up to 'last' (exclusive) to 'order'.
+void append(std::vector<unsigned int>& order, unsigned int first, unsigned int last)
+{
+    for(unsigned int f = first; f < last; f++)
+        order.push_back(f);
+}
+
+//Builds a 16-bit mono .WAV file in memory whose frame i holds i / 32768, with a smpl chunk looping from 'start' up to 'end'.
+std::vector<unsigned char> make_ramp_wav(unsigned int frames, unsigned int rate, unsigned int start, unsigned int end)
+{
+    std::vector<short> ramp(frames);
+    for(unsigned int i = 0; i < frames; i++)
+        ramp[i] = (short) i;
+    return build_wav(16, 1, rate, frames, &ramp[0], start, end);
+}
+
+int main()
+{
+    fcal::disable_info_print();
+    int failed = 0;
+
+    const char* files[] = { "resources/jingle 16bit mono.wav", "resources/jingle 24bit stereo.wav" };
+    for(int i = 0; i < 2; i++)
+    {
+        fcal::audio_stream plain_stream(files[i]);
+        if(!plain_stream.is_valid())
+        {
+            std::cout << files[i] << ": couldn't open" << std::endl;
+            failed++;
+            continue;
+        }
+
+        WAVEFORMATEX format = plain_stream.get_format();
+        unsigned int channels = format.nChannels;
+        unsigned int total = (unsigned int) std::floor(plain_stream.get_duration() * format.nSamplesPerSec + 0.5);
+
+        fcal::engine engine;
+        engine.open_offline(format.nSamplesPerSec, channels);
+
+        std::vector<float> plain = render_all(engine, plain_stream, total * 2);
+        plain.resize(total * channels);
+
+        std::cout << files[i] << std::endl;
+
+        //The smpl chunks of these files loop the whole asset.
+        failed += !report("  smpl loop points", plain_stream.get_loop_start() == 0 && plain_stream.get_loop_end() == total);
+
+        //Streamed from the file, then resident, as the loop head is cached differently for each.
+        for(int resident = 0; resident < 2; resident++)
+        {
+            unsigned int start = total / 4, end = total * 3 / 4;
+
+            fcal::audio_stream counted(files[i]);
+            if(resident) counted.load_resident();
+            counted.set_loop_points(start, end);
+            counted.set_loop_count(2);
+            counted.toggle_flag(FCAL_STRF_LOOP);
+
+            std::vector<unsigned int> order;
+            append(order, 0, end);
+            append(order, start, end);
+            append(order, start, total);
+
+            //Resident streams skip stretches quieter than the silence threshold.
+            double error = worst_error(render_all(engine, counted, total * 4), plain, order, channels);
+            failed += !report(resident ? "  loop count, resident" : "  loop count, streamed", error <= FCAL_SILENCE_THRESHOLD);
+
+            //The last 'fade' frames of every pass but the last are blended with the frames before the loop start, and the wrap goes straight
+            //on from the blend's last frame into the loop start.
+            const unsigned int fade = 500;
+            fcal::audio_stream faded(files[i]);
+            if(resident) faded.load_resident();
+            faded.set_loop_points(start, end);
+            faded.set_loop_crossfade(fade);
+            faded.set_loop_count(1);
+            faded.toggle_flag(FCAL_STRF_LOOP);
+
+            order.clear();
+            append(order, 0, end);
+            append(order, start, total);
+
+            //Only the first pass splices, so the blend gets frames of its own past the end of the asset.
+            std::vector<float> expected(plain);
+            expected.resize((total + fade) * channels);
+            for(unsigned int f = end - fade; f < end; f++)
+                order[f] = total + f - (end - fade);
+
+            for(unsigned int f = 0; f < fade; f++)
+            {
+                float w = (float) (f + 1) / (fade + 1);
+                for(unsigned int c = 0; c < channels; c++)
+                    expected[(total + f) * channels + c] = plain[(end - fade + f) * channels + c] * (1 - w) +
+                        plain[(start - fade + f) * channels + c] * w;
+            }
+
+            //The blend is stored at the asset's bit depth.
+            double splice = worst_error(render_all(engine, faded, total * 4), expected, order, channels);
+            failed += !report(resident ? "  crossfade splice, resident" : "  crossfade splice, streamed", splice < 1.5 / 32768);
+        }
+
+        engine.close();
+    }
+
+    //smpl loop points that aren't the whole asset. The ramp makes every output sample name the source frame it came from.
+    const unsigned int rate = 8000, frames = 4000;
+    std::vector<unsigned char> wav = make_ramp_wav(frames, rate, 1000, 2000);
+    fcal::audio_stream ramp(&wav[0], wav.size());
+    failed += !report("smpl loop points", ramp.get_loop_start() == 1000 && ramp.get_loop_end() == 2000);
+
+    fcal::engine engine;
+    engine.open_offline(rate, 1);
+
+    std::vector<float> plain(frames);
+    for(unsigned int f = 0; f < frames; f++)
+        plain[f] = f / 32768.0f;
+
+    ramp.set_loop_count(1);
+    ramp.toggle_flag(FCAL_STRF_LOOP);
+
+    std::vector<unsigned int> order;
+    append(order, 0, 2000);
+    append(order, 1000, frames);
+    failed += !report("smpl loop played", worst_error(render_all(engine, ramp, frames * 2), plain, order, 1) < 1e-6);
+
+    //Loop points changed while a voice plays apply from the next block: the voice, before the old loop end, runs on to the new one.
+    fcal::audio_stream moved(&wav[0], wav.size());
+    moved.set_loop_count(1);
+    moved.toggle_flag(FCAL_STRF_LOOP);
+
+    fcal::audio_source source;
+    engine.register_source(&source);
+    source.play(&moved);
+
+    std::vector<float> out(block);
+    engine.render(&out[0], block);
+    moved.set_loop_points(2500, 3000);
+
+    std::vector<float> data(block);
+    while(source.is_playing())
+    {
+        engine.render(&data[0], block);
+        out.insert(out.end(), data.begin(), data.end());
+    }
+
+    order.clear();
+    append(order, 0, 3000);
+    append(order, 2500, frames);
+    failed += !report("loop points moved while playing", worst_error(out, plain, order, 1) < 1e-6);
+
+    engine.remove_source(&source);
+    engine.close();
+
+    return failed;
+}
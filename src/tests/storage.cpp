@@ -0,0 +1,111 @@
+#include "../fcal.h"
+#include "test_utils.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+//Checks compact resident storage: mixes each asset as read from the file, then resident as int16 and as mu-law, and compares the results
+//against the codecs' error bounds. Also checks that an 8-bit stream ends on silence, not on a click. Nothing is played, so no device is
+//opened. Returns the number of failed checks.
+
+//Mixes 'frames' frames (the whole stream if 0) in the stream's own format, so at pitch 1 every output sample is one decoded sample.
+std::vector<float> mix_all(fcal::audio_stream& stream, unsigned int frames = 0)
+{
+    WAVEFORMATEX source = stream.get_format();
+
+    WAVEFORMATEX format = source;
+    format.wFormatTag = 3; //WAVE_FORMAT_IEEE_FLOAT
+    format.wBitsPerSample = 32;
+    format.nBlockAlign = format.nChannels * 4;
+    format.nAvgBytesPerSec = format.nBlockAlign * format.nSamplesPerSec;
+
+    float gains[FCAL_MAX_CHANNELS];
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        gains[c] = 1;
+
+    if(!frames) frames = (unsigned int) std::floor(stream.get_duration() * source.nSamplesPerSec + 0.5);
+    std::vector<float> out(frames * format.nChannels, 0.0f);
+
+    fcal::play_cursor cursor = { 0, 0, 0 };
+    bool end = false;
+    for(unsigned int done = 0; done < frames; done += 4096)
+    {
+        unsigned int n = frames - done < 4096 ? frames - done : 4096;
+        stream.mix(cursor, n, &format, 1, gains, &out[done * format.nChannels], &end);
+    }
+
+    return out;
+}
+
+//Returns the largest amount by which 'b' is further from 'a' than allowed, where the allowed error is 'relative' * |a| + 'absolute'.
+double excess_error(const std::vector<float>& a, const std::vector<float>& b, double relative, double absolute)
+{
+    if(a.size() != b.size()) return 1;
+
+    double worst = 0;
+    for(unsigned int i = 0; i < a.size(); i++)
+    {
+        double excess = std::fabs(a[i] - b[i]) - (relative * std::fabs(a[i]) + absolute);
+        if(excess > worst) worst = excess;
+    }
+
+    return worst;
+}
+
+//Builds an 8-bit mono .WAV file in memory holding 'frames' frames of a constant +0.5.
+std::vector<unsigned char> make_8bit_wav(unsigned int frames)
+{
+    std::vector<unsigned char> data(frames, 192);
+    return build_wav(8, 1, 8000, frames, &data[0]);
+}
+
+int main()
+{
+    fcal::disable_info_print();
+
+    const char* files[] = { "resources/jingle 16bit stereo.wav", "resources/jingle 24bit mono.wav", "resources/jingle 32bit stereo.wav" };
+    int failed = 0;
+
+    for(int i = 0; i < 3; i++)
+    {
+        fcal::audio_stream native(files[i]), int16(files[i]), mulaw(files[i]);
+        if(!native.is_valid())
+        {
+            std::cout << files[i] << ": couldn't open" << std::endl;
+            failed++;
+            continue;
+        }
+
+        //Both conversions read the file, including int16 from a file that's already 16-bit.
+        bool loaded = int16.load_resident(FCAL_STORAGE_INT16) && int16.is_resident() && mulaw.load_resident(FCAL_STORAGE_MULAW) &&
+            mulaw.is_resident();
+
+        std::vector<float> reference = mix_all(native);
+
+        //int16 rounds to the nearest step. Mu-law truncates to a step of at most 1/16 of the biased magnitude, and clips at 32635/32768.
+        double int16_error = excess_error(reference, mix_all(int16), 0, 0.5 / 32768 + 1e-7);
+        double mulaw_error = excess_error(reference, mix_all(mulaw), 1.0 / 16, 9.0 / 32768 + (32768.0 - 32635) / 32768);
+
+        bool ok = loaded && int16_error <= 0 && mulaw_error <= 0;
+        std::cout << files[i] << ": " << (ok ? "ok" : "FAILED") << " (resident " << loaded << ", int16 excess " << int16_error
+            << ", mu-law excess " << mulaw_error << ")" << std::endl;
+        if(!ok) failed++;
+    }
+
+    //An 8-bit stream is padded with its own silence byte, so interpolating past the last frame fades to 0 instead of -1.
+    std::vector<unsigned char> wav = make_8bit_wav(1000);
+    fcal::audio_stream eight(&wav[0], wav.size());
+    eight.set_pitch(0.37f);
+
+    std::vector<float> out = mix_all(eight, 3000);
+    float lowest = 1;
+    for(unsigned int i = 0; i < out.size(); i++)
+        if(out[i] < lowest) lowest = out[i];
+
+    bool ok = eight.is_valid() && !out.empty() && lowest >= 0;
+    std::cout << "8-bit end padding: " << (ok ? "ok" : "FAILED") << " (lowest sample " << lowest << ")" << std::endl;
+    if(!ok) failed++;
+
+    return failed;
+}
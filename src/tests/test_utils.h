@@ -0,0 +1,51 @@
+#ifndef FCAL_TEST_UTILS_H
+#define FCAL_TEST_UTILS_H
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+//Helpers shared by the self-checking tests.
+
+//Prints the outcome of a check and returns it, so a test can count its failures with failed += !report(...).
+inline bool report(const char* name, bool ok)
+{
+    std::cout << name << ": " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+/*
+Builds a PCM .WAV file in memory: 'frames' frames of 'channels' channels of 'bits'-bit samples at 'rate' Hz. 'data' holds the samples as
+they're stored in the file (silence if NULL). If 'loop_end' is past 'loop_start', a smpl chunk loops the frames from 'loop_start' up to
+'loop_end' (exclusive).
+*/
+inline std::vector<unsigned char> build_wav(unsigned int bits, unsigned int channels, unsigned int rate, unsigned int frames,
+    const void* data = NULL, unsigned int loop_start = 0, unsigned int loop_end = 0)
+{
+    unsigned int align = channels * bits / 8;
+    unsigned int bytes = frames * align;
+    bool looped = loop_end > loop_start;
+
+    unsigned int format[] = { 0x20746D66, 16, 0x00000001 | channels << 16, rate, rate * align, align | bits << 16 };
+    unsigned int smpl[] = { 0x6C706D73, 60, 0, 0, 1000000000 / rate, 60, 0, 0, 0, 1, 0, 0, 0, loop_start, loop_end - 1, 0, 0 };
+    unsigned int chunk[] = { 0x61746164, bytes };
+    unsigned int smpl_size = looped ? sizeof(smpl) : 0;
+    unsigned int size = sizeof(format) + smpl_size + sizeof(chunk) + bytes;
+    unsigned int riff[] = { 0x46464952, 4 + size, 0x45564157 };
+
+    std::vector<unsigned char> wav(sizeof(riff) + size, bits == 8 ? 128 : 0);
+    unsigned char* p = &wav[0];
+    memcpy(p, riff, sizeof(riff));
+    p += sizeof(riff);
+    memcpy(p, format, sizeof(format));
+    p += sizeof(format);
+    if(looped) memcpy(p, smpl, sizeof(smpl));
+    p += smpl_size;
+    memcpy(p, chunk, sizeof(chunk));
+    p += sizeof(chunk);
+    if(data) memcpy(p, data, bytes);
+
+    return wav;
+}
+
+#endif
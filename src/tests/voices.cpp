@@ -0,0 +1,151 @@
+#include "../fcal.h"
+#include "test_utils.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+//Checks a source's voice table: voices that end or are stopped are swapped out without disturbing the others, the table grows past its
+//first capacity while playing, a play and a stop of the same stream in one block apply in that order, and a seek restarts the loop count.
+//Then times a block that stops half of 20000 voices. Renders offline, so no device is opened. Returns the number of failed checks.
+
+const unsigned int rate = 8000;
+const unsigned int block = 100;
+
+//Builds a 16-bit mono .WAV file in memory holding 'frames' frames of the constant 'value' / 32768.
+std::vector<unsigned char> make_wav(unsigned int frames, short value)
+{
+    std::vector<short> data(frames, value);
+    return build_wav(16, 1, rate, frames, &data[0]);
+}
+
+int main()
+{
+    fcal::disable_info_print();
+    int failed = 0;
+
+    fcal::engine engine;
+    engine.open_offline(rate, 1);
+
+    //Voice i holds i + 1 and lasts a different number of blocks, so voices end out of play order. They're started a few per block, so the
+    //table is replaced while others play, and every block is checked against the sum of the voices that should still be playing.
+    const unsigned int count = 100;
+    std::vector<std::vector<unsigned char> > files(count);
+    std::vector<fcal::audio_stream*> streams(count);
+    std::vector<unsigned int> first(count), last(count);
+    for(unsigned int i = 0; i < count; i++)
+    {
+        first[i] = i / 4;
+        last[i] = first[i] + 1 + (i * 37) % 50;
+        files[i] = make_wav((last[i] - first[i]) * block, (short) (i + 1));
+        streams[i] = new fcal::audio_stream(&files[i][0], files[i].size());
+    }
+
+    fcal::audio_source source;
+    engine.register_source(&source);
+
+    bool sums = true, counts = true;
+    std::vector<float> out(block);
+    for(unsigned int b = 0; b < 80; b++)
+    {
+        for(unsigned int i = 0; i < count; i++)
+            if(first[i] == b) source.play(streams[i]);
+
+        engine.render(&out[0], block);
+
+        unsigned int expected = 0, playing = 0;
+        for(unsigned int i = 0; i < count; i++)
+        {
+            if(b >= first[i] && b < last[i]) expected += i + 1;
+            if(b >= first[i] && b + 1 < last[i]) playing++;
+        }
+
+        for(unsigned int f = 0; f < block; f++)
+            if(std::fabs(out[f] * 32768 - expected) > 0.01f) sums = false;
+        if(source.get_stream_list_size() != playing) counts = false;
+    }
+
+    failed += !report("swap-remove keeps the mix", sums);
+    failed += !report("voice count follows ends", counts && !source.is_playing());
+
+    //A stop then a play of the same stream restarts it, a play then a stop before the block never sounds, and a stop only ends one voice.
+    std::vector<unsigned char> long_file = make_wav(rate * 10, 1000);
+    fcal::audio_stream restarted(&long_file[0], long_file.size()), cancelled(&long_file[0], long_file.size());
+    fcal::audio_stream doubled(&long_file[0], long_file.size());
+
+    source.play(&restarted);
+    for(unsigned int b = 0; b < 10; b++)
+        engine.render(&out[0], block);
+
+    source.stop(&restarted);
+    source.play(&restarted);
+    source.play(&cancelled);
+    source.stop(&cancelled);
+    engine.render(&out[0], block);
+
+    float position = source.tell(&restarted) * rate;
+    failed += !report("stop and play restarts", std::fabs(position - block) < 0.5f && source.get_stream_list_size() == 1);
+    failed += !report("play and stop never sounds", source.tell(&cancelled) < 0 && std::fabs(out[0] * 32768 - 1000) < 0.01f);
+
+    source.play(&doubled);
+    source.play(&doubled);
+    engine.render(&out[0], block);
+    source.stop(&doubled);
+    engine.render(&out[0], block);
+    failed += !report("stop ends one voice", source.get_stream_list_size() == 2 && std::fabs(out[0] * 32768 - 2000) < 0.01f);
+
+    source.stop(&restarted);
+    source.stop(&doubled);
+    engine.render(&out[0], block);
+
+    //A seek starts the loop count over: a two-block stream looping once, sought back to its start during its second pass, plays both passes
+    //again, and ends in the block after them, like a voice that was just started.
+    std::vector<unsigned char> loop_file = make_wav(block * 2, 1);
+    fcal::audio_stream counted(&loop_file[0], loop_file.size());
+    counted.toggle_flag(FCAL_STRF_LOOP);
+    counted.set_loop_count(1);
+
+    source.play(&counted);
+    for(unsigned int b = 0; b < 3; b++)
+        engine.render(&out[0], block);
+
+    source.seek(&counted, 0);
+    unsigned int blocks = 0;
+    while(source.is_playing() && blocks < 10)
+    {
+        engine.render(&out[0], block);
+        blocks++;
+    }
+    failed += !report("seek restarts the loop count", blocks == 5);
+
+    //Every stop removes the first voice playing the stream, which is the worst case for removing from the middle of an array.
+    std::vector<unsigned char> short_file = make_wav(block, 1);
+    fcal::audio_stream looped(&short_file[0], short_file.size());
+    looped.toggle_flag(FCAL_STRF_LOOP);
+
+    for(unsigned int i = 0; i < 20000; i++)
+        source.play(&looped);
+    engine.render(&out[0], block);
+
+    for(unsigned int i = 0; i < 10000; i++)
+        source.stop(&looped);
+    auto start = std::chrono::high_resolution_clock::now();
+    engine.render(&out[0], block);
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    failed += !report("stopping half of 20000 voices", source.get_stream_list_size() == 10000);
+    std::cout << "Block stopping 10000 of 20000 voices: " << std::chrono::duration<double, std::milli>(stop - start).count() << " ms"
+        << std::endl;
+
+    for(unsigned int i = 0; i < 10000; i++)
+        source.stop(&looped);
+    engine.render(&out[0], block);
+    engine.remove_source(&source);
+    engine.close();
+
+    for(unsigned int i = 0; i < count; i++)
+        delete streams[i];
+
+    return failed;
+}
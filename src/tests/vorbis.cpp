@@ -0,0 +1,105 @@
+#include "../fcal.h"
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+//Benchmarks streaming Ogg Vorbis decoding (fcal must be compiled with FCAL_VORBIS) on the .ogg file given on the command line, or
+//resources/jingle vorbis.ogg. Renders a number of voices in 10 ms blocks, each voice started at a different point of the file: with a
+//stream per voice, with every voice on one stream, and from resident (already decoded) copies. Reports the decoding cost per voice per
+//block, and checks that voices sharing a stream mix exactly like voices with a stream each. Renders offline, so no device is opened.
+//Returns the number of failed checks.
+
+const unsigned int rate = 48000;
+const unsigned int block = 480;
+const unsigned int seconds = 10;
+
+//Plays 'voices' voices of 'path', each on its own source and sought to v / voices of the way through, and renders 'seconds' of them into
+//'mixed'. With 'shared', every voice plays the same stream. Returns the time spent rendering per voice per block, in ms, or -1 if the file
+//couldn't be opened.
+double run(const char* path, unsigned int voices, bool shared, bool resident, std::vector<float>& mixed)
+{
+    fcal::engine engine;
+    engine.open_offline(rate, 2);
+
+    std::vector<fcal::audio_stream*> streams;
+    std::vector<fcal::audio_source*> sources;
+    for(unsigned int v = 0; v < voices; v++)
+    {
+        if(!shared || v == 0)
+        {
+            streams.push_back(new fcal::audio_stream(path));
+            streams.back()->toggle_flag(FCAL_STRF_LOOP);
+            if(resident) streams.back()->load_resident();
+        }
+
+        sources.push_back(new fcal::audio_source());
+        engine.register_source(sources[v]);
+    }
+
+    double ms = -1;
+    if(streams[0]->is_valid())
+    {
+        for(unsigned int v = 0; v < voices; v++)
+        {
+            fcal::audio_stream* stream = streams[shared ? 0 : v];
+            sources[v]->play(stream);
+            sources[v]->seek(stream, stream->get_duration() * v / voices);
+        }
+
+        unsigned int blocks = seconds * rate / block;
+        mixed.assign(blocks * block * 2, 0.0f);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for(unsigned int b = 0; b < blocks; b++)
+            engine.render(&mixed[b * block * 2], block);
+        auto stop = std::chrono::high_resolution_clock::now();
+
+        ms = std::chrono::duration<double, std::milli>(stop - start).count() / blocks / voices;
+    }
+
+    for(unsigned int v = 0; v < voices; v++)
+    {
+        engine.remove_source(sources[v]);
+        delete sources[v];
+    }
+    engine.close();
+
+    for(unsigned int i = 0; i < streams.size(); i++)
+        delete streams[i];
+
+    return ms;
+}
+
+int main(int argc, char** argv)
+{
+    fcal::disable_info_print();
+
+    const char* path = argc > 1 ? argv[1] : "resources/jingle vorbis.ogg";
+    unsigned int voice_counts[] = { 1, 8, 32 };
+    int failed = 0;
+
+    for(int i = 0; i < 3; i++)
+    {
+        unsigned int voices = voice_counts[i];
+        std::vector<float> separate, together, resident;
+
+        double streamed = run(path, voices, false, false, separate);
+        if(streamed < 0)
+        {
+            std::cerr << "Couldn't open " << path << " (is fcal compiled with FCAL_VORBIS?)" << std::endl;
+            return 1;
+        }
+        double shared = run(path, voices, true, false, together);
+        double decoded = run(path, voices, false, true, resident);
+
+        bool same = separate == together;
+        std::cout << voices << " voices: " << streamed << " ms per voice per block streamed, " << shared << " ms on one stream, " << decoded
+            << " ms resident, " << streamed - decoded << " ms decoding (" << (int) (10 / streamed) << " streamed voices per 10 ms block)"
+            << std::endl;
+        std::cout << voices << " voices on one stream: " << (same ? "ok" : "FAILED") << std::endl;
+        if(!same) failed++;
+    }
+
+    return failed;
+}
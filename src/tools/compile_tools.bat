@@ -0,0 +1,4 @@
+::Compiles with MinGW_w64.
+
+::pack.cpp
+g++ -std=c++11 -Wall ../fcal.cpp pack.cpp -lole32 -lpthread -o pack.exe
@@ -0,0 +1,230 @@
+#include "../fcal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+Offline sound bank packer. Concatenates .WAV files into one fcal sound bank, optionally converting every asset to a target sample rate, bit
+depth and channel count so no conversion is needed at runtime.
+
+Usage: pack <output bank> [-rate <hz>] [-bits <8|16|24|32>] [-channels <n>] <input.wav> [<input.wav> ...]
+
+Assets are named after their file name, without the directory or extension. Each asset's peak map (the largest magnitude in every block of
+FCAL_PEAK_BLOCK_FRAMES frames, which lets the mixer skip silent stretches) is stored after all the sample data.
+*/
+
+struct packed_asset
+{
+    fcal::bank_entry entry;
+    std::vector<unsigned char> data;
+    std::vector<float> peaks;
+};
+
+//Encodes floats to little-endian PCM (8-bit unsigned, 16/24-bit signed) or 32-bit floats, clipping to the valid range.
+void encode_floats(std::vector<unsigned char>& out, const float* floats, unsigned int count, unsigned int bits)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        float f = floats[i];
+        if(f > 1) f = 1;
+        if(f < -1) f = -1;
+
+        int si;
+        switch(bits)
+        {
+            case 8:
+                si = (int) std::floor(f * 128 + 0.5f) + 128;
+                if(si > 255) si = 255;
+                out.push_back(si);
+                break;
+            case 16:
+                si = (int) std::floor(f * 32768 + 0.5f);
+                if(si > 32767) si = 32767;
+                out.push_back(si);
+                out.push_back(si >> 8);
+                break;
+            case 24:
+                si = (int) std::floor(f * 8388608 + 0.5f);
+                if(si > 8388607) si = 8388607;
+                out.push_back(si);
+                out.push_back(si >> 8);
+                out.push_back(si >> 16);
+                break;
+            default:
+                unsigned char* p = reinterpret_cast<unsigned char*>(&f);
+                out.insert(out.end(), p, p + 4);
+                break;
+        }
+    }
+}
+
+std::string asset_name(std::string path)
+{
+    size_t slash = path.find_last_of("/\\");
+    if(slash != std::string::npos) path = path.substr(slash + 1);
+    size_t dot = path.find_last_of('.');
+    if(dot != std::string::npos) path = path.substr(0, dot);
+    return path;
+}
+
+bool pack_asset(std::string path, unsigned int rate, unsigned int bits, unsigned int channels, packed_asset& asset)
+{
+    fcal::audio_stream stream(path);
+    if(!stream.is_valid()) return false;
+
+    WAVEFORMATEX source = stream.get_format();
+
+    WAVEFORMATEX target = source;
+    if(rate) target.nSamplesPerSec = rate;
+    if(bits) target.wBitsPerSample = bits;
+    if(channels) target.nChannels = channels;
+    target.wFormatTag = target.wBitsPerSample == 32 ? 3 : 1; //WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM
+    target.nBlockAlign = target.nChannels * target.wBitsPerSample / 8;
+    target.nAvgBytesPerSec = target.nBlockAlign * target.nSamplesPerSec;
+
+    //Converted through the same path the library plays streams with.
+    unsigned int frames = (unsigned int) std::floor(stream.get_duration() * target.nSamplesPerSec + 0.5);
+    unsigned int chunk = 4096;
+    fcal::play_cursor cursor = { 0, 0 };
+    bool end = false;
+
+    float gains[FCAL_MAX_CHANNELS];
+    for(unsigned int c = 0; c < FCAL_MAX_CHANNELS; c++)
+        gains[c] = 1;
+
+    //Peaks are measured on the clipped floats, plus one step of the target format, so rounding in encode_floats() can't exceed them.
+    float step = target.wBitsPerSample == 32 ? 0 : 1.0f / (1 << (target.wBitsPerSample - 1));
+    asset.peaks.assign((frames + FCAL_PEAK_BLOCK_FRAMES - 1) / FCAL_PEAK_BLOCK_FRAMES, 0.0f);
+
+    std::vector<float> data(chunk * target.nChannels);
+    for(unsigned int done = 0; done < frames; done += chunk)
+    {
+        unsigned int n = frames - done < chunk ? frames - done : chunk;
+        std::fill(data.begin(), data.end(), 0.0f);
+        stream.mix(cursor, n, &target, 1, gains, &data[0], &end);
+        encode_floats(asset.data, &data[0], n * target.nChannels, target.wBitsPerSample);
+
+        for(unsigned int i = 0; i < n * target.nChannels; i++)
+        {
+            float v = std::min(std::fabs(data[i]), 1.0f) + step;
+            float& peak = asset.peaks[(done + i / target.nChannels) / FCAL_PEAK_BLOCK_FRAMES];
+            if(v > peak) peak = v;
+        }
+    }
+
+    memset(&asset.entry, 0, sizeof(asset.entry));
+    std::string name = asset_name(path);
+    strncpy(asset.entry.name, name.c_str(), sizeof(asset.entry.name) - 1);
+    asset.entry.format_tag = target.wFormatTag;
+    asset.entry.channels = target.nChannels;
+    asset.entry.sample_rate = target.nSamplesPerSec;
+    asset.entry.bits_per_sample = target.wBitsPerSample;
+    asset.entry.data_length = asset.data.size();
+
+    //Loop points are kept, moved to the target sample rate.
+    double ratio = (double) target.nSamplesPerSec / source.nSamplesPerSec;
+    asset.entry.loop_start = (unsigned int) std::floor(stream.get_loop_start() * ratio + 0.5);
+    asset.entry.loop_end = (unsigned int) std::floor(stream.get_loop_end() * ratio + 0.5);
+    if(asset.entry.loop_end > frames) asset.entry.loop_end = frames;
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+    {
+        std::cerr << "Usage: pack <output bank> [-rate <hz>] [-bits <8|16|24|32>] [-channels <n>] <input.wav> [<input.wav> ...]" << std::endl;
+        return 1;
+    }
+
+    unsigned int rate = 0, bits = 0, channels = 0;
+    std::vector<packed_asset> assets;
+
+    for(int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg == "-rate" && i + 1 < argc) { rate = atoi(argv[++i]); continue; }
+        if(arg == "-bits" && i + 1 < argc) { bits = atoi(argv[++i]); continue; }
+        if(arg == "-channels" && i + 1 < argc) { channels = atoi(argv[++i]); continue; }
+
+        if(bits != 0 && bits != 8 && bits != 16 && bits != 24 && bits != 32)
+        {
+            std::cerr << "Unsupported bit depth: " << bits << std::endl;
+            return 1;
+        }
+
+        packed_asset asset;
+        if(!pack_asset(arg, rate, bits, channels, asset))
+        {
+            std::cerr << "Skipping " << arg << std::endl;
+            continue;
+        }
+
+        std::cout << asset.entry.name << ": " << asset.entry.sample_rate << " Hz, " << asset.entry.bits_per_sample << "-bit, "
+            << asset.entry.channels << " channels, " << asset.entry.data_length << " bytes" << std::endl;
+        assets.push_back(asset);
+    }
+
+    fcal::bank_header header;
+    memcpy(header.magic, "FCSB", 4);
+    header.version = FCAL_BANK_VERSION;
+    header.count = assets.size();
+    header.alignment = FCAL_BANK_ALIGNMENT;
+
+    //Lay out the data after the index, each asset aligned.
+    unsigned int offset = sizeof(fcal::bank_header) + assets.size() * sizeof(fcal::bank_entry);
+    for(unsigned int i = 0; i < assets.size(); i++)
+    {
+        offset = (offset + FCAL_BANK_ALIGNMENT - 1) / FCAL_BANK_ALIGNMENT * FCAL_BANK_ALIGNMENT;
+        assets[i].entry.data_offset = offset;
+        offset += assets[i].entry.data_length;
+    }
+
+    //Then the peak maps, as floats.
+    for(unsigned int i = 0; i < assets.size(); i++)
+    {
+        offset = (offset + 3) / 4 * 4;
+        assets[i].entry.peak_offset = offset;
+        assets[i].entry.peak_blocks = assets[i].peaks.size();
+        offset += assets[i].peaks.size() * sizeof(float);
+    }
+
+    FILE* file = fopen(argv[1], "wb");
+    if(!file)
+    {
+        std::cerr << "Couldn't write " << argv[1] << std::endl;
+        return 1;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    for(unsigned int i = 0; i < assets.size(); i++)
+        fwrite(&assets[i].entry, sizeof(fcal::bank_entry), 1, file);
+
+    for(unsigned int i = 0; i < assets.size(); i++)
+    {
+        static const unsigned char padding[FCAL_BANK_ALIGNMENT] = { 0 };
+        fwrite(padding, 1, assets[i].entry.data_offset - ftell(file), file);
+        if(!assets[i].data.empty())
+            fwrite(&assets[i].data[0], 1, assets[i].data.size(), file);
+    }
+
+    for(unsigned int i = 0; i < assets.size(); i++)
+    {
+        static const unsigned char padding[4] = { 0 };
+        fwrite(padding, 1, assets[i].entry.peak_offset - ftell(file), file);
+        if(!assets[i].peaks.empty())
+            fwrite(&assets[i].peaks[0], sizeof(float), assets[i].peaks.size(), file);
+    }
+
+    fclose(file);
+
+    std::cout << "Packed " << assets.size() << " assets into " << argv[1] << " (" << offset << " bytes)." << std::endl;
+
+    return 0;
+}